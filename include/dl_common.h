@@ -2,6 +2,8 @@
 #define DL_COMMON_H
 
 #include <Arduino.h>
+#include "radio.h"
+#include "breakout.h"
 
 // Reserved bit for identifying a master
 #define MASTER_ID_FLAG         (0x80)
@@ -55,12 +57,21 @@
 #error "Invalid Board ID is defined as valid!"
 #endif
 
+// Longest a switch wait sleeps between checks, only reached before the
+// switch interrupts are attached as they wake the wait as soon as it moves
+#define SWITCH_POLL_INTERVAL (50)
+
 bool dl_common_boot(void switch_isr(void));
 
 void dl_common_finish_boot(bool boot_success);
 
 uint8_t dl_common_get_board_id(void);
 
+// Radio to use for control traffic, the test radio if only one is fitted
+LoRaModule* dl_common_ctrl_radio(void);
+
+bool dl_common_is_dual_radio(void);
+
 // Call dl_common_set_interrupts with default true argument, can be used as an
 // ISR to trigger all known common interrupts
 void dl_common_set_interrupts(void);
@@ -69,5 +80,14 @@ void dl_common_set_interrupts(bool value);
 
 bool dl_common_check_interrupts(bool clear = false);
 
+// Sleeps until the switch is in its middle position
+void dl_common_wait_switch_mid(void);
+
+// Sleeps until the switch leaves 'state', woken by the switch interrupts
+void dl_common_wait_switch_change(sw_state_t state);
+
+// Sleeps until the switch interrupts the current behaviour
+void dl_common_wait_interrupts(void);
+
 
 #endif // DL_COMMON_H
\ No newline at end of file
@@ -2,12 +2,29 @@
 #define DL_MASTER_H
 
 #include <Arduino.h>
+#include "plan.h"
 #include "radio.h"
 
+// Time given to choose with the switch whether an unfinished plan is resumed, ms
+#define RESUME_CHOICE_WINDOW (10000)
+// Period the LEDs flash at while the choice is made, ms
+#define RESUME_CHOICE_BLINK (250)
+
 bool dl_master_setup(void);
 bool dl_master_loop(void);
 void dl_master_run_testdefs(void);
-bool dl_master_run_testdef(lora_testdef_t *testdef, uint16_t* recv_packets, File* log_file);
+// Asks the operator whether to resume the unfinished plan in 'results_path'
+// with the switch, returning false to start a new plan instead
+bool dl_master_choose_resume(const char *results_path);
+// Remove testdefs already journaled as complete from a plan being resumed
+uint16_t dl_master_skip_completed(plan_key_t plan[], uint16_t testdef_cnt, 
+                                  uint16_t *packets_at_level, bool *gave_up);
+// Upper bound on the time to run a plan, including its control traffic
+uint32_t dl_master_predict_duration(plan_key_t plan[], uint16_t testdef_cnt, lora_cfg_t *ctrl_cfg,
+                                    uint8_t parallel = 1, uint8_t slot_cnt = 1);
+// Receive a batch of testdefs at once, returning the total packets received
+uint16_t dl_master_run_batch(lora_testdef_t testdefs[], uint8_t cnt, uint8_t slave_ids[], 
+                             uint8_t slave_cnt, File *log_file, File *journal, uint32_t start_time);
 void dl_master_send_heartbeats(void);
 
 #endif // DL_MASTER_H
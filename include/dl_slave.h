@@ -2,10 +2,15 @@
 #define DL_SLAVE_H
 
 #include <Arduino.h>
+#include "radio.h"
 
 bool dl_slave_setup(void);
 bool dl_slave_loop(void);
 void dl_slave_recv_and_execute_cmd(void);
 bool dl_slave_handle_testdef_cmd(uint8_t master_id);
+bool dl_slave_handle_plan_cmd(uint8_t master_id);
+// Send a batch of testdefs at once, one per test radio
+bool dl_slave_send_batch(lora_testdef_t testdefs[], uint8_t cnt, uint32_t start_time, 
+                         uint8_t slot, uint8_t slot_cnt);
 
 #endif // DL_SLAVE_H
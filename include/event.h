@@ -0,0 +1,33 @@
+/*
+  Waiting on interrupts. Interrupt handlers signal that something happened,
+  such as a radio finishing a packet or the switch moving, and a wait sleeps
+  until then rather than polling. On the device the core sleeps with WFI
+  between interrupts, host builds block on a condition variable.
+
+  Each source has its own event bit so waiting on one never consumes
+  another's signal. A wait clears the bits it returns, which any later wait
+  on the same bits would also have been woken by, so callers always recheck
+  what they wait for on return, in a loop.
+*/
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdint.h>
+
+// A radio interrupt, or a radio wait being asked to give up
+#define EVENT_RADIO  (0x01)
+// The switch moved
+#define EVENT_SWITCH (0x02)
+
+// Longest a single wait sleeps for, waits also end on any of their events
+#define EVENT_WAIT_FOREVER (UINT32_MAX)
+
+// Wakes the current or next wait on any of 'events', safe to call from interrupts
+void event_signal(uint8_t events);
+// Sleeps until one of 'events' is signalled or the timeout passes, ms, returning
+// and clearing those signalled. A signal given since the last wait on it ends
+// this one straight away, so a condition checked before waiting can't be missed
+uint8_t event_wait(uint8_t events, uint32_t timeout);
+
+#endif // EVENT_H
@@ -0,0 +1,53 @@
+#ifndef PLAN_H
+#define PLAN_H
+
+// Shared with the host plan compiler so must not depend on Arduino
+#include <stdint.h>
+#include "testdef.h"
+
+// Largest plan the master can order, only compact keys are held for each
+#define MAX_PLAN_TESTDEFS (2048)
+// Maximum number of testdefs executed between plan syncs
+#define PLAN_MAX_BLOCK_LEN (16)
+
+/*
+  Compact stand-in for a testdef holding only what is needed to order and
+  schedule a plan, the full testdef is streamed from SD when it is run.
+  The configuration not held directly is packed into 'cfg_order' so that
+  comparing it orders testdefs as comparing each field would.
+*/
+typedef struct plan_key_t {
+  float freq;             // MHz
+  long bw;                // Hz
+  uint32_t slot_time;     // ms
+  uint32_t cfg_order;
+  uint16_t packet_cnt;
+  uint16_t dir_index;     // position of the testdef file in its directory
+  uint16_t variant;       // combination of a sweep's values
+  uint16_t id_hash;       // for matching an id without reopening the file
+  uint8_t exp_range;
+} plan_key_t;
+
+void plan_make_key(lora_testdef_t *testdef, uint16_t dir_index, uint16_t variant, plan_key_t *key);
+uint16_t plan_hash_id(const char *id);
+
+void plan_order_testdefs(plan_key_t keys[], uint16_t testdef_cnt, uint8_t parallel = 1);
+
+uint16_t plan_block_end(plan_key_t keys[], uint16_t testdef_cnt, uint16_t first);
+
+// Testdefs executed at the same time on separate radios, these always start
+// together and the batch lasts as long as its longest testdef
+uint16_t plan_batch_end(plan_key_t keys[], uint16_t block_end, uint16_t first, 
+                        uint8_t parallel);
+
+// Durations take the number of slaves' slots that share every packet interval
+uint32_t plan_batch_duration(plan_key_t keys[], uint16_t first, uint16_t batch_end,
+                             uint8_t slot_cnt = 1);
+
+uint32_t plan_block_duration(plan_key_t keys[], uint16_t first, uint16_t block_end, 
+                             uint8_t parallel = 1, uint8_t slot_cnt = 1);
+
+uint32_t plan_max_block_duration(plan_key_t keys[], uint16_t testdef_cnt, 
+                                 uint8_t parallel = 1, uint8_t slot_cnt = 1);
+
+#endif // PLAN_H
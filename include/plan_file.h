@@ -0,0 +1,74 @@
+/*
+  Binary plan file, a plan compiled on a host by tools/plan_compiler.cpp.
+  Shared between the firmware and host tools so must not depend on Arduino.
+
+  Layout: header | testdef records
+  Records have already been validated and are stored in the order the plan
+  runs in, so loading one is a single sequential read with no parsing.
+*/
+
+#ifndef PLAN_FILE_H
+#define PLAN_FILE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "testdef.h"
+
+// Kept in the testdef directory, which ignores files starting with '_'
+#define PLAN_FILE "_plan.lpf"
+#define PLAN_FILE_MAGIC (0x3146504C) // "LPF1"
+#define PLAN_FILE_VERSION (1)
+
+typedef struct __attribute__((packed)) plan_file_header_t {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t testdef_cnt;
+  uint8_t parallel;       // test radios the plan was ordered for
+} plan_file_header_t;
+
+typedef struct __attribute__((packed)) plan_file_testdef_t {
+  char id[TESTDEF_ID_LEN];
+  uint8_t exp_range;
+  uint16_t packet_cnt;
+  uint8_t packet_len;
+  float freq;             // MHz
+  uint8_t sf;
+  int8_t tx_dbm;
+  int32_t bw;             // Hz
+  uint8_t cr4_denom;
+  uint8_t preamble_syms;
+  uint8_t crc;
+} plan_file_testdef_t;
+
+static inline void plan_file_pack_testdef(const lora_testdef_t *testdef, plan_file_testdef_t *rec) {
+  memcpy(rec->id, testdef->id, TESTDEF_ID_LEN);
+  rec->exp_range = testdef->exp_range;
+  rec->packet_cnt = testdef->packet_cnt;
+  rec->packet_len = testdef->packet_len;
+  rec->freq = testdef->cfg.freq;
+  rec->sf = testdef->cfg.sf;
+  rec->tx_dbm = testdef->cfg.tx_dbm;
+  rec->bw = testdef->cfg.bw;
+  rec->cr4_denom = testdef->cfg.cr4_denom;
+  rec->preamble_syms = testdef->cfg.preamble_syms;
+  rec->crc = testdef->cfg.crc;
+}
+
+static inline void plan_file_unpack_testdef(const plan_file_testdef_t *rec, lora_testdef_t *testdef) {
+  memcpy(testdef->id, rec->id, TESTDEF_ID_LEN);
+  // A damaged record must not leave the id unterminated
+  testdef->id[TESTDEF_ID_LEN - 1] = '\0';
+  testdef->exp_range = rec->exp_range;
+  testdef->packet_cnt = rec->packet_cnt;
+  testdef->packet_len = rec->packet_len;
+  testdef->cfg.freq = rec->freq;
+  testdef->cfg.sf = rec->sf;
+  testdef->cfg.tx_dbm = rec->tx_dbm;
+  testdef->cfg.bw = rec->bw;
+  testdef->cfg.cr4_denom = rec->cr4_denom;
+  testdef->cfg.preamble_syms = rec->preamble_syms;
+  testdef->cfg.crc = rec->crc != 0;
+}
+
+#endif // PLAN_FILE_H
@@ -11,11 +11,20 @@
 
 #include <SdFat.h>
 
-#define TESTDEF_ID_LEN (10)
+#include "testdef.h"
 
 #define NO_TIMEOUT (0)
 #define NO_ATTEMPT_LIMIT (0)
 
+// Number of consecutive empty packet slots after which the receiver gives up
+// on a testdef, set to 0 to always wait for the last packet's slot
+#define RX_MAX_EMPTY_SLOTS (16)
+
+// Most radios a node can use for test traffic at once, limited by the three
+// interrupt driven instances the RF95 driver supports as one may hold the
+// control channel
+#define MAX_TEST_RADIOS (2)
+
 /*
   Helper structure for holding information required to setup
   a unique RF95 LoRa radio.
@@ -27,37 +36,6 @@ typedef struct lora_module_t {
     uint8_t pin_int;
 } lora_module_t;
 
-/*
-  Full LoRa radio configuration. It is likely that many of the
-  fields will be the same across various configurations.
-  Those denoted by (!) can be different between nodes, the others
-  must be consistent.
-*/
-typedef struct lora_cfg_t {
-  float freq;             // MHz
-  uint8_t sf;
-  int8_t tx_dbm;          // (!)
-  long bw;                // Hz 
-  uint8_t cr4_denom;      // (4 / Val) (!)
-  uint8_t preamble_syms;
-  bool crc;               // (!)
-} lora_cfg_t;
-
-/*
-  Full definition for a packet test.
-*/
-typedef struct lora_testdef_t {
-  char id[TESTDEF_ID_LEN];
-  // An arbitary user chosen value, can be used to discard testdefs
-  // that are almost guarenteed to fail
-  uint8_t exp_range; 
-  uint16_t packet_cnt;
-  uint8_t packet_len;
-  lora_cfg_t cfg;
-  uint8_t master_id;
-  uint8_t slave_id;
-} lora_testdef_t;
-
 /*
   Types of message that can be sent by the mutual radio interface.
   This is designed to be part of the RadioHead packet payload and
@@ -73,6 +51,11 @@ typedef enum radio_msg_type_t {
   msg_test_testdef, // Packet contains test definition
   msg_test_packet,  // Test packet
   msg_heartbeat,    // Heartbeat packet
+  msg_plan_qry,     // Query if ready to receive a plan
+  msg_plan_frag,    // Packet contains a fragment of a plan
+  msg_plan_sync,    // Packet contains the next block of a plan to execute
+  msg_ctrl_cfg,     // Packet contains the configuration to use for control traffic
+  msg_plan_abort,   // Abandon the rest of the plan
 } radio_msg_type_t;
 
 /*
@@ -82,6 +65,7 @@ typedef enum radio_cmd_t {
   cmd_invalid = 0,  // Unconfigured message  
   cmd_testdef,
   cmd_heartbeat,
+  cmd_plan,
 } radio_cmd_t;
 
 /*
@@ -103,8 +87,70 @@ typedef struct radio_msg_t {
 
 #define LEN_MSG_TESTDEF LEN_MSG_WITH_PAYLOAD(sizeof(lora_testdef_t))
 
-#define MIN_TESTDEF_PACKET_LEN (RH_RF95_HEADER_LEN + LEN_MSG_EMPTY)
-#define MAX_TESTDEF_PACKET_LEN (RH_MAX_MESSAGE_LEN)
+/*
+  Link quality as heard by a slave, returned in a RDY! so the master
+  knows the quality of both directions of the link. The slave also
+  reports how many testdefs it can transmit at once.
+*/
+typedef struct radio_link_report_t {
+  int8_t snr;             // dB
+  int16_t rssi;           // dBm
+  uint8_t test_radios;
+} radio_link_report_t;
+
+#define LEN_MSG_RDY LEN_MSG_WITH_PAYLOAD(sizeof(radio_link_report_t))
+#define LEN_MSG_CTRL_CFG LEN_MSG_WITH_PAYLOAD(sizeof(lora_cfg_t))
+
+// Fastest spreading factor that can be negotiated for control traffic
+#define CTRL_MIN_SF (7)
+// Required margin above the demodulation floor for a control configuration
+#define CTRL_SNR_MARGIN_DB (10)
+
+/*
+  Header of a plan fragment, followed directly by 'cnt' consecutive
+  testdefs of the plan starting from index 'first'. Every enrolled slave
+  first receives a fragment with no testdefs announcing the plan along with
+  its own transmission slot, each packet interval is split into 'slot_cnt'
+  slots so slaves never send together. The testdefs of each block are then
+  sent just before its sync so no node has to hold the whole plan.
+*/
+typedef struct radio_plan_frag_t {
+  uint16_t total;
+  uint16_t first;
+  uint8_t cnt;
+  uint8_t slot;
+  uint8_t slot_cnt;
+  uint32_t max_block_duration; // ms, longest block of the plan in a single slot
+} radio_plan_frag_t;
+
+/*
+  Instruction to execute a block of a plan. Both nodes step through the
+  block autonomously from the agreed start time, executing up to 'parallel'
+  testdefs at once. A 'next' index equal to or beyond the plan length
+  signals the end of the plan.
+*/
+typedef struct radio_plan_sync_t {
+  uint16_t next;
+  uint16_t cnt;
+  uint8_t parallel;
+  uint32_t start_delay; // ms from the end of this message to the block start
+} radio_plan_sync_t;
+
+// Slot of a slave that was dropped whilst the plan was being delivered
+#define PLAN_SLOT_DROPPED (RH_BROADCAST_ADDRESS)
+// Time a node waits for the next plan sync
+#define PLAN_SYNC_RX_TIMEOUT (10000)
+
+#define PLAN_FRAG_PAYLOAD_START (MSG_PAYLOAD_START + sizeof(radio_plan_frag_t))
+#define PLAN_TESTDEFS_PER_FRAG ((RH_RF95_MAX_MESSAGE_LEN - LEN_MSG_EMPTY - \
+                                 sizeof(radio_plan_frag_t)) / sizeof(lora_testdef_t))
+#define LEN_MSG_PLAN_FRAG(CNT) LEN_MSG_WITH_PAYLOAD(sizeof(radio_plan_frag_t) + \
+                                                    (CNT) * sizeof(lora_testdef_t))
+#define LEN_MSG_PLAN_SYNC LEN_MSG_WITH_PAYLOAD(sizeof(radio_plan_sync_t))
+
+static_assert(MIN_TESTDEF_PACKET_LEN >= RH_RF95_HEADER_LEN + LEN_MSG_EMPTY, 
+              "Test packets must fit the message headers");
+static_assert(MAX_TESTDEF_PACKET_LEN <= RH_MAX_MESSAGE_LEN, "Test packets must fit a RadioHead message");
 
 /*
   Helper structure for handling a message queue. Holds a buffer long
@@ -119,6 +165,71 @@ typedef struct radio_msg_buffer_t {
   radio_msg_t* p_hdr = (radio_msg_t*) &data[MSG_HEADER_START];
 } radio_msg_buffer_t;
 
+// Configurations whose register values are kept, enough for the base and control
+// configurations and those of the testdefs being run
+#define CFG_IMAGE_CACHE_LEN (4)
+
+/*
+  A configuration compiled into the register values that set it, so changing
+  configuration only writes the registers that differ.
+*/
+typedef struct radio_cfg_image_t {
+  lora_cfg_t cfg;
+  RH_RF95::RegisterImage regs;
+  bool valid;
+} radio_cfg_image_t;
+
+/*
+  State of a testdef's packets being sent, stepped through by polling so
+  that several radios can send at once.
+*/
+typedef struct radio_tx_session_t {
+  lora_testdef_t *testdef;
+  uint32_t start_time;    // ms, start of the first packet interval
+  uint32_t slot_time;     // ms
+  uint8_t slot;           // slot used in each packet interval
+  uint8_t slot_cnt;       // slots in each packet interval
+  uint16_t packet;        // next packet to send
+  bool active;
+  bool valid;
+} radio_tx_session_t;
+
+/*
+  Packets received from a single slave within a receive session.
+*/
+typedef struct radio_rx_slave_t {
+  uint8_t id;
+  struct storage_result_writer_t *results;
+  // Packet arrivals are predicted from the most recently received one
+  uint32_t anchor_time;
+  uint16_t anchor_id;
+  // First packet ID that is yet to be received
+  uint16_t next_id;
+  uint16_t valid_packets;
+  bool active;
+} radio_rx_slave_t;
+
+/*
+  State of a testdef's packets being received, stepped through by polling
+  so that several radios can receive at once. Each slave sending the
+  testdef has its own slot in every packet interval.
+*/
+typedef struct radio_rx_session_t {
+  lora_testdef_t *testdef;
+  File *log_file;
+  uint32_t start_time;    // ms, start of the testdef
+  uint32_t start_time_us; // us, start of the testdef on the clock packets are timestamped with
+  uint32_t timeout;       // ms, full receive window from the start time
+  uint32_t slot_time;     // ms
+  radio_rx_slave_t slaves[MAX_PLAN_SLAVES];
+  uint8_t slot_cnt;
+  uint32_t rx_bad_total;
+  uint16_t ring_dropped_start; // driver count of packets lost to a full receive ring
+  int32_t time_left;
+  bool active;
+  bool valid;
+} radio_rx_session_t;
+
 /*
   TODO
 */
@@ -127,27 +238,79 @@ class LoRaModule {
     LoRaModule(lora_module_t *module_cfg, lora_cfg_t *base_cfg);
     bool radio_init(void);
     void reset_to_base_cfg(void);
+    void reset_to_ctrl_cfg(void);
+    void fallback_ctrl_cfg(void);
+    bool is_ctrl_cfg_base(void);
+    lora_cfg_t* get_ctrl_cfg(void);
+    bool negotiate_ctrl_cfg(uint8_t slave_id);
+    bool negotiate_ctrl_cfg(uint8_t slave_ids[], uint8_t slave_cnt);
     void set_cfg(lora_cfg_t *new_cfg);
 
     bool acknowledged_tx(radio_msg_buffer_t *tx_buf, uint8_t attempts = NO_ATTEMPT_LIMIT);
     bool unacknowledged_tx(radio_msg_buffer_t *tx_buf);
+    // Queues a message to be sent without waiting, false if the queue is full.
+    // The receive helpers and set_cfg() wait for anything queued to be sent
+    bool queue_tx(radio_msg_buffer_t *tx_buf);
     
-    bool acknowledged_rx(radio_msg_buffer_t *rx_buf, uint16_t timeout = NO_TIMEOUT);
-    bool unacknowledged_rx(radio_msg_buffer_t *rx_buf, uint16_t timeout = NO_TIMEOUT);
+    bool acknowledged_rx(radio_msg_buffer_t *rx_buf, uint32_t timeout = NO_TIMEOUT);
+    bool unacknowledged_rx(radio_msg_buffer_t *rx_buf, uint32_t timeout = NO_TIMEOUT);
     
     bool send_testdef(lora_testdef_t *tx_testdef);
 
     radio_cmd_t recv_command(uint8_t *master_id);
     bool recv_testdef(lora_testdef_t *recv_testdef);
 
+    uint8_t enrol_slaves(uint8_t slave_ids[], uint8_t max_cnt);
+    bool send_plan(uint16_t testdef_cnt, uint32_t max_block_duration, uint8_t slave_ids[],
+                   uint8_t *slave_cnt);
+    bool recv_plan(uint8_t master_id, uint16_t *testdef_cnt, uint32_t *max_block_duration, 
+                   uint8_t *slot, uint8_t *slot_cnt);
+    uint8_t get_remote_test_radio_cnt(void);
+    bool send_plan_block(uint8_t slave_ids[], uint8_t slave_cnt, lora_testdef_t testdefs[], 
+                         uint16_t first, uint16_t cnt);
+    bool send_plan_sync(uint8_t slave_ids[], uint8_t slave_cnt, uint16_t next, uint16_t cnt, 
+                        uint8_t parallel, uint32_t *start_time);
+    bool recv_plan_sync(uint8_t master_id, lora_testdef_t testdefs[], uint16_t max_cnt, 
+                        uint16_t *next, uint16_t *cnt, uint8_t *parallel, uint32_t *start_time, 
+                        uint32_t timeout = PLAN_SYNC_RX_TIMEOUT);
+
+    bool send_plan_abort(uint8_t slave_ids[], uint8_t slave_cnt);
+    bool poll_plan_abort(uint8_t master_id);
+
     bool send_testdef_packets(lora_testdef_t *testdef);
+    bool send_testdef_packets(lora_testdef_t *testdef, uint32_t start_time);
     bool recv_testdef_packets(lora_testdef_t *testdef, uint16_t *recv_packets, File* log_file);
+    bool recv_testdef_packets(lora_testdef_t *testdef, uint16_t *recv_packets, File* log_file,
+                              uint32_t start_time);
+
+    // Non-blocking equivalents, poll until false is returned then end
+    bool begin_send_testdef_packets(lora_testdef_t *testdef, uint32_t start_time, 
+                                    uint8_t slot = 0, uint8_t slot_cnt = 1);
+    bool poll_send_testdef_packets(void);
+    bool end_send_testdef_packets(void);
+    void begin_recv_testdef_packets(lora_testdef_t *testdef, File* log_file, uint32_t start_time,
+                                    uint8_t slave_ids[] = NULL, uint8_t slot_cnt = 1);
+    bool poll_recv_testdef_packets(void);
+    uint32_t get_recv_idle_time(void);
+    bool end_recv_testdef_packets(uint16_t *recv_packets);
 
     bool send_heartbeat(void);
     void ack_heartbeat(uint8_t master_id);
 
     static bool is_low_datarate_required(lora_cfg_t *cfg);
+    static uint8_t select_ctrl_sf(lora_cfg_t *base_cfg, int8_t snr);
     static uint32_t calculate_packet_airtime(lora_cfg_t *cfg, uint16_t packet_len);
+    static uint32_t calculate_packet_slot(lora_cfg_t *cfg, uint16_t packet_len);
+    static uint32_t calculate_testdef_duration(lora_testdef_t *testdef, uint8_t slot_cnt = 1);
+    static uint32_t calculate_testdef_duration(uint32_t slot_time, uint16_t packet_cnt, 
+                                               uint8_t slot_cnt = 1);
+    // Time the master listens for slaves to enrol after a plan QRY?
+    static uint32_t calculate_plan_enrol_window(lora_cfg_t *cfg);
+    static uint32_t calculate_plan_transfer_duration(lora_cfg_t *cfg, uint8_t slave_cnt = 1);
+    static uint32_t calculate_plan_block_transfer_duration(lora_cfg_t *cfg, uint16_t testdef_cnt,
+                                                           uint8_t slave_cnt = 1);
+    static uint32_t calculate_plan_sync_duration(lora_cfg_t *cfg);
+    static uint32_t calculate_plan_frag_duration(lora_cfg_t *cfg, uint8_t cnt);
 
     // Debug functions
     void dbg_print_cur_cfg(void);
@@ -163,18 +326,42 @@ class LoRaModule {
     // Addressed reliable interface
     RHReliableDatagram _rf95_dg;
   private:
+    bool query_slave(radio_msg_type_t qry_type, uint8_t *slave_id);
+    bool is_rdy(void);
+    void record_link_quality(bool first);
+    bool send_rdy(uint8_t master_id);
     uint16_t rx_bad_since_last_check(void);
+    RH_RF95::RegisterImage* get_cfg_image(lora_cfg_t *cfg);
+    void expect_tx(uint8_t len);
+    static bool on_radio_wait(void *context, uint16_t timeout);
+    static void on_radio_interrupt(void *context);
 
     // The pin configuration of the module 
     lora_module_t _module_cfg;
     // The radio module configuration that is hardcoded and therefore predictable
     lora_cfg_t _base_cfg;
+    // The radio module configuration negotiated for control traffic
+    lora_cfg_t _ctrl_cfg;
     // The current radio module configuration
     lora_cfg_t _cur_cfg;
+    // Register values of recently used configurations, replaced in turn
+    radio_cfg_image_t _cfg_images[CFG_IMAGE_CACHE_LEN];
+    uint8_t _cfg_image_next;
+    // Link quality of the last handshake as heard locally and by the other node
+    radio_link_report_t _link_local;
+    radio_link_report_t _link_remote;
     // Buffer used by default for all class defined transmissions
     radio_msg_buffer_t _tx_buf; // may get trashed during acknowledged transmissions
     // Buffer used by default for all class defined receives
     radio_msg_buffer_t _rx_buf;
+    // Testdef packets currently being sent or received
+    radio_tx_session_t _tx_session;
+    radio_rx_session_t _rx_session;
+    // Driver count of failed receives at the last check
+    uint16_t _rx_bad_last;
+    // Predicted end of the transmissions given to the radio, airtime left before
+    // then is used for other work while waiting on the radio
+    uint32_t _tx_end_time;
     // Flag set when an external source wants current behaviour to finish
     volatile bool _interrupt;
 };
@@ -182,9 +369,13 @@ class LoRaModule {
 // Hardcoded base configuration file
 extern lora_cfg_t hc_base_cfg;
 
-// Global radio instances 
-// (multiple in case future dataloggers have separate radios for tx and rx)
+// Global radio instances, radio a is always used for test traffic. If a 
+// datalogger has a second radio then radio b holds the control channel,
+// otherwise it is NULL and radio a carries both.
 extern LoRaModule* g_radio_a;
 extern LoRaModule* g_radio_b;
+// All radios used for test traffic, radio a is always the first
+extern LoRaModule* g_test_radios[MAX_TEST_RADIOS];
+extern uint8_t g_test_radio_cnt;
 
 #endif // RADIO_H
@@ -0,0 +1,176 @@
+/*
+  Binary run container, a single file holding every result of a plan.
+  Shared between the firmware and host tools so must not depend on Arduino.
+
+  Layout: header | testdef table | records
+  Records are a tag byte, the low nibble holding the record type and the high
+  nibble the stream it belongs to, followed by its fields. Each stream is the
+  results of one testdef from one slave, result fields are stored as varint
+  deltas from the previous result of the same stream.
+*/
+
+#ifndef RUN_CONTAINER_H
+#define RUN_CONTAINER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define RUN_CONTAINER_FILE "_results.lrc"
+#define RUN_CONTAINER_MAGIC (0x3143524C) // "LRC1"
+#define RUN_CONTAINER_VERSION (3)
+
+// Must match the firmware's testdef id length
+#define RUN_CONTAINER_ID_LEN (16)
+#define RUN_CONTAINER_MAX_STREAMS (16)
+
+// Largest encoding of a single result record
+#define RC_MAX_RESULT_LEN (1 + 3 + 3 + 3 + 5 + 5 + 5)
+// Largest encoding of a stream begin record
+#define RC_MAX_BEGIN_LEN (1 + 1 + 1 + RUN_CONTAINER_ID_LEN)
+
+typedef struct __attribute__((packed)) run_container_header_t {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t testdef_cnt;
+  uint32_t table_offset;
+  uint32_t data_offset;
+  uint32_t data_len;      // bytes of records known to be on the card
+  uint16_t year;
+  uint8_t month;
+  uint8_t day;
+  uint8_t hour;
+  uint8_t minute;
+  uint8_t second;
+} run_container_header_t;
+
+typedef struct __attribute__((packed)) run_container_testdef_t {
+  char id[RUN_CONTAINER_ID_LEN];
+  uint8_t exp_range;
+  uint16_t packet_cnt;
+  uint8_t packet_len;
+  float freq;             // MHz
+  uint8_t sf;
+  int8_t tx_dbm;
+  int32_t bw;             // Hz
+  uint8_t cr4_denom;
+  uint8_t preamble_syms;
+  uint8_t crc;
+} run_container_testdef_t;
+
+typedef enum run_container_tag_t {
+  rc_tag_end = 0,         // No further records
+  rc_tag_begin,           // Slave id, id length then testdef id
+  rc_tag_result,          // Delta encoded result
+} run_container_tag_t;
+
+#define RC_TAG(TYPE, STREAM) ((uint8_t) ((TYPE) | ((STREAM) << 4)))
+#define RC_TAG_TYPE(TAG) ((TAG) & 0x0F)
+#define RC_TAG_STREAM(TAG) ((TAG) >> 4)
+
+/*
+  Last result of a stream, the reference for the next delta.
+*/
+typedef struct run_container_stream_t {
+  uint16_t id;
+  int16_t rssi;
+  int16_t snr;
+  uint32_t failed_recv;
+  int32_t time_left;
+  uint32_t arrival;       // us from the testdef start
+} run_container_stream_t;
+
+static inline void rc_reset_stream(run_container_stream_t *stream) {
+  // Consecutive IDs encode as zero so start just before the first
+  stream->id = UINT16_MAX;
+  stream->rssi = 0;
+  stream->snr = 0;
+  stream->failed_recv = 0;
+  stream->time_left = 0;
+  stream->arrival = 0;
+}
+
+static inline uint32_t rc_zigzag_encode(int32_t val) {
+  return ((uint32_t) val << 1) ^ (uint32_t) (val >> 31);
+}
+
+static inline int32_t rc_zigzag_decode(uint32_t val) {
+  return (int32_t) (val >> 1) ^ -(int32_t) (val & 1);
+}
+
+static inline uint8_t rc_varint_encode(uint32_t val, uint8_t *buf) {
+  uint8_t len = 0;
+  while (val >= 0x80) {
+    buf[len++] = (uint8_t) (val | 0x80);
+    val >>= 7;
+  }
+  buf[len++] = (uint8_t) val;
+  return len;
+}
+
+// Returns the number of bytes used, 0 if the varint is incomplete
+static inline size_t rc_varint_decode(const uint8_t *buf, size_t len, uint32_t *val) {
+  *val = 0;
+  for (size_t i=0; i < len && i < 5; i++) {
+    *val |= (uint32_t) (buf[i] & 0x7F) << (7 * i);
+    if (!(buf[i] & 0x80)) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+static inline uint8_t rc_encode_begin(uint8_t stream, uint8_t slave_id, const char *testdef_id,
+                                      uint8_t *buf) {
+  uint8_t id_len = strnlen(testdef_id, RUN_CONTAINER_ID_LEN);
+  buf[0] = RC_TAG(rc_tag_begin, stream);
+  buf[1] = slave_id;
+  buf[2] = id_len;
+  memcpy(&buf[3], testdef_id, id_len);
+  return 3 + id_len;
+}
+
+static inline uint8_t rc_encode_result(run_container_stream_t *stream, uint8_t stream_idx,
+                                       uint16_t id, int16_t rssi, int16_t snr,
+                                       uint32_t failed_recv, int32_t time_left, uint32_t arrival,
+                                       uint8_t *buf) {
+  uint8_t len = 0;
+  buf[len++] = RC_TAG(rc_tag_result, stream_idx);
+  len += rc_varint_encode(rc_zigzag_encode((int32_t) id - stream->id - 1), &buf[len]);
+  len += rc_varint_encode(rc_zigzag_encode(rssi - stream->rssi), &buf[len]);
+  len += rc_varint_encode(rc_zigzag_encode(snr - stream->snr), &buf[len]);
+  // Failed receives only ever increase within a testdef
+  len += rc_varint_encode(failed_recv - stream->failed_recv, &buf[len]);
+  len += rc_varint_encode(rc_zigzag_encode(time_left - stream->time_left), &buf[len]);
+  len += rc_varint_encode(rc_zigzag_encode((int32_t) (arrival - stream->arrival)), &buf[len]);
+  stream->id = id;
+  stream->rssi = rssi;
+  stream->snr = snr;
+  stream->failed_recv = failed_recv;
+  stream->time_left = time_left;
+  stream->arrival = arrival;
+  return len;
+}
+
+// Decodes the fields following a result tag, returns the bytes used or 0 if incomplete
+static inline size_t rc_decode_result(run_container_stream_t *stream, const uint8_t *buf,
+                                      size_t len) {
+  uint32_t fields[6];
+  size_t used = 0;
+  for (uint8_t i=0; i < 6; i++) {
+    size_t field_len = rc_varint_decode(&buf[used], len - used, &fields[i]);
+    if (field_len == 0) {
+      return 0;
+    }
+    used += field_len;
+  }
+  stream->id = stream->id + 1 + rc_zigzag_decode(fields[0]);
+  stream->rssi += rc_zigzag_decode(fields[1]);
+  stream->snr += rc_zigzag_decode(fields[2]);
+  stream->failed_recv += fields[3];
+  stream->time_left += rc_zigzag_decode(fields[4]);
+  stream->arrival += rc_zigzag_decode(fields[5]);
+  return used;
+}
+
+#endif // RUN_CONTAINER_H
@@ -4,19 +4,82 @@
 #include <Arduino.h>
 #include <SdFat.h>
 
+#include "plan.h"
+#include "plan_file.h"
 #include "radio.h"
+#include "run_container.h"
 #define TESTDEF_DIR  "/testdefs/"
 #define RESULTS_DIR  "/results/"
 
 #define TESTDEF_FORMAT_FILE TESTDEF_DIR "_format.txt"
 #define LOG_FILE "_log.txt"
+#define JOURNAL_FILE "_journal.txt"
+// Final journal entry of a finished plan, testdefs can never be named this
+#define JOURNAL_END_MARKER "_END"
+// Longest journal entry, the testdef id then its expected range and packets received
+#define JOURNAL_LINE_LEN (TESTDEF_ID_LEN + 16)
+// Length of a path to a results directory
+#define MAX_RESULTS_PATH_LEN (64)
 
 // Global format to use when printing datetimes
 #define DATETIME_PRINT_FORMAT "[%04d-%02d-%02d] %02d:%02d:%02d"
 #define DATETIME_PRINT_ARGS year(), month(), day(), hour(), minute(), second()
 
-#define SERIAL_AND_LOG(file, format, ...) file.printf(format,  ##__VA_ARGS__); \
-                                          Serial.printf(format, ##__VA_ARGS__);
+// Results are buffered in RAM and written to the card in whole blocks
+#define SD_BLOCK_LEN (512)
+#define RESULT_BUFFER_LEN (2 * SD_BLOCK_LEN)
+// Every receiving radio can have a results file open per slave
+#define MAX_RESULT_WRITERS (MAX_TEST_RADIOS * MAX_PLAN_SLAVES)
+// Assumed SD write latency until one has been measured
+#define SD_WRITE_LATENCY_ESTIMATE_US (5000)
+
+// Write all results of a run into a single binary container instead of a
+// CSV per testdef, tools/run_container_to_csv.cpp expands it on a host
+#ifndef RUN_CONTAINER_ENABLED
+#define RUN_CONTAINER_ENABLED (0)
+#endif
+
+// Log messages are queued as their format and arguments, they are only formatted
+// and written out when storage is flushed with enough idle time
+#define LOG_RING_LEN (32)
+#define LOG_MAX_ARGS (8)
+// Space for copies of the string arguments of a single message, enough for
+// the longest path logged along with a testdef id
+#define LOG_MAX_STR_LEN (MAX_RESULTS_PATH_LEN + TESTDEF_ID_LEN)
+#define LOG_MAX_LINE_LEN (192)
+
+// The format must outlive the message so should be a literal, string arguments are copied
+#define SERIAL_AND_LOG(file, format, ...) storage_defer_log(&(file), format, ##__VA_ARGS__);
+
+/*
+  A log message waiting to be formatted, arguments are held as words so
+  only integers and strings can be logged.
+*/
+typedef struct storage_log_entry_t {
+  File *file;             // NULL to only print to Serial
+  const char *format;
+  uintptr_t args[LOG_MAX_ARGS];
+  uint8_t arg_cnt;
+  uint8_t str_mask;       // arguments that are offsets into 'strs'
+  uint8_t strs_len;
+  char strs[LOG_MAX_STR_LEN];
+} storage_log_entry_t;
+
+/*
+  A results file buffered through a ring, the ring index of every byte
+  matches its file offset so a block never wraps within the ring.
+*/
+typedef struct storage_result_writer_t {
+  File file;
+  uint8_t buf[RESULT_BUFFER_LEN];
+  uint32_t buffered;      // bytes put into the ring
+  uint32_t written;       // bytes written to the file
+  bool open;
+  // Set when results go to the run container rather than this file
+  bool contained;
+  uint8_t stream_idx;
+  run_container_stream_t stream;
+} storage_result_writer_t;
 
 extern SdFatSdio SD;
 
@@ -25,17 +88,85 @@ bool storage_init(void);
 bool storage_master_defaults(void);
 bool storage_slave_defaults(void);
 
+// Sweeps are expanded into every variant, see testdef.h
 bool storage_load_testdef(File* file, lora_testdef_t *testdef);
 bool storage_load_testdef(char* path, lora_testdef_t *testdef);
 
-uint8_t storage_load_testdefs(lora_testdef_t testdefs[], uint8_t arr_len);
+// Plans are held as keys, each testdef is reloaded from its file when it is run. A plan
+// compiled on a host is loaded in place of the testdef files if present, 'ordered_for' 
+// is the number of test radios its keys are already ordered for, 0 if unordered
+uint16_t storage_load_plan_keys(plan_key_t keys[], uint16_t arr_len, uint8_t *ordered_for);
+bool storage_load_plan_testdef(plan_key_t *key, lora_testdef_t *testdef);
+
+storage_result_writer_t* storage_init_result_file(char* filename, uint8_t slave_id = 0);
+// 'arrival' is the time the packet completed in us from the testdef start
+bool storage_write_result(storage_result_writer_t *writer, uint16_t id, int16_t rssi, 
+                    int16_t snr, uint32_t failed_recv, int32_t time_left, uint32_t arrival);
+void storage_close_result_file(storage_result_writer_t *writer);
+// Write any whole buffered blocks, then log messages, that can complete within the idle time, ms
+void storage_flush_results(uint32_t idle_time);
+// Worst time taken by a single results write since boot, us
+uint32_t storage_get_max_write_latency(void);
 
-File storage_init_result_file(char* filename);
-bool storage_write_result(File *file, uint16_t id, int16_t rssi, 
-                    int16_t snr, uint32_t failed_recv, int32_t time_left);
+// Results files opened while a run container is open become streams within it
+bool storage_init_run_container(plan_key_t keys[], uint16_t cnt, uint32_t exp_results);
+void storage_close_run_container(void);
 
 File storage_init_test_log(void);
 
+bool storage_find_resumable_results(char* path);
+File storage_init_journal(void);
+bool storage_write_journal_entry(File *file, lora_testdef_t *testdef, uint16_t recv_packets);
+bool storage_read_journal_entry(File *file, char *testdef_id, uint8_t *exp_range, 
+                                uint16_t *recv_packets);
+bool storage_finish_journal(File *file);
+
 bool is_storage_initialised(void);
 
+// Returns NULL when the log is full, the message is then dropped and counted
+storage_log_entry_t* storage_claim_log_entry(File *file, const char *format);
+void storage_commit_log_entry(void);
+// Write every queued log message regardless of idle time
+void storage_flush_log(void);
+
+static inline void storage_log_arg(storage_log_entry_t *entry, const char *str) {
+  // Copied as the string may have changed by the time the message is written
+  uint8_t offset = entry->strs_len < LOG_MAX_STR_LEN ? entry->strs_len : LOG_MAX_STR_LEN - 1;
+  uint8_t len = strnlen(str, LOG_MAX_STR_LEN - 1 - offset);
+  memcpy(&entry->strs[offset], str, len);
+  // A string cut short ends in '...' so the log shows it is incomplete
+  if (str[len] != '\0' && len >= 3) {
+    memcpy(&entry->strs[offset + len - 3], "...", 3);
+  }
+  entry->strs[offset + len] = '\0';
+  entry->strs_len = offset + len + 1;
+  entry->str_mask |= 1 << entry->arg_cnt;
+  entry->args[entry->arg_cnt++] = offset;
+}
+
+static inline void storage_log_arg(storage_log_entry_t *entry, char *str) {
+  storage_log_arg(entry, (const char*) str);
+}
+
+// Floats would need formatting straight away, log them scaled as integers instead
+static void storage_log_arg(storage_log_entry_t *entry, float val) = delete;
+static void storage_log_arg(storage_log_entry_t *entry, double val) = delete;
+
+template<typename T>
+static inline void storage_log_arg(storage_log_entry_t *entry, T val) {
+  entry->args[entry->arg_cnt++] = (uintptr_t) val;
+}
+
+template<typename... Args>
+static inline void storage_defer_log(File *file, const char *format, Args... args) {
+  static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "Too many arguments to log");
+  storage_log_entry_t *entry = storage_claim_log_entry(file, format);
+  if (entry == NULL) {
+    return;
+  }
+  int expand[] = {0, (storage_log_arg(entry, args), 0)...};
+  (void) expand;
+  storage_commit_log_entry();
+}
+
 #endif // STORAGE_H
\ No newline at end of file
@@ -0,0 +1,102 @@
+/*
+  Console output of the firmware. Messages below LOG_LEVEL are removed at
+  compile time, the rest are either printed as text or, with
+  TELEMETRY_BINARY, sent as compact frames that tools/telemetry_decode.cpp
+  turns back into text. Output is dropped rather than waiting whenever USB
+  can't take it, so a missing host can never stall the radios.
+
+  Binary frames: sync | payload length | type | payload | check
+  The check is the XOR of every byte from the length on, letting the
+  decoder resync after a frame that was cut short.
+  A message frame holds its level, the id of its format then each argument,
+  integers as zigzag varints, floats as 4 bytes and strings null
+  terminated. Arguments that don't fit the payload are left out and the
+  level flagged with TELEMETRY_TRUNCATED. The format itself is sent once
+  per host connection in a format frame.
+*/
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LOG_LEVEL_NONE (0)
+#define LOG_LEVEL_ERROR (1)
+#define LOG_LEVEL_INFO (2)
+#define LOG_LEVEL_DEBUG (3)
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#ifndef TELEMETRY_BINARY
+#define TELEMETRY_BINARY (0)
+#endif
+
+#define TELEMETRY_SYNC (0xA5)
+#define TELEMETRY_MAX_PAYLOAD (UINT8_MAX)
+// Longest line printed in text mode
+#define TELEMETRY_MAX_LINE_LEN (192)
+// Longest string argument sent in a message frame
+#define TELEMETRY_MAX_STR_LEN (32)
+// Set in the level of a message frame missing its last arguments
+#define TELEMETRY_TRUNCATED (0x80)
+
+typedef enum telemetry_frame_t {
+  tlm_format = 0,         // Format id then format text
+  tlm_message,            // Level, format id then arguments
+  tlm_text,               // Text with no format
+  tlm_dropped,            // Varint count of messages dropped since the last frame
+} telemetry_frame_t;
+
+// Arguments are still type checked when a level is compiled out
+#define LOG_AT(LEVEL, format, ...) do { \
+    if ((LEVEL) <= LOG_LEVEL) { telemetry_log(LEVEL, format, ##__VA_ARGS__); } \
+  } while (0)
+#define LOG_ERROR(format, ...) LOG_AT(LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) LOG_AT(LOG_LEVEL_INFO, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...) LOG_AT(LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+
+// Writes as much text as USB can take without waiting
+void telemetry_print(const char *text);
+
+uint8_t telemetry_begin_message(uint8_t *payload, uint8_t level, const char *format);
+uint8_t telemetry_add_arg(uint8_t *payload, uint8_t len, int32_t val);
+uint8_t telemetry_add_arg(uint8_t *payload, uint8_t len, float val);
+uint8_t telemetry_add_arg(uint8_t *payload, uint8_t len, const char *str);
+void telemetry_send_message(const char *format, uint8_t *payload, uint8_t len);
+
+static inline uint8_t telemetry_add_arg(uint8_t *payload, uint8_t len, char *str) {
+  return telemetry_add_arg(payload, len, (const char*) str);
+}
+
+static inline uint8_t telemetry_add_arg(uint8_t *payload, uint8_t len, double val) {
+  return telemetry_add_arg(payload, len, (float) val);
+}
+
+template<typename T>
+static inline uint8_t telemetry_add_arg(uint8_t *payload, uint8_t len, T val) {
+  // Every integer fits a 32 bit word on the device, the decoder reinterprets
+  // it as the format requires
+  return telemetry_add_arg(payload, len, (int32_t) val);
+}
+
+template<typename... Args>
+static inline void telemetry_log(uint8_t level, const char *format, Args... args) {
+#if TELEMETRY_BINARY
+  uint8_t payload[TELEMETRY_MAX_PAYLOAD];
+  uint8_t len = telemetry_begin_message(payload, level, format);
+  int expand[] = {0, (len = telemetry_add_arg(payload, len, args), 0)...};
+  (void) expand;
+  telemetry_send_message(format, payload, len);
+#else
+  (void) level;
+  char line[TELEMETRY_MAX_LINE_LEN];
+  snprintf(line, TELEMETRY_MAX_LINE_LEN, format, args...);
+  telemetry_print(line);
+#endif
+}
+
+#endif // TELEMETRY_H
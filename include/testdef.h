@@ -0,0 +1,120 @@
+/*
+  Testdefs, the rules they must follow and the timing derived from them.
+  Shared between the firmware and host tools so must not depend on Arduino.
+*/
+
+#ifndef TESTDEF_H
+#define TESTDEF_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TESTDEF_ID_LEN (16)
+
+// Time added to the airtime of every test packet to form its transmission slot,
+// this must cover the receiver processing a packet and returning to RX
+#define PACKET_SLOT_GUARD_MS (30)
+// Delay from after configuration before slave starts sending packets
+#define SLAVE_PACKET_SEND_DELAY (1000)
+// Tolerance on the receive window to account for handshake and clock differences
+#define RX_WINDOW_TOLERANCE_MS (100)
+// Longest receive window of a testdef, packet arrivals are timed in us from the
+// testdef start in 32 bits which wrap after 71.5 minutes
+#define MAX_TESTDEF_DURATION_MS (60UL * 60 * 1000)
+// Most slaves that can be enrolled to execute a plan together, each has its own
+// slot in every packet interval so the receive window grows with them
+#define MAX_PLAN_SLAVES (4)
+
+// Test packets must at least hold the RadioHead and message headers,
+// radio.h checks these against the real header lengths
+#define MIN_TESTDEF_PACKET_LEN (12)
+#define MAX_TESTDEF_PACKET_LEN (255)
+
+// Number of fields in a testdef file
+#define TESTDEF_FIELD_CNT (10)
+// Most values a single field of a sweep can list
+#define TESTDEF_SWEEP_MAX_LIST (16)
+
+/*
+  Full LoRa radio configuration. It is likely that many of the
+  fields will be the same across various configurations.
+  Those denoted by (!) can be different between nodes, the others
+  must be consistent.
+*/
+typedef struct lora_cfg_t {
+  float freq;             // MHz
+  uint8_t sf;
+  int8_t tx_dbm;          // (!)
+  long bw;                // Hz
+  uint8_t cr4_denom;      // (4 / Val) (!)
+  uint8_t preamble_syms;
+  bool crc;               // (!)
+} lora_cfg_t;
+
+/*
+  Full definition for a packet test.
+*/
+typedef struct lora_testdef_t {
+  char id[TESTDEF_ID_LEN];
+  // An arbitary user chosen value, can be used to discard testdefs
+  // that are almost guarenteed to fail
+  uint8_t exp_range;
+  uint16_t packet_cnt;
+  uint8_t packet_len;
+  lora_cfg_t cfg;
+  uint8_t master_id;
+  uint8_t slave_id;
+} lora_testdef_t;
+
+typedef enum testdef_field_t {
+  FIELD_EXP_RANGE = 0,
+  FIELD_PACKET_CNT,
+  FIELD_PACKET_LEN,
+  FIELD_FREQ,
+  FIELD_SF,
+  FIELD_TX_DBM,
+  FIELD_BW,
+  FIELD_CR4_DENOM,
+  FIELD_PREAMBLE_SYMS,
+  FIELD_CRC,
+} testdef_field_t;
+
+/*
+  Values a single testdef field takes, either listed or as a range
+  described by its first value and step.
+*/
+typedef struct testdef_sweep_field_t {
+  float values[TESTDEF_SWEEP_MAX_LIST];
+  uint16_t cnt;
+  bool is_range;
+} testdef_sweep_field_t;
+
+/*
+  A testdef file where any field can take several values, every
+  combination is a variant built on demand from its index.
+*/
+typedef struct testdef_sweep_t {
+  char name[TESTDEF_ID_LEN];
+  testdef_sweep_field_t fields[TESTDEF_FIELD_CNT];
+  uint16_t variant_cnt;
+} testdef_sweep_t;
+
+// Reads up to 'len' bytes of a testdef file into 'buf', returning the number read
+typedef int (*testdef_read_t)(void *src, char *buf, uint16_t len);
+
+// Any testdef field can be swept, either listed as 'a|b|c' or as a range 'first:last[:step]',
+// every combination becomes a variant of the testdef named '<name>_<variant>'
+bool testdef_load_sweep(testdef_read_t read, void *src, const char *filename,
+                        testdef_sweep_t *sweep);
+void testdef_get_variant(testdef_sweep_t *sweep, uint16_t variant, lora_testdef_t *testdef);
+bool testdef_is_valid(lora_testdef_t *testdef);
+const char* testdef_field_name(uint8_t field);
+void testdef_extract_id(const char *filename, char *testdef_id);
+
+bool testdef_low_datarate_required(lora_cfg_t *cfg);
+uint32_t testdef_packet_airtime(lora_cfg_t *cfg, uint16_t packet_len);
+uint32_t testdef_packet_slot(lora_cfg_t *cfg, uint16_t packet_len);
+// Full receive window of the master, measured from the testdef start time
+uint32_t testdef_duration(uint32_t slot_time, uint16_t packet_cnt, uint8_t slot_cnt = 1);
+
+#endif // TESTDEF_H
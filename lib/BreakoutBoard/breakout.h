@@ -26,6 +26,16 @@
 #define RFM95_RST (25)
 #define RFM95_INT (26)
 
+// Optional second radio pins, for boards with separate control and test radios
+#define RFM95_B_CS  (27)
+#define RFM95_B_RST (28)
+#define RFM95_B_INT (29)
+
+// Optional third radio pins, for boards running testdefs in parallel
+#define RFM95_C_CS  (30)
+#define RFM95_C_RST (31)
+#define RFM95_C_INT (32)
+
 /*
   Enumeration of possible switch states.
 */
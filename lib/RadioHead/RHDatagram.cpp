@@ -49,6 +49,16 @@ bool RHDatagram::recvfrom(uint8_t* buf, uint8_t* len, uint8_t* from, uint8_t* to
     return false;
 }
 
+bool RHDatagram::borrowfrom(RHRxView* view)
+{
+    return _driver.borrow(view);
+}
+
+void RHDatagram::release()
+{
+    _driver.release();
+}
+
 bool RHDatagram::available()
 {
     return _driver.available();
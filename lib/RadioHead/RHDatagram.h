@@ -87,6 +87,17 @@ public:
     /// \return true if a valid message was copied to buf
     bool recvfrom(uint8_t* buf, uint8_t* len, uint8_t* from = NULL, uint8_t* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
 
+    /// Turns the receiver on if it not already on.
+    /// If there is a valid message available for this node, describe it in view without
+    /// copying it out of the driver and return true. The message must be given back
+    /// with release() once finished with. See RHGenericDriver::borrow().
+    /// \param[out] view Set to describe the received message, including its SRC and DEST addresses
+    /// \return true if a valid message was borrowed, false also if the driver can't lend messages
+    bool borrowfrom(RHRxView* view);
+
+    /// Gives back the message last returned by borrowfrom().
+    void release();
+
     /// Tests whether a new message is available
     /// from the Driver.
     /// On most drivers, this will also put the Driver into RHModeRx mode until
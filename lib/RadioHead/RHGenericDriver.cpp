@@ -16,7 +16,9 @@ RHGenericDriver::RHGenericDriver()
     _rxBad(0),
     _rxGood(0),
     _txGood(0),
-    _cad_timeout(0)
+    _cad_timeout(0),
+    _waitCallback(0),
+    _waitContext(0)
 {
 }
 
@@ -25,11 +27,30 @@ bool RHGenericDriver::init()
     return true;
 }
 
+void RHGenericDriver::setWaitCallback(RHWaitCallback callback, void* context)
+{
+    _waitCallback = callback;
+    _waitContext = context;
+}
+
+bool RHGenericDriver::waitAbandoned()
+{
+    return _waitCallback && !_waitCallback(_waitContext, 0);
+}
+
+bool RHGenericDriver::waitIdle(uint16_t timeout)
+{
+    if (_waitCallback)
+	return _waitCallback(_waitContext, timeout);
+    YIELD;
+    return true;
+}
+
 // Blocks until a valid message is received
 void RHGenericDriver::waitAvailable()
 {
     while (!available())
-	YIELD;
+	waitIdle(0xffff);
 }
 
 // Blocks until a valid message is received or timeout expires
@@ -38,32 +59,38 @@ void RHGenericDriver::waitAvailable()
 bool RHGenericDriver::waitAvailableTimeout(uint16_t timeout)
 {
     unsigned long starttime = millis();
-    while ((millis() - starttime) < timeout)
+    unsigned long elapsed;
+    while ((elapsed = millis() - starttime) < timeout)
     {
         if (available())
 	{
            return true;
 	}
-	YIELD;
+	if (!waitIdle(timeout - elapsed))
+	    break;
     }
     return false;
 }
 
 bool RHGenericDriver::waitPacketSent()
 {
+    // Wait for any previous transmit to finish, even if other waits are being
+    // abandoned, as it can't be stopped cleanly and will be done within its airtime
     while (_mode == RHModeTx)
-	YIELD; // Wait for any previous transmit to finish
+	waitIdle(0xffff);
     return true;
 }
 
 bool RHGenericDriver::waitPacketSent(uint16_t timeout)
 {
     unsigned long starttime = millis();
-    while ((millis() - starttime) < timeout)
+    unsigned long elapsed;
+    while ((elapsed = millis() - starttime) < timeout)
     {
         if (_mode != RHModeTx) // Any previous transmit finished?
            return true;
-	YIELD;
+	if (!waitIdle(timeout - elapsed))
+	    break;
     }
     return false;
 }
@@ -156,6 +183,16 @@ int16_t RHGenericDriver::lastRssi()
     return _lastRssi;
 }
 
+bool RHGenericDriver::borrow(RHRxView* view)
+{
+    (void)view;
+    return false;
+}
+
+void RHGenericDriver::release()
+{
+}
+
 RHGenericDriver::RHMode  RHGenericDriver::mode()
 {
     return _mode;
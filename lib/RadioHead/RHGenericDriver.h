@@ -17,6 +17,23 @@
 // Default timeout for waitCAD() in ms
 #define RH_CAD_DEFAULT_TIMEOUT            10000
 
+/// \brief A received message left in place in the driver, see RHGenericDriver::borrow()
+typedef struct
+{
+    uint8_t        headerTo;    ///< TO header
+    uint8_t        headerFrom;  ///< FROM header
+    uint8_t        headerId;    ///< ID header
+    uint8_t        headerFlags; ///< FLAGS header
+    const uint8_t* data;        ///< The message, following the headers
+    uint8_t        len;         ///< Octets of data
+    int16_t        rssi;        ///< dBm
+    int8_t         snr;         ///< dB, 0 if the driver does not measure it
+    uint32_t       time;        ///< micros() when the message was received, 0 if the driver does not record it
+} RHRxView;
+
+/// Called by the blocking waits of a driver each time round their loop, see RHGenericDriver::setWaitCallback()
+typedef bool (*RHWaitCallback)(void* context, uint16_t timeout);
+
 /////////////////////////////////////////////////////////////////////
 /// \class RHGenericDriver RHGenericDriver.h <RHGenericDriver.h>
 /// \brief Abstract base class for a RadioHead driver.
@@ -83,6 +100,20 @@ public:
     /// \return true if a valid message was copied to buf
     virtual bool recv(uint8_t* buf, uint8_t* len) = 0;
 
+    /// Turns the receiver on if it not already on.
+    /// If there is a valid message available, describe it in view without copying it
+    /// and return true, else return false. The message stays in the driver, and keeps
+    /// being returned by borrow(), until release() is called. The header accessors
+    /// such as headerFrom() describe the borrowed message as they would after recv().
+    /// Drivers that can't hold a message in place always return false.
+    /// \param[out] view Set to describe the received message
+    /// \return true if a valid message was borrowed
+    virtual bool borrow(RHRxView* view);
+
+    /// Frees the message last returned by borrow() so the driver can reuse its space.
+    /// The view must not be used afterwards.
+    virtual void release();
+
     /// Waits until any previous transmit packet is finished being transmitted with waitPacketSent().
     /// Then optionally waits for Channel Activity Detection (CAD) 
     /// to show the channnel is clear (if the radio supports CAD) by calling waitCAD().
@@ -101,6 +132,21 @@ public:
     /// \return The maximum legal message length
     virtual uint8_t maxMessageLength() = 0;
 
+    /// Sets a function to be called repeatedly while waitAvailable(), waitAvailableTimeout() and
+    /// waitPacketSent() block, letting the application do other work while the radio is busy.
+    /// The callback may sleep for up to timeout ms, but should return as soon as the driver
+    /// interrupts, as the wait can't end while it runs. It returns false to abandon the wait,
+    /// which makes waitAvailableTimeout() and waitPacketSent(timeout) return false straight away.
+    /// A timeout of 0 only asks whether to continue. Without a callback the waits spin.
+    /// \param[in] callback The function to call, or NULL for none
+    /// \param[in] context Passed to the callback
+    void                    setWaitCallback(RHWaitCallback callback, void* context);
+
+    /// Asks the wait callback, if any, whether waits are being abandoned, so that loops
+    /// built on waitAvailableTimeout() can tell a timeout from an abandoned wait
+    /// \return true if the wait callback returned false
+    bool                    waitAbandoned();
+
     /// Starts the receiver and blocks until a valid received 
     /// message is available.
     virtual void            waitAvailable();
@@ -249,6 +295,10 @@ public:
 
 protected:
 
+    /// Called each time round the loop of a blocking wait, which will end within timeout ms
+    /// \return false if the wait is to be abandoned
+    bool                    waitIdle(uint16_t timeout);
+
     /// The current transport operating mode
     volatile RHMode     _mode;
 
@@ -300,6 +350,10 @@ protected:
     /// Channel activity timeout in ms
     unsigned int        _cad_timeout;
 
+    /// Work to do while blocked waiting for the radio
+    RHWaitCallback      _waitCallback;
+    void*               _waitContext;
+
 private:
 
 };
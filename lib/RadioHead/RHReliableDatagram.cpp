@@ -114,6 +114,8 @@ bool RHReliableDatagram::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address)
 		    // Else discard it
 		}
 	    }
+	    else if (_driver.waitAbandoned())
+		return false;
 	    // Not the one we are waiting for, maybe keep waiting until timeout exhausted
 	    YIELD;
 	}
@@ -167,6 +169,29 @@ bool RHReliableDatagram::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* from,
     return false;
 }
 
+bool RHReliableDatagram::borrowfromAck(RHRxView* view)
+{
+    if (!available() || !borrowfrom(view))
+	return false;
+    // Never ACK an ACK
+    if (!(view->headerFlags & RH_FLAGS_ACK))
+    {
+	// Its for this node and not a broadcast, so ACK it
+	if (view->headerTo == _thisAddress)
+	    acknowledge(view->headerId, view->headerFrom);
+	// Filter out retried messages that we have seen before, as recvfromAck()
+	if ((RH_ENABLE_EXPLICIT_RETRY_DEDUP && !(view->headerFlags & RH_FLAGS_RETRY))
+	    || view->headerId != _seenIds[view->headerFrom])
+	{
+	    _seenIds[view->headerFrom] = view->headerId;
+	    return true;
+	}
+	// Else just re-ack it and wait for a new one
+    }
+    release();
+    return false;
+}
+
 bool RHReliableDatagram::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, uint8_t* from, uint8_t* to, uint8_t* id, uint8_t* flags)
 {
     unsigned long starttime = millis();
@@ -178,6 +203,8 @@ bool RHReliableDatagram::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t
 	    if (recvfromAck(buf, len, from, to, id, flags))
 		return true;
 	}
+	else if (_driver.waitAbandoned())
+	    return false;
 	YIELD;
     }
     return false;
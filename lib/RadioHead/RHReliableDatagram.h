@@ -154,6 +154,13 @@ public:
     /// \return true if a valid message was copied to buf
     bool recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* from = NULL, uint8_t* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
 
+    /// As recvfromAck(), but the message is described in view rather than copied and must
+    /// be given back with release() once finished with. The driver must keep a borrowed
+    /// message intact while the acknowledgement is sent.
+    /// \param[out] view Set to describe the received message
+    /// \return true if a valid message was borrowed
+    bool borrowfromAck(RHRxView* view);
+
     /// Similar to recvfromAck(), this will block until either a valid message available for this node
     /// or the timeout expires. Starts the receiver automatically.
     /// You should be sure to call this function frequently enough to not miss any messages
@@ -11,6 +11,12 @@
 RH_RF95* RH_RF95::_deviceForInterrupt[RH_RF95_NUM_INTERRUPTS] = {0, 0, 0};
 uint8_t RH_RF95::_interruptCount = 0; // Index into _deviceForInterrupt for next device
 
+// Registers read by the interrupt handler in a single burst, from FIFO_RX_CURRENT_ADDR
+// through to HOP_CHANNEL
+#define RH_RF95_STATUS_START RH_RF95_REG_10_FIFO_RX_CURRENT_ADDR
+#define RH_RF95_STATUS_LEN (RH_RF95_REG_1C_HOP_CHANNEL - RH_RF95_STATUS_START + 1)
+#define RH_RF95_STATUS(REG) ((REG) - RH_RF95_STATUS_START)
+
 // These are indexed by the values of ModemConfigChoice
 // Stored in flash (program) memory to save SRAM
 PROGMEM static const RH_RF95::ModemConfig MODEM_CONFIG_TABLE[] =
@@ -26,7 +32,21 @@ PROGMEM static const RH_RF95::ModemConfig MODEM_CONFIG_TABLE[] =
 RH_RF95::RH_RF95(uint8_t slaveSelectPin, uint8_t interruptPin, RHGenericSPI& spi)
     :
     RHSPIDriver(slaveSelectPin, spi),
-    _rxBufValid(0)
+    _rxHead(0),
+    _rxTail(0),
+    _rxRingDropped(0),
+    _rxPending(false),
+    _lastRxTime(0),
+    _lastTxTime(0),
+    _shadowValid(false),
+    _txPreloadLen(0),
+    _txQueued(false),
+    _txQueueHead(0),
+    _txQueueTail(0),
+    _txDoneCallback(0),
+    _txDoneContext(0),
+    _interruptCallback(0),
+    _interruptContext(0)
 {
     _interruptPin = interruptPin;
     _myInterruptIndex = 0xff; // Not allocated yet
@@ -123,67 +143,148 @@ bool RH_RF95::init()
 // We use this to get RxDone and TxDone interrupts
 void RH_RF95::handleInterrupt()
 {
-    // Read the interrupt register
-    uint8_t irq_flags = spiRead(RH_RF95_REG_12_IRQ_FLAGS);
-    // Read the RegHopChannel register to check if CRC presence is signalled
-    // in the header. If not it might be a stray (noise) packet.*
-    uint8_t crc_present = spiRead(RH_RF95_REG_1C_HOP_CHANNEL);
+    // Taken before any SPI traffic so it is as close to the event as possible
+    uint32_t now = micros();
+    // Everything the handler needs, from the interrupt flags to the packet RSSI and
+    // the RegHopChannel CRC indication, is in one contiguous block so read it in one go
+    uint8_t status[RH_RF95_STATUS_LEN];
+    spiBurstRead(RH_RF95_STATUS_START, status, sizeof(status));
+    uint8_t irq_flags = status[RH_RF95_STATUS(RH_RF95_REG_12_IRQ_FLAGS)];
+    // Clear just the flags being handled, straight away, so one raised meanwhile raises
+    // its own interrupt
+    spiWrite(RH_RF95_REG_12_IRQ_FLAGS, irq_flags);
+#ifdef RH_RF95_REPEAT_IRQ_CLEAR
+    // Sigh: on some processors, for some unknown reason, doing this only once does not actually
+    // clear the radio's interrupt flag. So we do it twice. Why?
+    spiWrite(RH_RF95_REG_12_IRQ_FLAGS, irq_flags);
+#endif
+    // Check if CRC presence is signalled in the header. If not it might be a stray (noise) packet.
+    uint8_t crc_present = status[RH_RF95_STATUS(RH_RF95_REG_1C_HOP_CHANNEL)];
 
     if (_mode == RHModeRx
 	&& ((irq_flags & (RH_RF95_RX_TIMEOUT | RH_RF95_PAYLOAD_CRC_ERROR))
 	    | !(crc_present & RH_RF95_RX_PAYLOAD_CRC_IS_ON)))
-//    if (_mode == RHModeRx && irq_flags & (RH_RF95_RX_TIMEOUT | RH_RF95_PAYLOAD_CRC_ERROR))
     {
 	_rxBad++;
     }
     else if (_mode == RHModeRx && irq_flags & RH_RF95_RX_DONE)
     {
-	// Have received a packet
-	uint8_t len = spiRead(RH_RF95_REG_13_RX_NB_BYTES);
-
-	// Reset the fifo read ptr to the beginning of the packet
-	spiWrite(RH_RF95_REG_0D_FIFO_ADDR_PTR, spiRead(RH_RF95_REG_10_FIFO_RX_CURRENT_ADDR));
-	spiBurstRead(RH_RF95_REG_00_FIFO, _buf, len);
-	_bufLen = len;
-	spiWrite(RH_RF95_REG_12_IRQ_FLAGS, 0xff); // Clear all IRQ flags
-
-	// Remember the last signal to noise ratio, LORA mode
-	// Per page 111, SX1276/77/78/79 datasheet
-	_lastSNR = (int8_t)spiRead(RH_RF95_REG_19_PKT_SNR_VALUE) / 4;
-
-	// Remember the RSSI of this packet, LORA mode
-	// this is according to the doc, but is it really correct?
-	// weakest receiveable signals are reported RSSI at about -66
-	_lastRssi = spiRead(RH_RF95_REG_1A_PKT_RSSI_VALUE);
-	// Adjust the RSSI, datasheet page 87
-	if (_lastSNR < 0)
-	    _lastRssi = _lastRssi + _lastSNR;
-	else
-	    _lastRssi = (int)_lastRssi * 16 / 15;
-	if (_usingHFport)
-	    _lastRssi -= 157;
-	else
-	    _lastRssi -= 164;
-	    
-	// We have received a message.
-	validateRxBuf(); 
-	if (_rxBufValid)
-	    setModeIdle(); // Got one 
+	handleRxDone(status, now);
     }
     else if (_mode == RHModeTx && irq_flags & RH_RF95_TX_DONE)
     {
+	_lastTxTime = now;
 	_txGood++;
-	setModeIdle();
+	// Straight into the next one if there is one, staying in Tx
+	if (_txQueued)
+	    startQueuedTx();
+	else if (_txQueueHead != _txQueueTail)
+	    startNextTx();
+	else
+	    setModeIdle();
+	if (_txDoneCallback)
+	    _txDoneCallback(_txDoneContext, now);
     }
     else if (_mode == RHModeCad && irq_flags & RH_RF95_CAD_DONE)
     {
         _cad = irq_flags & RH_RF95_CAD_DETECTED;
         setModeIdle();
     }
-    // Sigh: on some processors, for some unknown reason, doing this only once does not actually
-    // clear the radio's interrupt flag. So we do it twice. Why?
-    spiWrite(RH_RF95_REG_12_IRQ_FLAGS, 0xff); // Clear all IRQ flags
-    spiWrite(RH_RF95_REG_12_IRQ_FLAGS, 0xff); // Clear all IRQ flags
+    if (_interruptCallback)
+	_interruptCallback(_interruptContext);
+}
+
+// Have received a packet, the receiver stays on so it goes in the next free
+// slot of the ring until recv() collects it
+void RH_RF95::handleRxDone(const uint8_t* status, uint32_t now)
+{
+    uint8_t fifo_addr = status[RH_RF95_STATUS(RH_RF95_REG_10_FIFO_RX_CURRENT_ADDR)];
+    uint8_t len = status[RH_RF95_STATUS(RH_RF95_REG_13_RX_NB_BYTES)];
+#if RH_RF95_DEFER_FIFO_READ
+    // The previous message is still in the FIFO, take it before anything else can arrive
+    if (_rxPending)
+    {
+	ATOMIC_BLOCK_START;
+	_spi.beginTransaction();
+	readPendingRx(fifo_addr, len);
+	_spi.endTransaction();
+	ATOMIC_BLOCK_END;
+    }
+#endif
+    uint8_t head = _rxHead;
+    if ((uint8_t)(head - _rxTail) >= RH_RF95_RX_RING_LEN)
+    {
+	_rxRingDropped++;
+	return;
+    }
+    RxSlot* slot = &_rxRing[head % RH_RF95_RX_RING_LEN];
+    slot->time = now;
+    slot->len = len;
+    slot->fifoAddr = fifo_addr;
+
+    // Remember the signal to noise ratio, LORA mode
+    // Per page 111, SX1276/77/78/79 datasheet
+    slot->snr = (int8_t)status[RH_RF95_STATUS(RH_RF95_REG_19_PKT_SNR_VALUE)] / 4;
+
+    // Remember the RSSI of this packet, LORA mode
+    // this is according to the doc, but is it really correct?
+    // weakest receiveable signals are reported RSSI at about -66
+    slot->rssi = status[RH_RF95_STATUS(RH_RF95_REG_1A_PKT_RSSI_VALUE)];
+    // Adjust the RSSI, datasheet page 87
+    if (slot->snr < 0)
+	slot->rssi = slot->rssi + slot->snr;
+    else
+	slot->rssi = (int)slot->rssi * 16 / 15;
+    if (_usingHFport)
+	slot->rssi -= 157;
+    else
+	slot->rssi -= 164;
+
+#if RH_RF95_DEFER_FIFO_READ
+    // Left in the FIFO for available() to read outside of the interrupt
+    _rxPending = true;
+#else
+    ATOMIC_BLOCK_START;
+    _spi.beginTransaction();
+    _rxPending = true;
+    readPendingRx(fifo_addr, 0);
+    _spi.endTransaction();
+    ATOMIC_BLOCK_END;
+#endif
+}
+
+// Reads the pending message from the FIFO into its slot and publishes it, unless a later
+// message of 'next_len' bytes at 'next_addr' has since overwritten it.
+// The caller must hold the SPI transaction and keep the interrupt handler out.
+void RH_RF95::readPendingRx(uint8_t next_addr, uint8_t next_len)
+{
+    RxSlot* slot = &_rxRing[_rxHead % RH_RF95_RX_RING_LEN];
+    _rxPending = false;
+    // Messages are placed one after the other around the FIFO
+    uint8_t next_offset = next_addr - slot->fifoAddr;
+    uint8_t slot_offset = slot->fifoAddr - next_addr;
+    if (next_len > 0 && (next_offset < slot->len || slot_offset < next_len))
+    {
+	_rxRingDropped++;
+	return;
+    }
+    // Position the fifo read ptr at the beginning of the packet, then read it all
+    digitalWrite(_slaveSelectPin, LOW);
+    _spi.transfer(RH_RF95_REG_0D_FIFO_ADDR_PTR | RH_SPI_WRITE_MASK);
+    _spi.transfer(slot->fifoAddr);
+    digitalWrite(_slaveSelectPin, HIGH);
+    digitalWrite(_slaveSelectPin, LOW);
+    _spi.transfer(RH_RF95_REG_00_FIFO & ~RH_SPI_WRITE_MASK);
+    for (uint8_t i = 0; i < slot->len; i++)
+	slot->buf[i] = _spi.transfer(0);
+    digitalWrite(_slaveSelectPin, HIGH);
+
+    // We have received a message, only publish it once complete
+    if (validateRxBuf(slot))
+    {
+	_rxGood++;
+	_rxHead = _rxHead + 1;
+    }
 }
 
 // These are low level functions that call the interrupt handler for the correct
@@ -205,65 +306,107 @@ void RH_RF95::isr2()
 	_deviceForInterrupt[2]->handleInterrupt();
 }
 
-// Check whether the latest received message is complete and uncorrupted
-void RH_RF95::validateRxBuf()
+// Check whether a received message is complete and for this node
+bool RH_RF95::validateRxBuf(const RxSlot* slot)
 {
-    if (_bufLen < 4)
-	return; // Too short to be a real message
-    // Extract the 4 headers
-    _rxHeaderTo    = _buf[0];
-    _rxHeaderFrom  = _buf[1];
-    _rxHeaderId    = _buf[2];
-    _rxHeaderFlags = _buf[3];
-    if (_promiscuous ||
-	_rxHeaderTo == _thisAddress ||
-	_rxHeaderTo == RH_BROADCAST_ADDRESS)
-    {
-	_rxGood++;
-	_rxBufValid = true;
-    }
+    if (slot->len < RH_RF95_HEADER_LEN)
+	return false; // Too short to be a real message
+    uint8_t headerTo = slot->buf[0];
+    return _promiscuous ||
+	headerTo == _thisAddress ||
+	headerTo == RH_BROADCAST_ADDRESS;
 }
 
 bool RH_RF95::available()
 {
+#if RH_RF95_DEFER_FIFO_READ
+    if (_rxPending)
+    {
+	// Bottom half of the interrupt handler. The SPI transaction masks this radio's
+	// interrupt, leaving every other interrupt free to run during the FIFO read
+#if !defined(SPI_HAS_TRANSACTION)
+	ATOMIC_BLOCK_START;
+#endif
+	_spi.beginTransaction();
+	if (_rxPending)
+	    readPendingRx(0, 0);
+	_spi.endTransaction();
+#if !defined(SPI_HAS_TRANSACTION)
+	ATOMIC_BLOCK_END;
+#endif
+    }
+#endif
     if (_mode == RHModeTx)
 	return false;
     setModeRx();
-    return _rxBufValid; // Will be set by the interrupt handler when a good message is received
+    return _rxHead != _rxTail; // Will be advanced by the interrupt handler when a good message is received
 }
 
 void RH_RF95::clearRxBuf()
 {
-    ATOMIC_BLOCK_START;
-    _rxBufValid = false;
-    _bufLen = 0;
-    ATOMIC_BLOCK_END;
+    // Only the tail is ours, a message arriving meanwhile is simply kept
+    _rxTail = _rxHead;
 }
 
 bool RH_RF95::recv(uint8_t* buf, uint8_t* len)
 {
-    if (!available())
+    RHRxView view;
+    if (!borrow(&view))
 	return false;
     if (buf && len)
     {
-	ATOMIC_BLOCK_START;
-	// Skip the 4 headers that are at the beginning of the rxBuf
-	if (*len > _bufLen-RH_RF95_HEADER_LEN)
-	    *len = _bufLen-RH_RF95_HEADER_LEN;
-	memcpy(buf, _buf+RH_RF95_HEADER_LEN, *len);
-	ATOMIC_BLOCK_END;
+	if (*len > view.len)
+	    *len = view.len;
+	memcpy(buf, view.data, *len);
     }
-    clearRxBuf(); // This message accepted and cleared
+    release(); // This message accepted, the slot can be reused
     return true;
 }
 
+bool RH_RF95::borrow(RHRxView* view)
+{
+    if (!available())
+	return false;
+    // The interrupt handler never writes the slot at the tail, so no need to lock
+    RxSlot* slot = &_rxRing[_rxTail % RH_RF95_RX_RING_LEN];
+    // Extract the 4 headers
+    _rxHeaderTo    = slot->buf[0];
+    _rxHeaderFrom  = slot->buf[1];
+    _rxHeaderId    = slot->buf[2];
+    _rxHeaderFlags = slot->buf[3];
+    _lastRssi      = slot->rssi;
+    _lastSNR       = slot->snr;
+    _lastRxTime    = slot->time;
+    view->headerTo    = _rxHeaderTo;
+    view->headerFrom  = _rxHeaderFrom;
+    view->headerId    = _rxHeaderId;
+    view->headerFlags = _rxHeaderFlags;
+    // Skip the 4 headers that are at the beginning of the slot
+    view->data = slot->buf + RH_RF95_HEADER_LEN;
+    view->len  = slot->len - RH_RF95_HEADER_LEN;
+    view->rssi = slot->rssi;
+    view->snr  = slot->snr;
+    view->time = slot->time;
+    return true;
+}
+
+void RH_RF95::release()
+{
+    if (_rxTail != _rxHead)
+	_rxTail = _rxTail + 1;
+}
+
 bool RH_RF95::send(const uint8_t* data, uint8_t len)
 {
     if (len > RH_RF95_MAX_MESSAGE_LEN)
 	return false;
 
     waitPacketSent(); // Make sure we dont interrupt an outgoing message
+    ATOMIC_BLOCK_START;
     setModeIdle();
+    takePendingRx();
+    ATOMIC_BLOCK_END;
+    _txPreloadLen = 0; // About to be overwritten
 
     if (!waitCAD()) 
 	return false;  // Check channel activity
@@ -284,6 +427,167 @@ bool RH_RF95::send(const uint8_t* data, uint8_t len)
     return true;
 }
 
+bool RH_RF95::sendAsync(const uint8_t* data, uint8_t len)
+{
+    if (len > RH_RF95_MAX_MESSAGE_LEN)
+	return false;
+    if ((uint8_t)(_txQueueHead - _txQueueTail) >= RH_RF95_TX_QUEUE_LEN)
+	return false; // Full
+
+    uint8_t* buf = _txQueue[_txQueueHead & (RH_RF95_TX_QUEUE_LEN - 1)].buf;
+    buf[0] = _txHeaderTo;
+    buf[1] = _txHeaderFrom;
+    buf[2] = _txHeaderId;
+    buf[3] = _txHeaderFlags;
+    memcpy(buf + RH_RF95_HEADER_LEN, data, len);
+    _txQueue[_txQueueHead & (RH_RF95_TX_QUEUE_LEN - 1)].len = len + RH_RF95_HEADER_LEN;
+
+    // Decided with interrupts off so a TxDone can't come between publishing and checking
+    ATOMIC_BLOCK_START;
+    _txQueueHead++;
+    if (_mode != RHModeTx)
+    {
+	setModeIdle();
+	takePendingRx();
+	startNextTx();
+    }
+    ATOMIC_BLOCK_END;
+    return true;
+}
+
+uint8_t RH_RF95::txQueueDepth()
+{
+    return _txQueueHead - _txQueueTail;
+}
+
+void RH_RF95::setTxDoneCallback(RHTxDoneCallback callback, void* context)
+{
+    ATOMIC_BLOCK_START;
+    _txDoneCallback = callback;
+    _txDoneContext = context;
+    ATOMIC_BLOCK_END;
+}
+
+void RH_RF95::setInterruptCallback(RHInterruptCallback callback, void* context)
+{
+    ATOMIC_BLOCK_START;
+    _interruptCallback = callback;
+    _interruptContext = context;
+    ATOMIC_BLOCK_END;
+}
+
+// A received message still waiting in the FIFO must be read before the FIFO is used
+// for transmitting. Called with interrupts off and the radio no longer receiving
+void RH_RF95::takePendingRx()
+{
+#if RH_RF95_DEFER_FIFO_READ
+    if (_rxPending)
+    {
+	_spi.beginTransaction();
+	readPendingRx(0, 0);
+	_spi.endTransaction();
+    }
+#endif
+}
+
+// Called by the interrupt handler on TxDone, or with interrupts off
+void RH_RF95::startNextTx()
+{
+    const uint8_t slot = _txQueueTail & (RH_RF95_TX_QUEUE_LEN - 1);
+    _txPreloadLen = 0; // About to be overwritten
+    spiWrite(RH_RF95_REG_0D_FIFO_ADDR_PTR, 0);
+    spiBurstWrite(RH_RF95_REG_00_FIFO, _txQueue[slot].buf, _txQueue[slot].len);
+    spiWrite(RH_RF95_REG_22_PAYLOAD_LENGTH, _txQueue[slot].len);
+    _txQueueTail++;
+    spiWrite(RH_RF95_REG_01_OP_MODE, RH_RF95_MODE_TX);
+    if (_mode != RHModeTx)
+    {
+	spiWrite(RH_RF95_REG_40_DIO_MAPPING1, 0x40); // Interrupt on TxDone
+	_mode = RHModeTx;
+    }
+}
+
+bool RH_RF95::preloadPacket(const uint8_t* data, uint8_t len)
+{
+    if (len > RH_RF95_MAX_MESSAGE_LEN)
+	return false;
+
+    waitPacketSent(); // Make sure we dont interrupt an outgoing message
+    ATOMIC_BLOCK_START;
+    setModeIdle();
+    takePendingRx();
+    ATOMIC_BLOCK_END;
+
+    // The whole packet image, headers then message data, from the beginning of the FIFO
+    uint8_t headers[RH_RF95_HEADER_LEN] = { _txHeaderTo, _txHeaderFrom, _txHeaderId, _txHeaderFlags };
+    spiWrite(RH_RF95_REG_0D_FIFO_ADDR_PTR, 0);
+    spiBurstWrite(RH_RF95_REG_00_FIFO, headers, RH_RF95_HEADER_LEN);
+    spiBurstWrite(RH_RF95_REG_00_FIFO, data, len);
+    spiWrite(RH_RF95_REG_22_PAYLOAD_LENGTH, len + RH_RF95_HEADER_LEN);
+    _txPreloadLen = len + RH_RF95_HEADER_LEN;
+    return true;
+}
+
+bool RH_RF95::sendPreloaded(uint8_t offset, const uint8_t* bytes, uint8_t len)
+{
+    waitPacketSent(); // Make sure we dont interrupt an outgoing message
+    setModeIdle();
+    if (_txPreloadLen == 0 || offset + len > _txPreloadLen)
+	return false;
+
+    if (!waitCAD()) 
+	return false;  // Check channel activity
+
+    ATOMIC_BLOCK_START;
+    _txPatchOffset = offset;
+    _txPatchLen = len;
+    memcpy(_txPatch, bytes, len);
+    startQueuedTx();
+    ATOMIC_BLOCK_END;
+    return true;
+}
+
+bool RH_RF95::queuePreloaded(uint8_t offset, const uint8_t* bytes, uint8_t len)
+{
+    if (_txPreloadLen == 0 || offset + len > _txPreloadLen || len > RH_RF95_TX_PATCH_LEN)
+	return false;
+
+    // Decided with interrupts off so a TxDone can't come between checking and queueing
+    bool queued = false;
+    bool transmitting;
+    ATOMIC_BLOCK_START;
+    transmitting = _mode == RHModeTx;
+    if (transmitting && !_txQueued && _txPreloadLen != 0)
+    {
+	_txPatchOffset = offset;
+	_txPatchLen = len;
+	memcpy(_txPatch, bytes, len);
+	_txQueued = true;
+	queued = true;
+    }
+    ATOMIC_BLOCK_END;
+    if (!transmitting)
+	return sendPreloaded(offset, bytes, len);
+    return queued;
+}
+
+// Rewrites the patch into the preloaded packet and starts transmitting it.
+// Called by the interrupt handler on TxDone, or with interrupts off.
+void RH_RF95::startQueuedTx()
+{
+    _txQueued = false;
+    spiWrite(RH_RF95_REG_0D_FIFO_ADDR_PTR, _txPatchOffset);
+    spiBurstWrite(RH_RF95_REG_00_FIFO, _txPatch, _txPatchLen);
+    // Transmission reads the packet from the start of the FIFO
+    spiWrite(RH_RF95_REG_0D_FIFO_ADDR_PTR, 0);
+    spiWrite(RH_RF95_REG_01_OP_MODE, RH_RF95_MODE_TX);
+    if (_mode != RHModeTx)
+    {
+	spiWrite(RH_RF95_REG_40_DIO_MAPPING1, 0x40); // Interrupt on TxDone
+	_mode = RHModeTx;
+    }
+}
+
 bool RH_RF95::printRegisters()
 {
 #ifdef RH_HAVE_SERIAL
@@ -313,6 +617,7 @@ bool RH_RF95::setFrequency(float centre)
     spiWrite(RH_RF95_REG_07_FRF_MID, (frf >> 8) & 0xff);
     spiWrite(RH_RF95_REG_08_FRF_LSB, frf & 0xff);
     _usingHFport = (centre >= 779.0);
+    _shadowValid = false;
 
     return true;
 }
@@ -330,6 +635,7 @@ bool RH_RF95::sleep()
 {
     if (_mode != RHModeSleep)
     {
+	_txPreloadLen = 0; // The FIFO is cleared in sleep mode
 	spiWrite(RH_RF95_REG_01_OP_MODE, RH_RF95_MODE_SLEEP);
 	_mode = RHModeSleep;
     }
@@ -340,6 +646,7 @@ void RH_RF95::setModeRx()
 {
     if (_mode != RHModeRx)
     {
+	_txPreloadLen = 0; // Received packets share the FIFO
 	spiWrite(RH_RF95_REG_01_OP_MODE, RH_RF95_MODE_RXCONTINUOUS);
 	spiWrite(RH_RF95_REG_40_DIO_MAPPING1, 0x00); // Interrupt on RxDone
 	_mode = RHModeRx;
@@ -370,32 +677,42 @@ void RH_RF95::setTxPower(int8_t power, bool useRFO)
     }
     else
     {
-	if (power > 23)
-	    power = 23;
-	if (power < 5)
-	    power = 5;
-
-	// For RH_RF95_PA_DAC_ENABLE, manual says '+20dBm on PA_BOOST when OutputPower=0xf'
-	// RH_RF95_PA_DAC_ENABLE actually adds about 3dBm to all power levels. We will us it
-	// for 21, 22 and 23dBm
-	if (power > 20)
-	{
-	    spiWrite(RH_RF95_REG_4D_PA_DAC, RH_RF95_PA_DAC_ENABLE);
-	    power -= 3;
-	}
-	else
-	{
-	    spiWrite(RH_RF95_REG_4D_PA_DAC, RH_RF95_PA_DAC_DISABLE);
-	}
-
-	// RFM95/96/97/98 does not have RFO pins connected to anything. Only PA_BOOST
-	// pin is connected, so must use PA_BOOST
-	// Pout = 2 + OutputPower.
-	// The documentation is pretty confusing on this topic: PaSelect says the max power is 20dBm,
-	// but OutputPower claims it would be 17dBm.
-	// My measurements show 20dBm is correct
-	spiWrite(RH_RF95_REG_09_PA_CONFIG, RH_RF95_PA_SELECT | (power-5));
+	uint8_t paDac;
+	uint8_t paConfig = paBoostRegisters(power, &paDac);
+	spiWrite(RH_RF95_REG_4D_PA_DAC, paDac);
+	spiWrite(RH_RF95_REG_09_PA_CONFIG, paConfig);
+    }
+    _shadowValid = false;
+}
+
+// Register values for a PA_BOOST output power
+uint8_t RH_RF95::paBoostRegisters(int8_t power, uint8_t* paDac)
+{
+    if (power > 23)
+	power = 23;
+    if (power < 5)
+	power = 5;
+
+    // For RH_RF95_PA_DAC_ENABLE, manual says '+20dBm on PA_BOOST when OutputPower=0xf'
+    // RH_RF95_PA_DAC_ENABLE actually adds about 3dBm to all power levels. We will us it
+    // for 21, 22 and 23dBm
+    if (power > 20)
+    {
+	*paDac = RH_RF95_PA_DAC_ENABLE;
+	power -= 3;
+    }
+    else
+    {
+	*paDac = RH_RF95_PA_DAC_DISABLE;
     }
+
+    // RFM95/96/97/98 does not have RFO pins connected to anything. Only PA_BOOST
+    // pin is connected, so must use PA_BOOST
+    // Pout = 2 + OutputPower.
+    // The documentation is pretty confusing on this topic: PaSelect says the max power is 20dBm,
+    // but OutputPower claims it would be 17dBm.
+    // My measurements show 20dBm is correct
+    return RH_RF95_PA_SELECT | (power-5);
 }
 
 // Sets registers from a canned modem configuration structure
@@ -404,6 +721,7 @@ void RH_RF95::setModemRegisters(const ModemConfig* config)
     spiWrite(RH_RF95_REG_1D_MODEM_CONFIG1,       config->reg_1d);
     spiWrite(RH_RF95_REG_1E_MODEM_CONFIG2,       config->reg_1e);
     spiWrite(RH_RF95_REG_26_MODEM_CONFIG3,       config->reg_26);
+    _shadowValid = false;
 }
 
 // Set one of the canned FSK Modem configs
@@ -424,6 +742,7 @@ void RH_RF95::setPreambleLength(uint16_t bytes)
 {
     spiWrite(RH_RF95_REG_20_PREAMBLE_MSB, bytes >> 8);
     spiWrite(RH_RF95_REG_21_PREAMBLE_LSB, bytes & 0xff);
+    _shadowValid = false;
 }
 
 bool RH_RF95::isChannelActive()
@@ -485,6 +804,21 @@ int RH_RF95::lastSNR()
     return _lastSNR;
 }
 
+uint32_t RH_RF95::lastRxTime()
+{
+    return _lastRxTime;
+}
+
+uint32_t RH_RF95::lastTxTime()
+{
+    return _lastTxTime;
+}
+
+uint16_t RH_RF95::rxRingDropped()
+{
+    return _rxRingDropped;
+}
+
  ///////////////////////////////////////////////////
  //
  // additions below by Brian Norman 9th Nov 2018
@@ -497,89 +831,108 @@ int RH_RF95::lastSNR()
  
  void RH_RF95::setSpreadingFactor(uint8_t sf)
  {
-   if (sf <= 6) 
-     sf = RH_RF95_SPREADING_FACTOR_64CPS;
-   else if (sf == 7) 
-     sf = RH_RF95_SPREADING_FACTOR_128CPS;
-   else if (sf == 8) 
-     sf = RH_RF95_SPREADING_FACTOR_256CPS;
-   else if (sf == 9)
-     sf = RH_RF95_SPREADING_FACTOR_512CPS;
-   else if (sf == 10)
-     sf = RH_RF95_SPREADING_FACTOR_1024CPS;
-   else if (sf == 11) 
-     sf = RH_RF95_SPREADING_FACTOR_2048CPS;
-   else if (sf >= 12)
-     sf =  RH_RF95_SPREADING_FACTOR_4096CPS;
- 
    // set the new spreading factor
-   spiWrite(RH_RF95_REG_1E_MODEM_CONFIG2, (spiRead(RH_RF95_REG_1E_MODEM_CONFIG2) & ~RH_RF95_SPREADING_FACTOR) | sf);
+   spiWrite(RH_RF95_REG_1E_MODEM_CONFIG2, (spiRead(RH_RF95_REG_1E_MODEM_CONFIG2) & ~RH_RF95_SPREADING_FACTOR) | spreadingFactorBits(sf));
    // check if Low data Rate bit should be set or cleared
    setLowDatarate();
  }
+
+uint8_t RH_RF95::spreadingFactorBits(uint8_t sf)
+{
+    if (sf <= 6) 
+	return RH_RF95_SPREADING_FACTOR_64CPS;
+    else if (sf == 7) 
+	return RH_RF95_SPREADING_FACTOR_128CPS;
+    else if (sf == 8) 
+	return RH_RF95_SPREADING_FACTOR_256CPS;
+    else if (sf == 9)
+	return RH_RF95_SPREADING_FACTOR_512CPS;
+    else if (sf == 10)
+	return RH_RF95_SPREADING_FACTOR_1024CPS;
+    else if (sf == 11) 
+	return RH_RF95_SPREADING_FACTOR_2048CPS;
+    else
+	return RH_RF95_SPREADING_FACTOR_4096CPS;
+}
  
 void RH_RF95::setSignalBandwidth(long sbw)
 {
-    uint8_t bw; //register bit pattern
- 
+    // top 4 bits of reg 1D control bandwidth
+    spiWrite(RH_RF95_REG_1D_MODEM_CONFIG1, (spiRead(RH_RF95_REG_1D_MODEM_CONFIG1) & ~RH_RF95_BW) | bandwidthBits(sbw));
+    // check if low data rate bit should be set or cleared
+    setLowDatarate();
+}
+
+uint8_t RH_RF95::bandwidthBits(long sbw)
+{
     if (sbw <= 7800)
-	bw = RH_RF95_BW_7_8KHZ;
+	return RH_RF95_BW_7_8KHZ;
     else if (sbw <= 10400)
-	bw =  RH_RF95_BW_10_4KHZ;
+	return RH_RF95_BW_10_4KHZ;
     else if (sbw <= 15600)
-	bw = RH_RF95_BW_15_6KHZ ;
+	return RH_RF95_BW_15_6KHZ ;
     else if (sbw <= 20800)
-	bw = RH_RF95_BW_20_8KHZ;
+	return RH_RF95_BW_20_8KHZ;
     else if (sbw <= 31250)
-	bw = RH_RF95_BW_31_25KHZ;
+	return RH_RF95_BW_31_25KHZ;
     else if (sbw <= 41700)
-	bw = RH_RF95_BW_41_7KHZ;
+	return RH_RF95_BW_41_7KHZ;
     else if (sbw <= 62500)
-	bw = RH_RF95_BW_62_5KHZ;
+	return RH_RF95_BW_62_5KHZ;
     else if (sbw <= 125000)
-	bw = RH_RF95_BW_125KHZ;
+	return RH_RF95_BW_125KHZ;
     else if (sbw <= 250000)
-	bw = RH_RF95_BW_250KHZ;
+	return RH_RF95_BW_250KHZ;
     else 
-	bw =  RH_RF95_BW_500KHZ;
-     
-    // top 4 bits of reg 1D control bandwidth
-    spiWrite(RH_RF95_REG_1D_MODEM_CONFIG1, (spiRead(RH_RF95_REG_1D_MODEM_CONFIG1) & ~RH_RF95_BW) | bw);
-    // check if low data rate bit should be set or cleared
-    setLowDatarate();
+	return RH_RF95_BW_500KHZ;
 }
  
 void RH_RF95::setCodingRate4(uint8_t denominator)
 {
-    int cr;
- 
+    // CR is bits 3..1 of RH_RF95_REG_1D_MODEM_CONFIG1
+    spiWrite(RH_RF95_REG_1D_MODEM_CONFIG1, (spiRead(RH_RF95_REG_1D_MODEM_CONFIG1) & ~RH_RF95_CODING_RATE) | codingRateBits(denominator));
+    _shadowValid = false;
+}
+
+uint8_t RH_RF95::codingRateBits(uint8_t denominator)
+{
     if (denominator <= 5)
-	cr=RH_RF95_CODING_RATE_4_5;
+	return RH_RF95_CODING_RATE_4_5;
     else if (denominator == 6)
-	cr = RH_RF95_CODING_RATE_4_6;
+	return RH_RF95_CODING_RATE_4_6;
     else if (denominator == 7)
-	cr = RH_RF95_CODING_RATE_4_7;
-    else if (denominator >= 8)
-	cr = RH_RF95_CODING_RATE_4_8;
- 
-    // CR is bits 3..1 of RH_RF95_REG_1D_MODEM_CONFIG1
-    spiWrite(RH_RF95_REG_1D_MODEM_CONFIG1, (spiRead(RH_RF95_REG_1D_MODEM_CONFIG1) & ~RH_RF95_CODING_RATE) | cr);
+	return RH_RF95_CODING_RATE_4_7;
+    else
+	return RH_RF95_CODING_RATE_4_8;
 }
  
 void RH_RF95::setLowDatarate()
 {
     // called after changing bandwidth and/or spreading factor
+    // the LDR is bit 3 of RH_RF95_REG_26_MODEM_CONFIG3
+    uint8_t current = spiRead(RH_RF95_REG_26_MODEM_CONFIG3) & ~RH_RF95_LOW_DATA_RATE_OPTIMIZE; // mask off the LDR bit
+    if (lowDatarateRequired(spiRead(RH_RF95_REG_1D_MODEM_CONFIG1), spiRead(RH_RF95_REG_1E_MODEM_CONFIG2)))
+	spiWrite(RH_RF95_REG_26_MODEM_CONFIG3, current | RH_RF95_LOW_DATA_RATE_OPTIMIZE);
+    else
+	spiWrite(RH_RF95_REG_26_MODEM_CONFIG3, current);
+    _shadowValid = false;
+}
+
+bool RH_RF95::lowDatarateRequired(uint8_t modemConfig1, uint8_t modemConfig2)
+{
     //  Semtech modem design guide AN1200.13 says 
     // "To avoid issues surrounding  drift  of  the  crystal  reference  oscillator  due  to  either  temperature  change  
     // or  motion,the  low  data  rate optimization  bit  is  used. Specifically for 125  kHz  bandwidth  and  SF  =  11  and  12,  
     // this  adds  a  small  overhead  to increase robustness to reference frequency variations over the timescale of the LoRa packet."
  
-    // read current value for BW and SF
-    uint8_t BW = spiRead(RH_RF95_REG_1D_MODEM_CONFIG1) >> 4;	// bw is in bits 7..4
-    uint8_t SF = spiRead(RH_RF95_REG_1E_MODEM_CONFIG2) >> 4;	// sf is in bits 7..4
+    // BW and SF from their register values
+    uint8_t BW = modemConfig1 >> 4;	// bw is in bits 7..4
+    uint8_t SF = modemConfig2 >> 4;	// sf is in bits 7..4
    
     // calculate symbol time (see Semtech AN1200.22 section 4)
     float bw_tab[] = {7800, 10400, 15600, 20800, 31250, 41700, 62500, 125000, 250000, 500000};
+    if (BW >= (sizeof(bw_tab) / sizeof(float)))
+	return false;
    
     float bandwidth = bw_tab[BW];
    
@@ -590,14 +943,7 @@ void RH_RF95::setLowDatarate()
     // https://www.thethingsnetwork.org/forum/t/a-point-to-note-lora-low-data-rate-optimisation-flag/12007
     // the LDR bit should be set if the Symbol Time is > 16ms
     // So the threshold used here is 16.0ms
- 
-    // the LDR is bit 3 of RH_RF95_REG_26_MODEM_CONFIG3
-    uint8_t current = spiRead(RH_RF95_REG_26_MODEM_CONFIG3) & ~RH_RF95_LOW_DATA_RATE_OPTIMIZE; // mask off the LDR bit
-    if (symbolTime > 16.0)
-	spiWrite(RH_RF95_REG_26_MODEM_CONFIG3, current | RH_RF95_LOW_DATA_RATE_OPTIMIZE);
-    else
-	spiWrite(RH_RF95_REG_26_MODEM_CONFIG3, current);
-   
+    return symbolTime > 16.0;
 }
  
 void RH_RF95::setPayloadCRC(bool on)
@@ -609,5 +955,72 @@ void RH_RF95::setPayloadCRC(bool on)
 	spiWrite(RH_RF95_REG_1E_MODEM_CONFIG2, current | RH_RF95_PAYLOAD_CRC_ON);
     else
 	spiWrite(RH_RF95_REG_1E_MODEM_CONFIG2, current);
+    _shadowValid = false;
+}
+
+void RH_RF95::compileRegisters(float centre, uint8_t sf, int8_t power, long sbw, uint8_t denominator,
+			       uint16_t preamble, bool crc, RegisterImage* image)
+{
+    // Bits this doesn't control keep the radio's current values
+    readShadow();
+    *image = _shadow;
+    // Frf = FRF / FSTEP
+    uint32_t frf = (centre * 1000000.0) / RH_RF95_FSTEP;
+    image->frf[0] = (frf >> 16) & 0xff;
+    image->frf[1] = (frf >> 8) & 0xff;
+    image->frf[2] = frf & 0xff;
+    image->usingHFport = (centre >= 779.0);
+    image->paConfig = paBoostRegisters(power, &image->paDac);
+    uint8_t* modem = image->modem;
+    modem[RH_RF95_REG_1D_MODEM_CONFIG1 - RH_RF95_REG_1D_MODEM_CONFIG1] =
+	(modem[0] & ~(RH_RF95_BW | RH_RF95_CODING_RATE)) | bandwidthBits(sbw) | codingRateBits(denominator);
+    modem[RH_RF95_REG_1E_MODEM_CONFIG2 - RH_RF95_REG_1D_MODEM_CONFIG1] =
+	(modem[1] & ~(RH_RF95_SPREADING_FACTOR | RH_RF95_PAYLOAD_CRC_ON)) | spreadingFactorBits(sf) |
+	(crc ? RH_RF95_PAYLOAD_CRC_ON : 0);
+    modem[RH_RF95_REG_20_PREAMBLE_MSB - RH_RF95_REG_1D_MODEM_CONFIG1] = preamble >> 8;
+    modem[RH_RF95_REG_21_PREAMBLE_LSB - RH_RF95_REG_1D_MODEM_CONFIG1] = preamble & 0xff;
+    image->modemConfig3 = image->modemConfig3 & ~RH_RF95_LOW_DATA_RATE_OPTIMIZE;
+    if (lowDatarateRequired(modem[0], modem[1]))
+	image->modemConfig3 |= RH_RF95_LOW_DATA_RATE_OPTIMIZE;
+}
+
+void RH_RF95::applyRegisters(const RegisterImage* image)
+{
+    readShadow();
+    writeChangedRegisters(RH_RF95_REG_06_FRF_MSB, image->frf, _shadow.frf, sizeof(image->frf));
+    writeChangedRegisters(RH_RF95_REG_09_PA_CONFIG, &image->paConfig, &_shadow.paConfig, 1);
+    writeChangedRegisters(RH_RF95_REG_1D_MODEM_CONFIG1, image->modem, _shadow.modem, sizeof(image->modem));
+    writeChangedRegisters(RH_RF95_REG_26_MODEM_CONFIG3, &image->modemConfig3, &_shadow.modemConfig3, 1);
+    writeChangedRegisters(RH_RF95_REG_4D_PA_DAC, &image->paDac, &_shadow.paDac, 1);
+    _usingHFport = _shadow.usingHFport = image->usingHFport;
+}
+
+// Refreshes the shadow from the radio if a register has been written around it
+void RH_RF95::readShadow()
+{
+    if (_shadowValid)
+	return;
+    spiBurstRead(RH_RF95_REG_06_FRF_MSB, _shadow.frf, sizeof(_shadow.frf));
+    _shadow.paConfig = spiRead(RH_RF95_REG_09_PA_CONFIG);
+    spiBurstRead(RH_RF95_REG_1D_MODEM_CONFIG1, _shadow.modem, sizeof(_shadow.modem));
+    _shadow.modemConfig3 = spiRead(RH_RF95_REG_26_MODEM_CONFIG3);
+    _shadow.paDac = spiRead(RH_RF95_REG_4D_PA_DAC);
+    _shadow.usingHFport = _usingHFport;
+    _shadowValid = true;
+}
+
+// Writes the span of contiguous registers from the first to the last that differ, in one burst
+void RH_RF95::writeChangedRegisters(uint8_t reg, const uint8_t* values, uint8_t* shadow, uint8_t len)
+{
+    uint8_t first = 0;
+    while (first < len && values[first] == shadow[first])
+	first++;
+    if (first == len)
+	return;
+    uint8_t last = len - 1;
+    while (values[last] == shadow[last])
+	last--;
+    spiBurstWrite(reg + first, values + first, last - first + 1);
+    memcpy(shadow + first, values + first, last - first + 1);
 }
  
@@ -36,6 +36,38 @@
  #define RH_RF95_MAX_MESSAGE_LEN (RH_RF95_MAX_PAYLOAD_LEN - RH_RF95_HEADER_LEN)
 #endif
 
+// Number of received packets the interrupt handler can hold until they are collected by recv().
+// The receiver stays on while any are held, so packets arriving while the application is busy
+// are kept rather than missed. Must be a power of 2, 1 holds a single packet.
+// Can be pre-defined to a smaller size (to save SRAM) prior to including this header
+#ifndef RH_RF95_RX_RING_LEN
+ #define RH_RF95_RX_RING_LEN 4
+#endif
+#if (RH_RF95_RX_RING_LEN & (RH_RF95_RX_RING_LEN - 1)) != 0
+ #error RH_RF95_RX_RING_LEN must be a power of 2
+#endif
+
+// Number of messages sendAsync() can queue behind the one being transmitted, the interrupt
+// handler starts each as soon as the one before is done. Must be a power of 2.
+// Can be pre-defined to a smaller size (to save SRAM) prior to including this header
+#ifndef RH_RF95_TX_QUEUE_LEN
+ #define RH_RF95_TX_QUEUE_LEN 2
+#endif
+#if (RH_RF95_TX_QUEUE_LEN & (RH_RF95_TX_QUEUE_LEN - 1)) != 0
+ #error RH_RF95_TX_QUEUE_LEN must be a power of 2
+#endif
+
+// Most bytes of a preloaded packet that can be rewritten for each transmission,
+// see RH_RF95::queuePreloaded()
+#define RH_RF95_TX_PATCH_LEN 4
+
+// If set, the interrupt handler leaves a received message in the radio's FIFO and
+// available() reads it instead, keeping the handler short. A message not read before
+// the next one overwrites it in the FIFO is lost and counted by rxRingDropped()
+#ifndef RH_RF95_DEFER_FIFO_READ
+ #define RH_RF95_DEFER_FIFO_READ 0
+#endif
+
 // The crystal oscillator frequency of the module
 #define RH_RF95_FXOSC 32000000.0
 
@@ -242,6 +274,12 @@
 #define RH_RF95_PA_DAC_DISABLE                        0x04
 #define RH_RF95_PA_DAC_ENABLE                         0x07
 
+/// Called from the interrupt handler each time a transmission completes, see RH_RF95::setTxDoneCallback()
+typedef void (*RHTxDoneCallback)(void* context, uint32_t time);
+
+/// Called from the interrupt handler after every interrupt, see RH_RF95::setInterruptCallback()
+typedef void (*RHInterruptCallback)(void* context);
+
 /////////////////////////////////////////////////////////////////////
 /// \class RH_RF95 RH_RF95.h <RH_RF95.h>
 /// \brief Driver to send and receive unaddressed, unreliable datagrams via a LoRa 
@@ -599,6 +637,21 @@ public:
 	Bw125Cr48Sf4096,           ///< Bw = 125 kHz, Cr = 4/8, Sf = 4096chips/symbol, CRC on. Slow+long range
     } ModemConfigChoice;
 
+    /// \brief Register values for a complete radio configuration
+    ///
+    /// Built once by compileRegisters() then applied by applyRegisters() as often as
+    /// needed, writing only the registers that differ from those already in the radio.
+    /// Contiguous registers are kept together so they can be written in a single burst.
+    typedef struct
+    {
+	uint8_t    frf[3];       ///< RH_RF95_REG_06_FRF_MSB to RH_RF95_REG_08_FRF_LSB
+	uint8_t    paConfig;     ///< Value for register RH_RF95_REG_09_PA_CONFIG
+	uint8_t    modem[5];     ///< RH_RF95_REG_1D_MODEM_CONFIG1 to RH_RF95_REG_21_PREAMBLE_LSB
+	uint8_t    modemConfig3; ///< Value for register RH_RF95_REG_26_MODEM_CONFIG3
+	uint8_t    paDac;        ///< Value for register RH_RF95_REG_4D_PA_DAC
+	bool       usingHFport;  ///< True for 779.0 MHz and above
+    } RegisterImage;
+
     /// Constructor. You can have multiple instances, but each instance must have its own
     /// interrupt and slave select pin. After constructing, you must call init() to initialise the interface
     /// and the radio module. A maximum of 3 instances can co-exist on one processor, provided there are sufficient
@@ -664,6 +717,16 @@ public:
     /// \return true if a valid message was copied to buf
     virtual bool    recv(uint8_t* buf, uint8_t* len);
 
+    /// Turns the receiver on if it not already on.
+    /// If there is a valid message available, describe the message in its receive ring
+    /// slot and return true. The interrupt handler won't reuse the slot until release().
+    /// \param[out] view Set to describe the received message
+    /// \return true if a valid message was borrowed
+    virtual bool    borrow(RHRxView* view);
+
+    /// Returns the slot of the message last returned by borrow() to the receive ring.
+    virtual void    release();
+
     /// Waits until any previous transmit packet is finished being transmitted with waitPacketSent().
     /// Then optionally waits for Channel Activity Detection (CAD) 
     /// to show the channnel is clear (if the radio supports CAD) by calling waitCAD().
@@ -676,6 +739,61 @@ public:
     /// if CAD was requested and the CAD timeout timed out before clear channel was detected.
     virtual bool    send(const uint8_t* data, uint8_t len);
 
+    /// Queues a message, with the current headers, to be transmitted without waiting for any
+    /// transmission in progress or for this one to complete. The message is copied, so data can be
+    /// reused straight away. Queued messages go out back to back in the order they were queued,
+    /// started by the interrupt handler, and waitPacketSent() waits for all of them.
+    /// Channel activity detection is not done for queued messages.
+    /// \param[in] data Array of data to be sent
+    /// \param[in] len Number of bytes of data to send
+    /// \return false if the message is too long or the queue is full
+    bool           sendAsync(const uint8_t* data, uint8_t len);
+
+    /// Returns the number of messages queued by sendAsync() that have not started transmitting
+    /// \return The messages waiting in the transmit queue
+    uint8_t        txQueueDepth();
+
+    /// Sets a function to be called from the interrupt handler each time a transmission
+    /// completes, with the time it completed as for lastTxTime(). Runs in interrupt context,
+    /// so must be short and not use the radio.
+    /// \param[in] callback The function to call, or NULL for none
+    /// \param[in] context Passed to the callback
+    void           setTxDoneCallback(RHTxDoneCallback callback, void* context);
+
+    /// Sets a function to be called from the interrupt handler once it has handled an
+    /// interrupt, whatever it was, so that code sleeping until the radio has news can be
+    /// woken. Runs in interrupt context, so must be short and not use the radio.
+    /// \param[in] callback The function to call, or NULL for none
+    /// \param[in] context Passed to the callback
+    void           setInterruptCallback(RHInterruptCallback callback, void* context);
+
+    /// Loads a message, with the current headers, into the transmitter without sending it, so
+    /// it can be sent repeatedly by sendPreloaded() or queuePreloaded() rewriting only the bytes
+    /// that change. The preloaded packet is lost once the receiver is used, as it shares the FIFO,
+    /// or when send() or sleep() is called.
+    /// \param[in] data Array of data to be sent
+    /// \param[in] len Number of bytes of data to send
+    /// \return true if the message length was valid and it was loaded
+    bool           preloadPacket(const uint8_t* data, uint8_t len);
+
+    /// Waits for any previous transmission, optionally for a clear channel (see waitCAD()), then
+    /// rewrites len bytes of the preloaded packet at offset and sends it.
+    /// \param[in] offset Position of the bytes in the packet, counting from the start of the headers
+    /// \param[in] bytes The new values
+    /// \param[in] len Number of bytes to rewrite, up to RH_RF95_TX_PATCH_LEN
+    /// \return false if there is no preloaded packet, the bytes are outside of it or CAD timed out
+    bool           sendPreloaded(uint8_t offset, const uint8_t* bytes, uint8_t len);
+
+    /// As sendPreloaded(), but never blocks. If a packet is being transmitted, the next is queued
+    /// and the interrupt handler starts it the moment the current one is done, for the smallest
+    /// possible gap between packets. Only one packet can be queued. Does not wait for CAD when queueing.
+    /// \param[in] offset Position of the bytes in the packet, counting from the start of the headers
+    /// \param[in] bytes The new values
+    /// \param[in] len Number of bytes to rewrite, up to RH_RF95_TX_PATCH_LEN
+    /// \return true if the packet was sent or queued, false if one is already queued
+    /// or there is no preloaded packet
+    bool           queuePreloaded(uint8_t offset, const uint8_t* bytes, uint8_t len);
+
     /// Sets the length of the preamble
     /// in bytes. 
     /// Caution: this should be set to the same 
@@ -821,17 +939,90 @@ public:
     /// so that packets with a bad CRC are rejected
     /// \patam[in] on bool, true turns the payload CRC on, false turns it off
     void setPayloadCRC(bool on);
+
+    /// Computes the register values for a full configuration, as setFrequency(), setSpreadingFactor(),
+    /// setTxPower() on PA_BOOST, setSignalBandwidth(), setCodingRate4(), setPreambleLength() and
+    /// setPayloadCRC() would set them, without writing any. All other register bits keep their
+    /// current values.
+    /// \param[out] image Set to the register values
+    void compileRegisters(float centre, uint8_t sf, int8_t power, long sbw, uint8_t denominator,
+			  uint16_t preamble, bool crc, RegisterImage* image);
+
+    /// Applies a configuration made by compileRegisters(), writing only the registers that differ
+    /// from a shadow copy of the radio's in as few burst transactions as possible.
+    /// The radio should be idle.
+    /// \param[in] image The register values to apply
+    void applyRegisters(const RegisterImage* image);
+
+    /// Returns the time the last message returned by recv() was received, as
+    /// captured on entry to the RxDone interrupt handler.
+    /// \return micros() when the last received message completed
+    uint32_t lastRxTime();
+
+    /// Returns the time the last transmitted message left the radio, as
+    /// captured on entry to the TxDone interrupt handler.
+    /// \return micros() when the last transmitted message completed
+    uint32_t lastTxTime();
+
+    /// Returns the count of received messages that were lost because the receive
+    /// ring was full, ie because the application did not call recv() often enough,
+    /// or with RH_RF95_DEFER_FIFO_READ because available() did not read them in time.
+    /// Caution: this is a 16 bit counter, which will rollover
+    /// \return The number of messages lost to a full receive ring
+    uint16_t rxRingDropped();
  	
 protected:
+    /// A received message along with the signal it was received with
+    typedef struct
+    {
+	uint8_t         buf[RH_RF95_MAX_PAYLOAD_LEN]; ///< First so the data after the headers is aligned
+	uint8_t         len;        ///< Octets in buf, including the headers
+	int16_t         rssi;       ///< dBm
+	int8_t          snr;        ///< dB
+	uint32_t        time;       ///< micros() when the message completed
+	uint8_t         fifoAddr;   ///< Where the message starts in the radio's FIFO
+    } RxSlot;
+
     /// This is a low level function to handle the interrupts for one instance of RH_RF95.
     /// Called automatically by isr*()
     /// Should not need to be called by user code.
     void           handleInterrupt();
 
-    /// Examine the revceive buffer to determine whether the message is for this node
-    void validateRxBuf();
+    /// Claims a ring slot for a message that has just been received and reads it, or
+    /// with RH_RF95_DEFER_FIFO_READ leaves it pending in the FIFO.
+    /// \param[in] status Registers RH_RF95_REG_10_FIFO_RX_CURRENT_ADDR to RH_RF95_REG_1C_HOP_CHANNEL
+    /// \param[in] now micros() when the interrupt was taken
+    void handleRxDone(const uint8_t* status, uint32_t now);
+
+    /// Rewrites the queued bytes of the preloaded packet and starts transmitting it
+    void startQueuedTx();
+
+    /// Loads the message at the tail of the transmit queue into the FIFO and starts transmitting it
+    void startNextTx();
+
+    /// With RH_RF95_DEFER_FIFO_READ, reads any message still pending in the FIFO before transmitting
+    void takePendingRx();
+
+    /// Reads the pending message out of the FIFO and publishes it to the ring
+    void readPendingRx(uint8_t next_addr, uint8_t next_len);
+
+    /// Register bits for the setters and compileRegisters()
+    static uint8_t spreadingFactorBits(uint8_t sf);
+    static uint8_t bandwidthBits(long sbw);
+    static uint8_t codingRateBits(uint8_t denominator);
+    static bool lowDatarateRequired(uint8_t modemConfig1, uint8_t modemConfig2);
+    static uint8_t paBoostRegisters(int8_t power, uint8_t* paDac);
 
-    /// Clear our local receive buffer
+    /// Reads the configuration registers into the shadow if any were written around it
+    void readShadow();
+
+    /// Burst writes the registers of values that differ from the shadow, then updates the shadow
+    void writeChangedRegisters(uint8_t reg, const uint8_t* values, uint8_t* shadow, uint8_t len);
+
+    /// Examine a received message to determine whether the message is for this node
+    bool validateRxBuf(const RxSlot* slot);
+
+    /// Discard every message held in the receive ring
     void clearRxBuf();
 
 private:
@@ -857,14 +1048,66 @@ private:
     /// else 0xff
     uint8_t             _myInterruptIndex;
 
-    /// Number of octets in the buffer
-    volatile uint8_t    _bufLen;
-    
-    /// The receiver/transmitter buffer
-    uint8_t             _buf[RH_RF95_MAX_PAYLOAD_LEN];
+    /// Messages received by the interrupt handler. The handler only fills the slot at
+    /// _rxHead and recv() only empties the slot at _rxTail, so neither needs to lock
+    RxSlot              _rxRing[RH_RF95_RX_RING_LEN];
+
+    /// Count of messages added to the ring, only written by the interrupt handler
+    volatile uint8_t    _rxHead;
+
+    /// Count of messages taken from the ring, only written by recv() and clearRxBuf()
+    volatile uint8_t    _rxTail;
+
+    /// Count of messages lost to a full ring or overwritten in the FIFO
+    volatile uint16_t   _rxRingDropped;
+
+    /// True when the slot at _rxHead holds a message still to be read from the FIFO
+    volatile bool       _rxPending;
+
+    /// Time the last message returned by recv() was received, us
+    uint32_t            _lastRxTime;
+
+    /// Time the last transmitted message completed, us
+    volatile uint32_t   _lastTxTime;
+
+    /// Copy of the configuration registers as last written to the radio
+    RegisterImage       _shadow;
+
+    /// False once a register in the shadow has been written by anything but applyRegisters()
+    bool                _shadowValid;
+
+    /// Length of the packet preloaded in the FIFO including headers, 0 if there is none
+    uint8_t             _txPreloadLen;
+
+    /// Bytes to rewrite in the preloaded packet before its next transmission
+    uint8_t             _txPatch[RH_RF95_TX_PATCH_LEN];
+    uint8_t             _txPatchOffset;
+    uint8_t             _txPatchLen;
+
+    /// True when the patched packet is to be sent as soon as the current one is done
+    volatile bool       _txQueued;
+
+    /// Messages waiting to be transmitted, with headers. sendAsync() only fills the slot at
+    /// _txQueueHead and the interrupt handler only empties the slot at _txQueueTail
+    struct
+    {
+	uint8_t         buf[RH_RF95_MAX_PAYLOAD_LEN];
+	uint8_t         len;
+    }                   _txQueue[RH_RF95_TX_QUEUE_LEN];
+
+    /// Count of messages added to the queue, only written by sendAsync()
+    volatile uint8_t    _txQueueHead;
+
+    /// Count of messages started from the queue
+    volatile uint8_t    _txQueueTail;
+
+    /// Called when each transmission completes
+    RHTxDoneCallback    _txDoneCallback;
+    void*               _txDoneContext;
 
-    /// True when there is a valid message in the buffer
-    volatile bool       _rxBufValid;
+    /// Called after each interrupt is handled
+    RHInterruptCallback _interruptCallback;
+    void*               _interruptContext;
 
     // True if we are using the HF port (779.0 MHz and above)
     bool                _usingHFport;
@@ -6,6 +6,8 @@
 #include "breakout.h"
 #include "radio.h"
 #include "storage.h"
+#include "telemetry.h"
+#include "event.h"
 
 static volatile bool _interrupted = false;
 static uint8_t board_id = INVALID_BOARD_ID;
@@ -22,33 +24,37 @@ bool dl_common_boot(void switch_isr(void)) {
   delay(100);
   // Warning: Not valid for all possible microcontrollers, ideal behaviour will
   // mean bootup will be delayed until serial monitor open
-  while (breakout_get_switch_state() == sw_state_bot && !Serial) {}
+  while (breakout_get_switch_state() == sw_state_bot && !Serial) {
+    event_wait(EVENT_SWITCH, SWITCH_POLL_INTERVAL);
+  }
   breakout_set_led(BO_LED_3, false);
 
-  Serial.printf("Starting common boot phase...\n");
+  LOG_INFO("Starting common boot phase...\n");
   
   // RTC configuration occurs during breakout board initialisation
-  Serial.printf("RTC sync %s!\n", timeStatus() == timeSet ? "successful" : "failed");
-  Serial.printf("Current [Date] Time: ");
-  Serial.printf(DATETIME_PRINT_FORMAT "\n", DATETIME_PRINT_ARGS);
+  LOG_INFO("RTC sync %s!\n", timeStatus() == timeSet ? "successful" : "failed");
+  LOG_INFO("Current [Date] Time: ");
+  LOG_INFO(DATETIME_PRINT_FORMAT "\n", DATETIME_PRINT_ARGS);
 
   // Get the Board ID from the EEPROM
-  Serial.printf("Getting Board ID from EEPROM...\n");
+  LOG_INFO("Getting Board ID from EEPROM...\n");
   uint8_t identifier_byte_1 = EEPROM.read(IDX_IDENTIFIER_BYTE_1);
   uint8_t identifier_byte_2 = EEPROM.read(IDX_IDENTIFIER_BYTE_2);
   bool board_id_set = identifier_byte_1 == IDENTIFIER_BYTE_1 &&
                       identifier_byte_2 == IDENTIFIER_BYTE_2;
   if (board_id_set) {
-    Serial.printf("Board ID Found!\n");
+    LOG_INFO("Board ID Found!\n");
     board_id = EEPROM.read(IDX_BOARD_ID);
-    Serial.printf("* ID: 0x%02X\n", board_id);
-    Serial.printf("* Valid: %s\n", IS_VALID_BOARD_ID(board_id) ? "True" : "False");
+    LOG_INFO("* ID: 0x%02X\n", board_id);
+    LOG_INFO("* Valid: %s\n", IS_VALID_BOARD_ID(board_id) ? "True" : "False");
     if (!IS_VALID_BOARD_ID(board_id)) {
       return false;
     }
-    Serial.printf("* Type: %s\n", GET_BOARD_STR_ID(board_id));
+    LOG_INFO("* Type: %s\n", GET_BOARD_STR_ID(board_id));
+    // Boards must not share random backoffs when answering the same query
+    randomSeed(board_id);
   } else {
-    Serial.printf("Board ID not Found!\n");
+    LOG_INFO("Board ID not Found!\n");
     return false;
   }
 
@@ -56,35 +62,56 @@ bool dl_common_boot(void switch_isr(void)) {
   lora_module_t lora_module = {board_id, RFM95_CS, RFM95_RST, RFM95_INT};
   g_radio_a = new LoRaModule(&lora_module, &hc_base_cfg);
   bool radio_init_sucess = g_radio_a->radio_init();
-  Serial.printf("Radio initialisation %s!\n", radio_init_sucess ? "successful" : "failed");
+  LOG_INFO("Radio initialisation %s!\n", radio_init_sucess ? "successful" : "failed");
   if (!radio_init_sucess) {
     return false;
   }
+  g_test_radios[g_test_radio_cnt++] = g_radio_a;
+  // A second radio is optional, if fitted it permanently holds the control channel
+  lora_module_t lora_module_b = {board_id, RFM95_B_CS, RFM95_B_RST, RFM95_B_INT};
+  g_radio_b = new LoRaModule(&lora_module_b, &hc_base_cfg);
+  if (g_radio_b->radio_init()) {
+    LOG_INFO("Second radio found, using it for control traffic!\n");
+    g_radio_b->reset_to_base_cfg();
+  } else {
+    LOG_INFO("No second radio found, using a single radio!\n");
+    delete g_radio_b;
+    g_radio_b = NULL;
+  }
+  // A third radio is optional, if fitted it lets testdefs run in parallel
+  lora_module_t lora_module_c = {board_id, RFM95_C_CS, RFM95_C_RST, RFM95_C_INT};
+  LoRaModule *radio_c = new LoRaModule(&lora_module_c, &hc_base_cfg);
+  if (radio_c->radio_init()) {
+    g_test_radios[g_test_radio_cnt++] = radio_c;
+  } else {
+    delete radio_c;
+  }
+  LOG_INFO("Using %d radio(s) for test traffic!\n", g_test_radio_cnt);
   breakout_set_led(BO_LED_1, false);
 
   // Initialise the SD card, failure is not necessarily a boot failure,
   // let higher levels check for initialisation to determine severity of failure.
   bool storage_init_success = storage_init();
-  Serial.printf("SD card initialisation %s!\n", storage_init_success ? "successful" : "failed");
+  LOG_INFO("SD card initialisation %s!\n", storage_init_success ? "successful" : "failed");
 
-  Serial.printf("Configuring switch, ensure it is in its middle position...\n");
+  LOG_INFO("Configuring switch, ensure it is in its middle position...\n");
   // Wait for switch to return to middle position
-  while (breakout_get_switch_state() != sw_state_mid) {}
+  dl_common_wait_switch_mid();
   // Attach switch interrupts 
   attachInterrupt(digitalPinToInterrupt(BO_SWITCH_PIN1), switch_isr, CHANGE);
   attachInterrupt(digitalPinToInterrupt(BO_SWITCH_PIN2), switch_isr, CHANGE);
-  Serial.printf("Switch configured!\n");
+  LOG_INFO("Switch configured!\n");
   
   breakout_set_led(BO_LED_2, false);
-  Serial.printf("Finished common boot phase!\n");
+  LOG_INFO("Finished common boot phase!\n");
   return true;
 }
 
 void dl_common_finish_boot(bool boot_success) {
   breakout_set_led(GET_BOARD_LED(board_id), true);
   if (!boot_success) {
-    Serial.printf("Boot as %s failed!\n", GET_BOARD_STR_ID(board_id)); 
-    Serial.printf("Check errors and reset device!\n"); 
+    LOG_ERROR("Boot as %s failed!\n", GET_BOARD_STR_ID(board_id)); 
+    LOG_ERROR("Check errors and reset device!\n"); 
     
     bool failure_led_on = false;
     while (true) {
@@ -93,7 +120,7 @@ void dl_common_finish_boot(bool boot_success) {
       delay(1000);
     }
   } else {
-    Serial.printf("Booted as %s successfully!\n", GET_BOARD_STR_ID(board_id)); 
+    LOG_INFO("Booted as %s successfully!\n", GET_BOARD_STR_ID(board_id)); 
   }           
 }
 
@@ -103,10 +130,24 @@ uint8_t dl_common_get_board_id(void) {
 
 void dl_common_set_interrupts(void) {
   dl_common_set_interrupts(true);
+  event_signal(EVENT_SWITCH);
+}
+
+LoRaModule* dl_common_ctrl_radio(void) {
+  return g_radio_b != NULL ? g_radio_b : g_radio_a;
+}
+
+bool dl_common_is_dual_radio(void) {
+  return g_radio_b != NULL;
 }
 
 void dl_common_set_interrupts(bool value) {
-  g_radio_a->set_interrupt(value);
+  for (uint8_t i=0; i < g_test_radio_cnt; i++) {
+    g_test_radios[i]->set_interrupt(value);
+  }
+  if (g_radio_b != NULL) {
+    g_radio_b->set_interrupt(value);
+  }
   _interrupted = value;
 }
 
@@ -117,3 +158,21 @@ bool dl_common_check_interrupts(bool clear) {
   }
   return temp;
 }
+
+void dl_common_wait_switch_mid(void) {
+  while (breakout_get_switch_state() != sw_state_mid) {
+    event_wait(EVENT_SWITCH, SWITCH_POLL_INTERVAL);
+  }
+}
+
+void dl_common_wait_switch_change(sw_state_t state) {
+  while (breakout_get_switch_state() == state) {
+    event_wait(EVENT_SWITCH, EVENT_WAIT_FOREVER);
+  }
+}
+
+void dl_common_wait_interrupts(void) {
+  while (!dl_common_check_interrupts()) {
+    event_wait(EVENT_SWITCH, EVENT_WAIT_FOREVER);
+  }
+}
@@ -4,34 +4,36 @@
 #include "dl_common.h"
 #include "dl_master.h"
 #include "breakout.h"
+#include "event.h"
+#include "plan.h"
 #include "radio.h"
 #include "storage.h"
-
-#define MAX_TESTDEFS (100)
+#include "telemetry.h"
 
 bool dl_master_setup(void) {
-  Serial.printf("Running %s setup...\n", MASTER_BOARD_STR_ID);
+  LOG_INFO("Running %s setup...\n", MASTER_BOARD_STR_ID);
   // Prepare the SD card for master logging, failure isn't critical
   storage_master_defaults();
-  Serial.printf("Finished %s setup!\n", MASTER_BOARD_STR_ID);
+  LOG_INFO("Finished %s setup!\n", MASTER_BOARD_STR_ID);
   return true;                       
 }
 
 bool dl_master_loop(void) {
-  switch (breakout_get_switch_state()) {
+  sw_state_t state = breakout_get_switch_state();
+  switch (state) {
     case sw_state_top:
       dl_master_run_testdefs();
       break;
     case sw_state_mid:
       breakout_set_led(BO_LED_1, false);
       breakout_set_led(BO_LED_2, false);
-      delay(100); // do nothing
+      dl_common_wait_switch_change(state); // do nothing
       break;
     case sw_state_bot:
       dl_master_send_heartbeats();
       break;
     default:
-      delay(100); // do nothing
+      dl_common_wait_switch_change(state); // do nothing
       break;
   }
   return true;
@@ -42,135 +44,349 @@ void dl_master_run_testdefs(void) {
   dl_common_set_interrupts(false);
   
   if (!is_storage_initialised()) {
-    Serial.printf("Storage is not initialised, cannot execute testdefs!\n");
-    while (!dl_common_check_interrupts()) {
-      delay(100);
-    }
+    LOG_ERROR("Storage is not initialised, cannot execute testdefs!\n");
+    dl_common_wait_interrupts();
     return;
   }
 
-  // Create results folder with current datetime
+  // Continue an unfinished plan if there is one, otherwise create a results
+  // folder with current datetime
   SD.chdir(true);
-  char test_results_path[64];
-  sprintf(test_results_path, "%s%04d-%02d-%02d-%02dh%02dm%02ds/", RESULTS_DIR,
-          year(), month(), day(), hour(), minute(), second());
-  SD.mkdir(test_results_path);
-
-  // Load in all the testdefs 
-  // TODO: Don't really want to load all in at once but needed at the moment for ordering
-  //       and would rather not load multiple times.
-  Serial.printf("Loading all testdefs in testdef folder...\n");
-  lora_testdef_t testdefs[MAX_TESTDEFS];
-  bool completed[MAX_TESTDEFS] = {false};
-  uint8_t testdef_cnt = storage_load_testdefs(testdefs, MAX_TESTDEFS);
+  char test_results_path[MAX_RESULTS_PATH_LEN];
+  bool resuming = storage_find_resumable_results(test_results_path);
+  if (resuming) {
+    resuming = dl_master_choose_resume(test_results_path);
+    // Anything but the switch at the top leaves the choice for later
+    if (breakout_get_switch_state() != sw_state_top) {
+      LOG_INFO("No plan started, return switch to middle to choose again...\n");
+      dl_common_wait_switch_mid();
+      return;
+    }
+    dl_common_set_interrupts(false);
+  }
+  if (!resuming) {
+    sprintf(test_results_path, "%s%04d-%02d-%02d-%02dh%02dm%02ds/", RESULTS_DIR,
+            year(), month(), day(), hour(), minute(), second());
+    SD.mkdir(test_results_path);
+  }
+
+  // Only a key for each testdef is held, the full testdefs are streamed
+  // from SD a block at a time. Kept off the stack as the plan can be large
+  LOG_INFO("Loading all testdefs in testdef folder...\n");
+  static plan_key_t plan[MAX_PLAN_TESTDEFS];
+  uint8_t ordered_for;
+  uint16_t testdef_cnt = storage_load_plan_keys(plan, MAX_PLAN_TESTDEFS, &ordered_for);
+  // Order for as many testdefs at once as we can receive, a slave with fewer
+  // test radios just leaves some batches smaller. A compiled plan only needs
+  // reordering if it was made for a different number of radios
+  if (ordered_for != g_test_radio_cnt) {
+    plan_order_testdefs(plan, testdef_cnt, g_test_radio_cnt);
+  }
 
   // Enter results directory so logs end up there
   SD.chdir(test_results_path, true);
   File log_file = storage_init_test_log();
-
-  // Start running all testdefs in reverse order of expected range
   // If no packets are received at a certain level do not carry out the further testdefs
-  lora_testdef_t *last_testdef = NULL;
   uint16_t packets_at_level = 0;
-  Serial.printf("Executing testdefs...\n");
-  while (!dl_common_check_interrupts()) {
-    bool all_completed = true;
-    uint8_t max_exp_range = 0;
-    uint8_t selected = 0;
-    for (uint8_t i=0; i < testdef_cnt; i++) {
-      if (!completed[i]) {
-        all_completed = false;
-        if (testdefs[i].exp_range > max_exp_range) {
-          selected = i;
-          max_exp_range = testdefs[i].exp_range;
-        }
-      }
+  bool gave_up = false;
+  if (resuming) {
+    SERIAL_AND_LOG(log_file, "\nResuming plan in '%s'\n", test_results_path);
+    testdef_cnt = dl_master_skip_completed(plan, testdef_cnt, &packets_at_level, &gave_up);
+    SERIAL_AND_LOG(log_file, "%d testdefs remaining\n", testdef_cnt);
+    if (gave_up) {
+      SERIAL_AND_LOG(log_file, "\nGiving up, got no packets from testdef with highest expected range!\n")
     }
+  }
+  // Progress is journaled so an interrupted plan can be resumed
+  File journal = storage_init_journal();
 
-    if (all_completed) {
+  // Deliver the whole plan up front to every slave that enrols, after this
+  // all nodes step through it autonomously, only returning to the control 
+  // configuration to resync. With a second radio the control channel never 
+  // has to be given up.
+  LoRaModule *ctrl_radio = dl_common_ctrl_radio();
+  uint8_t slave_ids[MAX_PLAN_SLAVES];
+  uint8_t slave_cnt = 0;
+  bool delivered_plan = false;
+  while (!delivered_plan && testdef_cnt > 0 && !dl_common_check_interrupts()) {
+    breakout_set_led(BO_LED_1, false);
+    breakout_set_led(BO_LED_2, false);
+    ctrl_radio->fallback_ctrl_cfg();
+    ctrl_radio->reset_to_base_cfg();
+    delivered_plan = ctrl_radio->send_plan(testdef_cnt, plan_max_block_duration(plan, testdef_cnt), 
+                                           slave_ids, &slave_cnt);
+    breakout_set_led(delivered_plan ? BO_LED_2 : BO_LED_1, true);
+    if (!delivered_plan) {
+      delay(500); 
+    }
+  }
+
+  // Every slave gets its own slot in each packet interval
+  uint8_t parallel = min(g_test_radio_cnt, ctrl_radio->get_remote_test_radio_cnt());
+  if (delivered_plan) {
+    uint8_t active_cnt = 0;
+    for (uint8_t i=0; i < slave_cnt; i++) {
+      active_cnt += slave_ids[i] != PLAN_SLOT_DROPPED;
+    }
+    SERIAL_AND_LOG(log_file, "Plan delivered to %d of %d slave(s)\n", active_cnt, slave_cnt);
+    uint32_t duration = dl_master_predict_duration(plan, testdef_cnt, ctrl_radio->get_ctrl_cfg(), 
+                                                   parallel, slave_cnt) / 1000;
+    SERIAL_AND_LOG(log_file, "Predicted plan duration: %02ldh %02ldm %02lds\n", 
+                   duration / 3600, (duration / 60) % 60, duration % 60);
+#if RUN_CONTAINER_ENABLED
+    uint32_t exp_results = 0;
+    for (uint16_t i=0; i < testdef_cnt; i++) {
+      exp_results += plan[i].packet_cnt;
+    }
+    storage_init_run_container(plan, testdef_cnt, exp_results * active_cnt);
+#endif
+  }
+
+  // Start running all testdefs in reverse order of expected range
+  storage_flush_log();
+  uint16_t next = 0;
+  LOG_INFO("Executing testdefs, up to %d at once...\n", parallel);
+  while (delivered_plan && !dl_common_check_interrupts()) {
+    if (next >= testdef_cnt) {
       SERIAL_AND_LOG(log_file, "\nAll testdefs excuted!\n")
       break;
     }
-    if (last_testdef != NULL && max_exp_range < last_testdef->exp_range) {
+    uint16_t block_end = plan_block_end(plan, testdef_cnt, next);
+    lora_testdef_t block[PLAN_MAX_BLOCK_LEN];
+    bool loaded_block = true;
+    for (uint16_t i=next; i < block_end && loaded_block; i++) {
+      loaded_block = storage_load_plan_testdef(&plan[i], &block[i - next]);
+    }
+    if (!loaded_block) {
+      // Left unfinished in the journal so it can be resumed once fixed
+      SERIAL_AND_LOG(log_file, "\nFailed to reload testdefs %d to %d!\n", next, block_end - 1);
+      break;
+    }
+    ctrl_radio->reset_to_ctrl_cfg();
+    // Slaves that miss any of the block sit it out, rejoining at the next sync
+    bool acked_block = ctrl_radio->send_plan_block(slave_ids, slave_cnt, block, next, block_end - next);
+    uint32_t start_time;
+    bool acked_sync = ctrl_radio->send_plan_sync(slave_ids, slave_cnt, next, block_end - next, 
+                                                 parallel, &start_time);
+    if (!(acked_block && acked_sync) && !ctrl_radio->is_ctrl_cfg_base()) {
+      // Slave will also fall back if it didn't hear us
+      SERIAL_AND_LOG(log_file, "Falling back to base control configuration!\n");
+      ctrl_radio->fallback_ctrl_cfg();
+    }
+
+    uint16_t first = next;
+    while (first < block_end && !dl_common_check_interrupts()) {
+      // Clear any status LEDs
+      breakout_set_led(BO_LED_1, false);
+      breakout_set_led(BO_LED_2, false);
+
+      uint16_t batch_end = plan_batch_end(plan, block_end, first, parallel);
+      packets_at_level += dl_master_run_batch(&block[first - next], batch_end - first, slave_ids,
+                                              slave_cnt, &log_file, &journal, start_time);
+      breakout_set_led(BO_LED_1, true);
+      start_time += plan_batch_duration(plan, first, batch_end, slave_cnt);
+      first = batch_end;
+    }
+    next = block_end;
+
+    if (next < testdef_cnt && plan[next].exp_range < plan[next - 1].exp_range) {
       // Exit early as there is no point in carrying on
       if (packets_at_level == 0) {
         SERIAL_AND_LOG(log_file, "\nGiving up, got no packets from testdef with highest expected range!\n")
+        gave_up = true;
         break;
       }      
       // At a new level, reset the number of packets found
       packets_at_level = 0;
     }
+  }
+  // Control traffic can be sent alongside the test traffic, so the slaves can
+  // be stopped immediately rather than finishing their block
+  if (delivered_plan && dl_common_check_interrupts() && dl_common_is_dual_radio()) {
+    ctrl_radio->set_interrupt(false);
+    ctrl_radio->send_plan_abort(slave_ids, slave_cnt);
+  }
+  // Let the slaves know the plan is over
+  if (delivered_plan && !dl_common_check_interrupts()) {
+    ctrl_radio->reset_to_ctrl_cfg();
+    uint32_t start_time;
+    ctrl_radio->send_plan_sync(slave_ids, slave_cnt, testdef_cnt, 0, parallel, &start_time);
+  }
 
-    // Clear any status LEDs
-    breakout_set_led(BO_LED_1, false);
-    breakout_set_led(BO_LED_2, false);
-
-    // Run test definition
-    lora_testdef_t *testdef = &testdefs[selected];
-    SERIAL_AND_LOG(log_file, "\nExecuting testdef: '%s'\n", testdef->id);
-    SERIAL_AND_LOG(log_file, "Start Time: " DATETIME_PRINT_FORMAT "\n", DATETIME_PRINT_ARGS);
-    log_file.flush();
-    g_radio_a->dbg_print_testdef(testdef);
-    Serial.printf("\n");
-    uint16_t recv_packets = 0;
-    bool valid_results = dl_master_run_testdef(testdef, &recv_packets, &log_file);  
-    packets_at_level += recv_packets;
-    completed[selected] = valid_results;
-    last_testdef = testdef;
-    SERIAL_AND_LOG(log_file, "Testdef results: %s\n", valid_results ? "Valid" : "Invalid");
-    SERIAL_AND_LOG(log_file, "End Time: " DATETIME_PRINT_FORMAT "\n", DATETIME_PRINT_ARGS);
-    log_file.flush();
+  // Only an interrupted plan is left to be resumed, whether to is chosen
+  // when the next plan is started
+  if (gave_up || (next >= testdef_cnt && !dl_common_check_interrupts())) {
+    storage_finish_journal(&journal);
   }
+  journal.close();
+  storage_close_run_container();
 
   // All LEDs set to indicate finished
   breakout_set_led(BO_LED_1, true);
   breakout_set_led(BO_LED_2, true);
+  storage_flush_log();
   log_file.close();
 
   // Be careful not to just infinitely run tests
   if (breakout_get_switch_state() != sw_state_mid) {
-    Serial.printf("\nReturn switch to middle to run tests again...\n");
+    LOG_INFO("\nReturn switch to middle to run tests again...\n");
   }
-  while (breakout_get_switch_state() != sw_state_mid) {}
+  dl_common_wait_switch_mid();
 }
 
-bool dl_master_run_testdef(lora_testdef_t *testdef, uint16_t* recv_packets, File* log_file) {
-  // Clear all interrupts
-  dl_common_set_interrupts(false);
-  // Reset to agreed base 
-  g_radio_a->reset_to_base_cfg();
-  // Handshake to pass over test def
-  bool delivered_testdef = false;
-  while (!delivered_testdef && !dl_common_check_interrupts()) {
-    breakout_set_led(BO_LED_1, false);
-    breakout_set_led(BO_LED_2, false);
-    delivered_testdef = g_radio_a->send_testdef(testdef);
-    breakout_set_led(delivered_testdef ? BO_LED_2 : BO_LED_1, true);
-    if (!delivered_testdef) {
-      delay(500); 
+bool dl_master_choose_resume(const char *results_path) {
+  // Resuming is the operator's choice. Leaving the switch at the top resumes,
+  // moving it to the bottom and back up starts a new plan
+  LOG_INFO("\nUnfinished plan found in '%s'!\n", results_path);
+  LOG_INFO("Leave the switch at the top to resume it, or move it to the bottom " \
+           "and back within %ds to start a new plan...\n", RESUME_CHOICE_WINDOW / 1000);
+  bool restart = false;
+  bool led_on = false;
+  uint32_t start_time = millis();
+  while (millis() - start_time < RESUME_CHOICE_WINDOW) {
+    sw_state_t state = breakout_get_switch_state();
+    if (state == sw_state_bot) {
+      restart = true;
+    } else if (state == sw_state_mid || (state == sw_state_top && restart)) {
+      break;
+    }
+    led_on = !led_on;
+    breakout_set_led(BO_LED_1, led_on);
+    breakout_set_led(BO_LED_2, !led_on);
+    event_wait(EVENT_SWITCH, RESUME_CHOICE_BLINK);
+  }
+  breakout_set_led(BO_LED_1, false);
+  breakout_set_led(BO_LED_2, false);
+  LOG_INFO("%s plan!\n", restart ? "Starting a new" : "Resuming the unfinished");
+  return !restart;
+}
+
+uint16_t dl_master_skip_completed(plan_key_t plan[], uint16_t testdef_cnt, 
+                                  uint16_t *packets_at_level, bool *gave_up) {
+  // Remove every testdef the journal has results for, keeping the plan order
+  File journal = SD.open(JOURNAL_FILE, O_RDONLY);
+  char testdef_id[TESTDEF_ID_LEN + 1];
+  uint8_t exp_range;
+  uint16_t recv_packets;
+  int16_t last_exp_range = -1;
+  uint16_t last_level_packets = 0;
+  while (storage_read_journal_entry(&journal, testdef_id, &exp_range, &recv_packets)) {
+    uint16_t id_hash = plan_hash_id(testdef_id);
+    for (uint16_t i=0; i < testdef_cnt; i++) {
+      if (plan[i].id_hash != id_hash || plan[i].exp_range != exp_range) {
+        continue;
+      }
+      // Keys only hold a hash of the id, so check against the file
+      lora_testdef_t testdef;
+      if (storage_load_plan_testdef(&plan[i], &testdef) && 
+          strncmp(testdef.id, testdef_id, TESTDEF_ID_LEN) == 0) {
+        memmove(&plan[i], &plan[i + 1], (testdef_cnt - i - 1) * sizeof(plan_key_t));
+        testdef_cnt--;
+        break;
+      }
+    }
+    // Track the packets of the level that was in progress
+    if (exp_range != last_exp_range) {
+      last_exp_range = exp_range;
+      last_level_packets = 0;
+    }
+    last_level_packets += recv_packets;
+  }
+  journal.close();
+  *packets_at_level = 0;
+  *gave_up = false;
+  if (testdef_cnt == 0 || last_exp_range < 0) {
+    return testdef_cnt;
+  }
+  if (plan[0].exp_range == last_exp_range) {
+    *packets_at_level = last_level_packets;
+  } else if (last_level_packets == 0) {
+    // The last level finished just before the plan was interrupted
+    *gave_up = true;
+    return 0;
+  }
+  return testdef_cnt;
+}
+
+uint32_t dl_master_predict_duration(plan_key_t plan[], uint16_t testdef_cnt, lora_cfg_t *ctrl_cfg,
+                                    uint8_t parallel, uint8_t slot_cnt) {
+  // Assumes every level is executed and no testdef ends early, so this is
+  // an upper bound for a plan that is delivered first time
+  uint32_t duration = LoRaModule::calculate_plan_transfer_duration(ctrl_cfg, slot_cnt);
+  uint32_t sync_duration = LoRaModule::calculate_plan_sync_duration(ctrl_cfg) * slot_cnt;
+  uint16_t next = 0;
+  while (next < testdef_cnt) {
+    uint16_t block_end = plan_block_end(plan, testdef_cnt, next);
+    // Each block's testdefs are delivered just before its sync
+    duration += LoRaModule::calculate_plan_block_transfer_duration(ctrl_cfg, block_end - next, 
+                                                                   slot_cnt);
+    duration += sync_duration + plan_block_duration(plan, next, block_end, parallel, slot_cnt);
+    next = block_end;
+  }
+  // Final sync to tell the slave the plan is over
+  return duration + sync_duration;
+}
+
+uint16_t dl_master_run_batch(lora_testdef_t testdefs[], uint8_t cnt, uint8_t slave_ids[], 
+                             uint8_t slave_cnt, File *log_file, File *journal, uint32_t start_time) {
+  // Every testdef in the batch gets its own radio, all started together
+  for (uint8_t i=0; i < cnt; i++) {
+    lora_testdef_t *testdef = &testdefs[i];
+    SERIAL_AND_LOG((*log_file), "\nExecuting testdef: '%s'\n", testdef->id);
+    SERIAL_AND_LOG((*log_file), "Start Time: " DATETIME_PRINT_FORMAT "\n", DATETIME_PRINT_ARGS);
+    storage_flush_log();
+    g_test_radios[i]->dbg_print_testdef(testdef);
+    LOG_INFO("\n");
+    g_test_radios[i]->begin_recv_testdef_packets(testdef, log_file, start_time, slave_ids, slave_cnt);
+  }
+  // Nothing is due until the slaves' send delay has passed
+  storage_flush_log();
+  log_file->flush();
+  // Service every radio until they have all finished, results are only
+  // written when no radio expects a packet
+  bool receiving = true;
+  while (receiving) {
+    receiving = false;
+    uint32_t idle_time = UINT32_MAX;
+    for (uint8_t i=0; i < cnt; i++) {
+      receiving |= g_test_radios[i]->poll_recv_testdef_packets();
+      idle_time = min(idle_time, g_test_radios[i]->get_recv_idle_time());
     }
+    storage_flush_results(idle_time);
+    yield();
   }
-  bool valid_results = false;
-  if (delivered_testdef) {
-    valid_results = g_radio_a->recv_testdef_packets(testdef, recv_packets, log_file);
-    breakout_set_led(BO_LED_1, true);
+  uint16_t recv_packets = 0;
+  for (uint8_t i=0; i < cnt; i++) {
+    SERIAL_AND_LOG((*log_file), "\nFinished testdef: '%s'\n", testdefs[i].id);
+    uint16_t testdef_packets = 0;
+    bool valid_results = g_test_radios[i]->end_recv_testdef_packets(&testdef_packets);
+    recv_packets += testdef_packets;
+    // Interrupted testdefs are repeated when the plan is resumed
+    if (valid_results) {
+      storage_write_journal_entry(journal, &testdefs[i], testdef_packets);
+    }
+    SERIAL_AND_LOG((*log_file), "Testdef results: %s\n", valid_results ? "Valid" : "Invalid");
+    SERIAL_AND_LOG((*log_file), "End Time: " DATETIME_PRINT_FORMAT "\n", DATETIME_PRINT_ARGS);
   }
-  return valid_results;
+  storage_flush_log();
+  log_file->flush();
+  return recv_packets;
 }
 
 void dl_master_send_heartbeats(void) {
   // Clear all interrupts
   dl_common_set_interrupts(false);
   // Reset to agreed base 
-  g_radio_a->reset_to_base_cfg();
+  LoRaModule *ctrl_radio = dl_common_ctrl_radio();
+  ctrl_radio->reset_to_base_cfg();
   // Start sending some acknowledged packets indefinitely
   while (!dl_common_check_interrupts()) {
-    bool heartbeat_success = g_radio_a->send_heartbeat();
-    Serial.printf("Got Heartbeat ACK: %s\n", heartbeat_success ? "True" : "False");
+    bool heartbeat_success = ctrl_radio->send_heartbeat();
+    LOG_INFO("Got Heartbeat ACK: %s\n", heartbeat_success ? "True" : "False");
     breakout_set_led(heartbeat_success ? BO_LED_2 : BO_LED_1, true);
     delay(500);
     breakout_set_led(heartbeat_success ? BO_LED_2 : BO_LED_1, false);
   }
   // Just a safety check to ensure switch doesn't skip mid
-  while (breakout_get_switch_state() != sw_state_mid) {}
+  dl_common_wait_switch_mid();
 }
\ No newline at end of file
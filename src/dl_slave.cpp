@@ -3,24 +3,33 @@
 #include "dl_common.h"
 #include "dl_slave.h"
 #include "breakout.h"
+#include "plan.h"
 #include "radio.h"
 #include "storage.h"
+#include "telemetry.h"
+
+static void dl_slave_poll_plan_abort(void);
+
+// Details of the plan in progress, used when polling for an abort
+static uint8_t _plan_master_id;
+static volatile bool _plan_aborted;
 
 bool dl_slave_setup(void) {
-  Serial.printf("Running %s setup...\n", SLAVE_BOARD_STR_ID);
+  LOG_INFO("Running %s setup...\n", SLAVE_BOARD_STR_ID);
   // Prepare the SD card for slave logging, failure isn't critical
   storage_slave_defaults();
-  Serial.printf("Finished %s setup!\n", SLAVE_BOARD_STR_ID);
+  LOG_INFO("Finished %s setup!\n", SLAVE_BOARD_STR_ID);
   return true;
 }
 
 bool dl_slave_loop(void) {
-  switch (breakout_get_switch_state()) {
+  sw_state_t state = breakout_get_switch_state();
+  switch (state) {
     case sw_state_top:
       dl_slave_recv_and_execute_cmd();
       break;
     default:
-      delay(100); // do nothing
+      dl_common_wait_switch_change(state); // do nothing
       break;
   }
   return true;
@@ -30,11 +39,13 @@ void dl_slave_recv_and_execute_cmd(void) {
   // Clear all interrupts
   dl_common_set_interrupts(false);
   // Reset to agreed base 
-  g_radio_a->reset_to_base_cfg();
+  LoRaModule *ctrl_radio = dl_common_ctrl_radio();
+  ctrl_radio->fallback_ctrl_cfg();
+  ctrl_radio->reset_to_base_cfg();
 
   // Wait till a command is received
   uint8_t master_id = 0;
-  radio_cmd_t recv_cmd = g_radio_a->recv_command(&master_id);
+  radio_cmd_t recv_cmd = ctrl_radio->recv_command(&master_id);
   
   switch (recv_cmd) {
     case cmd_testdef: 
@@ -42,9 +53,14 @@ void dl_slave_recv_and_execute_cmd(void) {
       dl_slave_handle_testdef_cmd(master_id);
       break;
     }
+    case cmd_plan:
+    {
+      dl_slave_handle_plan_cmd(master_id);
+      break;
+    }
     case cmd_heartbeat:
     {
-      g_radio_a->ack_heartbeat(master_id);
+      ctrl_radio->ack_heartbeat(master_id);
       break;
     }
     default:
@@ -56,7 +72,7 @@ bool dl_slave_handle_testdef_cmd(uint8_t master_id) {
     // Handshake to pass over testdef
     lora_testdef_t testdef;
     testdef.master_id = master_id;
-    bool recv_testdef = g_radio_a->recv_testdef(&testdef);
+    bool recv_testdef = dl_common_ctrl_radio()->recv_testdef(&testdef);
     if (!recv_testdef || dl_common_check_interrupts()) {
       breakout_set_led(BO_LED_3, true);
       delay(500);
@@ -68,4 +84,129 @@ bool dl_slave_handle_testdef_cmd(uint8_t master_id) {
     g_radio_a->send_testdef_packets(&testdef);
     breakout_set_led(BO_LED_2, false);
     return true;
+}
+
+bool dl_slave_handle_plan_cmd(uint8_t master_id) {
+    uint16_t plan_cnt = 0;
+    uint32_t max_block_duration;
+    uint8_t slot, slot_cnt;
+    LoRaModule *ctrl_radio = dl_common_ctrl_radio();
+    bool recv_plan = ctrl_radio->recv_plan(master_id, &plan_cnt, &max_block_duration, 
+                                           &slot, &slot_cnt);
+    if (!recv_plan || dl_common_check_interrupts()) {
+      breakout_set_led(BO_LED_3, true);
+      delay(500);
+      breakout_set_led(BO_LED_3, false);
+      return false;
+    }
+    // Syncs and the block's testdefs to the slaves in earlier slots are sent before ours
+    lora_cfg_t *ctrl_cfg = ctrl_radio->get_ctrl_cfg();
+    uint32_t sync_timeout = PLAN_SYNC_RX_TIMEOUT + 
+                            (LoRaModule::calculate_plan_sync_duration(ctrl_cfg) + 
+                             LoRaModule::calculate_plan_block_transfer_duration(ctrl_cfg, 
+                                                                                PLAN_MAX_BLOCK_LEN)) * slot;
+    // If a sync or part of a block is missed the master runs that block without
+    // us, the next sync will be heard by the end of it at the latest. The longest
+    // block is given for a single slot so is scaled to bound ours
+    uint32_t resync_timeout = max_block_duration * slot_cnt + sync_timeout;
+    // With a second radio the master can abort the plan whilst we transmit
+    _plan_master_id = master_id;
+    _plan_aborted = false;
+    bool plan_success = true;
+    // Only the block being executed is held, it arrives along with its sync
+    lora_testdef_t block[PLAN_MAX_BLOCK_LEN];
+    plan_key_t keys[PLAN_MAX_BLOCK_LEN];
+    // Execute blocks of the plan as instructed until told the plan is over
+    while (!dl_common_check_interrupts()) {
+      ctrl_radio->reset_to_ctrl_cfg();
+      uint16_t next, cnt;
+      uint8_t parallel;
+      uint32_t start_time;
+      bool got_sync = ctrl_radio->recv_plan_sync(master_id, block, PLAN_MAX_BLOCK_LEN, &next, &cnt, 
+                                                 &parallel, &start_time, sync_timeout);
+      if (!got_sync && !dl_common_check_interrupts()) {
+        // The master also falls back if it didn't hear from us
+        if (!ctrl_radio->is_ctrl_cfg_base()) {
+          LOG_INFO("Falling back to base control configuration...\n");
+          ctrl_radio->fallback_ctrl_cfg();
+          ctrl_radio->reset_to_ctrl_cfg();
+        }
+        LOG_INFO("Waiting for the next block's sync...\n");
+        got_sync = ctrl_radio->recv_plan_sync(master_id, block, PLAN_MAX_BLOCK_LEN, &next, &cnt, 
+                                              &parallel, &start_time, resync_timeout);
+      }
+      if (!got_sync) {
+        LOG_ERROR("Lost plan synchronisation with master!\n");
+        plan_success = false;
+        break;
+      }
+      if (next >= plan_cnt) {
+        LOG_INFO("Plan finished!\n");
+        break;
+      }
+      // Step through the block using the agreed schedule, batches are formed
+      // exactly as the master forms them so both sides stay in step
+      breakout_set_led(BO_LED_2, true);
+      uint16_t block_cnt = min(cnt, (uint16_t) PLAN_MAX_BLOCK_LEN);
+      for (uint16_t i=0; i < block_cnt; i++) {
+        plan_make_key(&block[i], i, 0, &keys[i]);
+      }
+      parallel = constrain(parallel, 1, g_test_radio_cnt);
+      uint16_t first = 0;
+      while (first < block_cnt) {
+        uint16_t batch_end = plan_batch_end(keys, block_cnt, first, parallel);
+        if (!dl_slave_send_batch(&block[first], batch_end - first, start_time, slot, slot_cnt)) {
+          break;
+        }
+        start_time += plan_batch_duration(keys, first, batch_end, slot_cnt);
+        first = batch_end;
+      }
+      breakout_set_led(BO_LED_2, false);
+      if (_plan_aborted) {
+        LOG_INFO("Plan aborted by master!\n");
+        plan_success = false;
+        break;
+      }
+    }
+    for (uint8_t i=0; i < g_test_radio_cnt; i++) {
+      g_test_radios[i]->set_interrupt(false);
+    }
+    return plan_success;
+}
+
+bool dl_slave_send_batch(lora_testdef_t testdefs[], uint8_t cnt, uint32_t start_time, 
+                         uint8_t slot, uint8_t slot_cnt) {
+  // Every testdef in the batch gets its own radio, all started together
+  uint8_t started = 0;
+  bool success = true;
+  while (started < cnt && success) {
+    success = g_test_radios[started]->begin_send_testdef_packets(&testdefs[started], start_time, 
+                                                                 slot, slot_cnt);
+    started++;
+  }
+  // Service every radio until they have all finished
+  bool sending = success;
+  while (sending) {
+    sending = false;
+    for (uint8_t i=0; i < started; i++) {
+      sending |= g_test_radios[i]->poll_send_testdef_packets();
+    }
+    if (dl_common_is_dual_radio()) {
+      dl_slave_poll_plan_abort();
+    }
+    yield();
+  }
+  for (uint8_t i=0; i < started; i++) {
+    success &= g_test_radios[i]->end_send_testdef_packets();
+  }
+  return success;
+}
+
+static void dl_slave_poll_plan_abort(void) {
+  if (!_plan_aborted && g_radio_b->poll_plan_abort(_plan_master_id)) {
+    _plan_aborted = true;
+    for (uint8_t i=0; i < g_test_radio_cnt; i++) {
+      g_test_radios[i]->set_interrupt(true);
+    }
+  }
 }
\ No newline at end of file
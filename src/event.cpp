@@ -0,0 +1,58 @@
+#include "event.h"
+
+#if defined(ARDUINO)
+#include <Arduino.h>
+
+static volatile uint8_t _signalled = 0;
+
+void event_signal(uint8_t events) {
+  // The interrupt that called this has already woken the core. Both interrupts
+  // and the main loop signal, so the bits are set atomically without masking
+  __atomic_fetch_or(&_signalled, events, __ATOMIC_SEQ_CST);
+}
+
+uint8_t event_wait(uint8_t events, uint32_t timeout) {
+  uint32_t start_time = millis();
+  while (true) {
+    // Interrupts stay masked from the check until asleep, a pending one still
+    // wakes WFI and runs as soon as they are unmasked
+    __disable_irq();
+    uint8_t signalled = _signalled & events;
+    if (signalled || millis() - start_time >= timeout) {
+      _signalled &= ~signalled;
+      __enable_irq();
+      return signalled;
+    }
+    asm volatile("wfi");
+    __enable_irq();
+  }
+}
+
+#else
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+static std::mutex _mutex;
+static std::condition_variable _cond;
+static uint8_t _signalled = 0;
+
+void event_signal(uint8_t events) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _signalled |= events;
+  _cond.notify_all();
+}
+
+uint8_t event_wait(uint8_t events, uint32_t timeout) {
+  std::unique_lock<std::mutex> lock(_mutex);
+  if (timeout == EVENT_WAIT_FOREVER) {
+    _cond.wait(lock, [events] { return (_signalled & events) != 0; });
+  } else {
+    _cond.wait_for(lock, std::chrono::milliseconds(timeout), 
+                   [events] { return (_signalled & events) != 0; });
+  }
+  uint8_t signalled = _signalled & events;
+  _signalled &= ~signalled;
+  return signalled;
+}
+#endif
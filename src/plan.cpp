@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "plan.h"
+
+static int compare_keys(const void *a, const void *b);
+static bool can_join_batch(plan_key_t keys[], uint16_t first, uint16_t end, plan_key_t *key);
+
+void plan_make_key(lora_testdef_t *testdef, uint16_t dir_index, uint16_t variant, plan_key_t *key) {
+  key->freq = testdef->cfg.freq;
+  key->bw = testdef->cfg.bw;
+  key->slot_time = testdef_packet_slot(&testdef->cfg, testdef->packet_len);
+  // Most expensive to change in the highest bits
+  key->cfg_order = ((uint32_t) testdef->cfg.sf << 28) | ((uint32_t) testdef->cfg.cr4_denom << 24) |
+                   ((uint32_t) (uint8_t) (testdef->cfg.tx_dbm + 128) << 16) | 
+                   ((uint32_t) testdef->cfg.preamble_syms << 8) | testdef->cfg.crc;
+  key->packet_cnt = testdef->packet_cnt;
+  key->dir_index = dir_index;
+  key->variant = variant;
+  key->id_hash = plan_hash_id(testdef->id);
+  key->exp_range = testdef->exp_range;
+}
+
+uint16_t plan_hash_id(const char *id) {
+  // FNV-1a folded to 16 bits, collisions are resolved by checking the file
+  uint32_t hash = 2166136261UL;
+  for (uint8_t i=0; i < TESTDEF_ID_LEN && id[i] != '\0'; i++) {
+    hash = (hash ^ (uint8_t) id[i]) * 16777619UL;
+  }
+  return (hash >> 16) ^ (hash & 0xFFFF);
+}
+
+void plan_order_testdefs(plan_key_t keys[], uint16_t testdef_cnt, uint8_t parallel) {
+  // Sort once so the plan runs in reverse order of expected range, with
+  // similar configurations kept together within each level
+  qsort(keys, testdef_cnt, sizeof(plan_key_t), compare_keys);
+  if (parallel <= 1) {
+    return;
+  }
+  // Sorting places testdefs on the same channel next to each other, so pull
+  // forward testdefs from the same level that can share each batch
+  uint16_t next = 0;
+  while (next < testdef_cnt) {
+    uint16_t block_end = plan_block_end(keys, testdef_cnt, next);
+    uint16_t first = next;
+    while (first < block_end) {
+      uint16_t end = first + 1;
+      while (end < block_end && (end - first) < parallel) {
+        uint16_t i = end;
+        while (i < testdef_cnt && keys[i].exp_range == keys[first].exp_range &&
+               !can_join_batch(keys, first, end, &keys[i])) {
+          i++;
+        }
+        if (i >= testdef_cnt || keys[i].exp_range != keys[first].exp_range) {
+          break;
+        }
+        if (i != end) {
+          plan_key_t key = keys[i];
+          memmove(&keys[end + 1], &keys[end], (i - end) * sizeof(plan_key_t));
+          keys[end] = key;
+        }
+        end++;
+      }
+      first = end;
+    }
+    next = block_end;
+  }
+}
+
+uint16_t plan_block_end(plan_key_t keys[], uint16_t testdef_cnt, uint16_t first) {
+  // Blocks never span a change in level and are limited in length to bound 
+  // the clock drift between the nodes
+  uint16_t end = first + 1;
+  while (end < testdef_cnt && (end - first) < PLAN_MAX_BLOCK_LEN &&
+         keys[end].exp_range == keys[first].exp_range) {
+    end++;
+  }
+  return end;
+}
+
+uint16_t plan_batch_end(plan_key_t keys[], uint16_t block_end, uint16_t first, 
+                        uint8_t parallel) {
+  // Both nodes must agree on every batch, so only consecutive testdefs are used
+  uint16_t end = first + 1;
+  while (end < block_end && (end - first) < parallel &&
+         can_join_batch(keys, first, end, &keys[end])) {
+    end++;
+  }
+  return end;
+}
+
+uint32_t plan_batch_duration(plan_key_t keys[], uint16_t first, uint16_t batch_end,
+                             uint8_t slot_cnt) {
+  uint32_t duration = 0;
+  for (uint16_t i=first; i < batch_end; i++) {
+    uint32_t testdef = testdef_duration(keys[i].slot_time, keys[i].packet_cnt, slot_cnt);
+    if (testdef > duration) {
+      duration = testdef;
+    }
+  }
+  return duration;
+}
+
+uint32_t plan_block_duration(plan_key_t keys[], uint16_t first, uint16_t block_end, 
+                             uint8_t parallel, uint8_t slot_cnt) {
+  uint32_t duration = 0;
+  while (first < block_end) {
+    uint16_t batch_end = plan_batch_end(keys, block_end, first, parallel);
+    duration += plan_batch_duration(keys, first, batch_end, slot_cnt);
+    first = batch_end;
+  }
+  return duration;
+}
+
+uint32_t plan_max_block_duration(plan_key_t keys[], uint16_t testdef_cnt, uint8_t parallel,
+                                 uint8_t slot_cnt) {
+  uint32_t max_duration = 0;
+  uint16_t next = 0;
+  while (next < testdef_cnt) {
+    uint16_t block_end = plan_block_end(keys, testdef_cnt, next);
+    uint32_t duration = plan_block_duration(keys, next, block_end, parallel, slot_cnt);
+    if (duration > max_duration) {
+      max_duration = duration;
+    }
+    next = block_end;
+  }
+  return max_duration;
+}
+
+static bool can_join_batch(plan_key_t keys[], uint16_t first, uint16_t end, 
+                           plan_key_t *key) {
+  // Testdefs sharing a channel would interfere with each other's results,
+  // even at different spreading factors, so occupied bandwidths must not overlap
+  for (uint16_t i=first; i < end; i++) {
+    float separation = fabs(keys[i].freq - key->freq) * 1E6;
+    if (separation < (keys[i].bw + key->bw) / 2) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static int compare_keys(const void *a, const void *b) {
+  const plan_key_t *key_a = (const plan_key_t*) a;
+  const plan_key_t *key_b = (const plan_key_t*) b;
+  // Highest expected range first
+  if (key_a->exp_range != key_b->exp_range) {
+    return key_a->exp_range > key_b->exp_range ? -1 : 1;
+  }
+  // Then group by configuration, most expensive to change first
+  if (key_a->freq != key_b->freq) {
+    return key_a->freq < key_b->freq ? -1 : 1;
+  }
+  if (key_a->bw != key_b->bw) {
+    return key_a->bw < key_b->bw ? -1 : 1;
+  }
+  if (key_a->cfg_order != key_b->cfg_order) {
+    return key_a->cfg_order < key_b->cfg_order ? -1 : 1;
+  }
+  // Keep the order deterministic for otherwise identical configurations
+  if (key_a->dir_index != key_b->dir_index) {
+    return key_a->dir_index < key_b->dir_index ? -1 : 1;
+  }
+  return key_a->variant < key_b->variant ? -1 : (key_a->variant > key_b->variant);
+}
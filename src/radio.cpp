@@ -4,20 +4,32 @@
 #include "radio.h"
 #include "breakout.h"
 #include "storage.h"
+#include "telemetry.h"
+#include "event.h"
 
-#define SINGLE_RX_CHECK_TIMEOUT (500)
+// Longest a single driver wait can be asked to block for, waits end early on
+// a message or an interrupt so this only limits how often a wait restarts
+#define SINGLE_RX_CHECK_TIMEOUT (UINT16_MAX)
 #define RDY_RX_TIMEOUT (3000)
 #define HEARTBEAT_TIMEOUT (3000)
 #define TESTDEF_RX_TIMEOUT (5000)
 #define ACK_TIMEOUT (1000)
 
-// Delay from after configuration before slave starts sending packets
-#define SLAVE_PACKET_SEND_DELAY (1000)
+// Number of attempts the master makes to deliver a plan sync
+#define PLAN_SYNC_ATTEMPTS (2)
+// Time for nodes to prepare between a plan sync and the block starting
+#define PLAN_SYNC_SETUP_TIME (200)
 
-// Airtime will not reflect all time for a single packet, will require extra processing.
-// TODO: Currently captured as a simple multiplier, is something more sophisticated better?
-#define AIRTIME_MULTIPLIER (1.3)
-#define RX_PROCESS_TIME_MS (100)
+// Longest a slave waits before answering a plan QRY?, spreading out the
+// replies of slaves that heard the same query
+#define PLAN_RDY_BACKOFF_MAX (1000)
+
+// Tolerance on the predicted arrival of a single packet
+#define RX_SLOT_TOLERANCE_MS (20)
+
+// Position of the message ID in a test packet as the radio sends it, the only
+// bytes rewritten in the preloaded packet from one packet to the next
+#define TEST_PACKET_ID_OFFSET (RH_RF95_HEADER_LEN + MSG_HEADER_START + offsetof(radio_msg_t, id))
 
 lora_cfg_t hc_base_cfg = {
   .freq = 869.525f,
@@ -31,28 +43,46 @@ lora_cfg_t hc_base_cfg = {
 
 LoRaModule* g_radio_a = NULL;
 LoRaModule* g_radio_b = NULL;
+LoRaModule* g_test_radios[MAX_TEST_RADIOS] = {NULL};
+uint8_t g_test_radio_cnt = 0;
 
 LoRaModule::LoRaModule(lora_module_t *module_cfg, lora_cfg_t *base_cfg) : 
   _rf95(module_cfg->pin_cs, module_cfg->pin_int), 
   _rf95_dg(_rf95, module_cfg->radio_id),
   _module_cfg(*module_cfg), 
   _base_cfg(*base_cfg),
+  _ctrl_cfg(*base_cfg),
+  _cfg_image_next(0),
+  _rx_bad_last(0),
+  _tx_end_time(0),
   _interrupt(false)
-  {}
+  {
+    _tx_session.active = false;
+    _rx_session.active = false;
+    for (uint8_t i=0; i < CFG_IMAGE_CACHE_LEN; i++) {
+      _cfg_images[i].valid = false;
+    }
+  }
 
 bool LoRaModule::radio_init(void) {
   // Configure reset pin
-  pinMode(RFM95_RST, OUTPUT);
-  digitalWrite(RFM95_RST, HIGH);
+  pinMode(_module_cfg.pin_rst, OUTPUT);
+  digitalWrite(_module_cfg.pin_rst, HIGH);
   delay(10);
   // Manually trigger reset
-  digitalWrite(RFM95_RST, LOW);
+  digitalWrite(_module_cfg.pin_rst, LOW);
   delay(10);
-  digitalWrite(RFM95_RST, HIGH);
+  digitalWrite(_module_cfg.pin_rst, HIGH);
   delay(10);
   // Initialise a reliable datagram driver, this will initialise the raw driver
-  Serial.printf("Initialising radio driver...\n"); 
+  LOG_INFO("Initialising radio driver...\n"); 
   bool success = _rf95_dg.init();
+  _rf95.setWaitCallback(on_radio_wait, this);
+  _rf95.setInterruptCallback(on_radio_interrupt, this);
+  // Images hold register bits read from the radio before it was reset
+  for (uint8_t i=0; i < CFG_IMAGE_CACHE_LEN; i++) {
+    _cfg_images[i].valid = false;
+  }
   // We need an unreasonably long timeout to detect ACKs, not sure why (TODO)
   _rf95_dg.setTimeout(ACK_TIMEOUT); 
   // Initialise any buffer values
@@ -64,60 +94,194 @@ void LoRaModule::reset_to_base_cfg(void) {
   set_cfg(&_base_cfg);
 }
 
+void LoRaModule::reset_to_ctrl_cfg(void) {
+  set_cfg(&_ctrl_cfg);
+}
+
+void LoRaModule::fallback_ctrl_cfg(void) {
+  _ctrl_cfg = _base_cfg;
+}
+
+bool LoRaModule::is_ctrl_cfg_base(void) {
+  return _ctrl_cfg.sf == _base_cfg.sf;
+}
+
+lora_cfg_t* LoRaModule::get_ctrl_cfg(void) {
+  return &_ctrl_cfg;
+}
+
+bool LoRaModule::negotiate_ctrl_cfg(uint8_t slave_id) {
+  return negotiate_ctrl_cfg(&slave_id, 1);
+}
+
+bool LoRaModule::negotiate_ctrl_cfg(uint8_t slave_ids[], uint8_t slave_cnt) {
+  // Limited by the weaker direction of the weakest link from the last handshake
+  int8_t snr = min(_link_local.snr, _link_remote.snr);
+  lora_cfg_t ctrl_cfg = _base_cfg;
+  ctrl_cfg.sf = select_ctrl_sf(&_base_cfg, snr);
+  fallback_ctrl_cfg();
+  if (ctrl_cfg.sf == _base_cfg.sf) {
+    return true;
+  }
+  LOG_INFO("Negotiating control configuration with SF%d...\n", ctrl_cfg.sf);
+  bool negotiated = false;
+  for (uint8_t i=0; i < slave_cnt; i++) {
+    if (slave_ids[i] == PLAN_SLOT_DROPPED) {
+      continue;
+    }
+    _tx_buf.to = slave_ids[i];
+    _tx_buf.len = LEN_MSG_CTRL_CFG;
+    _tx_buf.p_hdr->type = msg_ctrl_cfg;
+    memcpy(&_tx_buf.data[MSG_PAYLOAD_START], &ctrl_cfg, sizeof(lora_cfg_t));
+    bool acked_cfg = acknowledged_tx(&_tx_buf, 3);
+    if (check_interrupt()) {
+      return false;
+    }
+    // Slaves that may not have switched can't follow the rest of the exchange
+    if (!acked_cfg) {
+      LOG_ERROR("Dropping slave 0x%02X!\n", slave_ids[i]);
+      slave_ids[i] = PLAN_SLOT_DROPPED;
+      continue;
+    }
+    negotiated = true;
+  }
+  if (!negotiated) {
+    return false;
+  }
+  _ctrl_cfg = ctrl_cfg;
+  reset_to_ctrl_cfg();
+  return true;
+}
+
+uint8_t LoRaModule::select_ctrl_sf(lora_cfg_t *base_cfg, int8_t snr) {
+  // Use the fastest spreading factor whose demodulation floor is exceeded by
+  // the margin, floors are from the SX1276 datasheet (-7.5dB at SF7 falling
+  // by 2.5dB per step)
+  for (uint8_t sf=CTRL_MIN_SF; sf < base_cfg->sf; sf++) {
+    float demod_floor = -5.0 - 2.5 * (sf - 6);
+    if (snr - demod_floor >= CTRL_SNR_MARGIN_DB) {
+      return sf;
+    }
+  }
+  return base_cfg->sf;
+}
+
 void LoRaModule::set_cfg(lora_cfg_t *new_cfg) {
-  Serial.printf("Setting new configuration...\n");
+  LOG_DEBUG("Setting new configuration...\n");
+  // Anything still queued goes out with the configuration it was queued under
+  _rf95.waitPacketSent();
   _rf95.setModeIdle();
-  _rf95.setFrequency(new_cfg->freq);
-  _rf95.setSpreadingFactor(new_cfg->sf);
-  _rf95.setTxPower(new_cfg->tx_dbm);
-  _rf95.setSignalBandwidth(new_cfg->bw);
-  _rf95.setCodingRate4(new_cfg->cr4_denom);
-  _rf95.setPreambleLength(new_cfg->preamble_syms);
-  _rf95.setPayloadCRC(new_cfg->crc);
+  // Only the registers that differ from the current configuration are written
+  _rf95.applyRegisters(get_cfg_image(new_cfg));
   _cur_cfg = *new_cfg;
-  Serial.printf("Configuration set!\n");
+  LOG_DEBUG("Configuration set!\n");
+}
+
+RH_RF95::RegisterImage* LoRaModule::get_cfg_image(lora_cfg_t *cfg) {
+  for (uint8_t i=0; i < CFG_IMAGE_CACHE_LEN; i++) {
+    lora_cfg_t *cached = &_cfg_images[i].cfg;
+    if (_cfg_images[i].valid && cached->freq == cfg->freq && cached->sf == cfg->sf &&
+        cached->tx_dbm == cfg->tx_dbm && cached->bw == cfg->bw && 
+        cached->cr4_denom == cfg->cr4_denom && cached->preamble_syms == cfg->preamble_syms &&
+        cached->crc == cfg->crc) {
+      return &_cfg_images[i].regs;
+    }
+  }
+  // Compiling does the float maths and register bit lookups once per configuration
+  radio_cfg_image_t *image = &_cfg_images[_cfg_image_next];
+  _cfg_image_next = (_cfg_image_next + 1) % CFG_IMAGE_CACHE_LEN;
+  _rf95.compileRegisters(cfg->freq, cfg->sf, cfg->tx_dbm, cfg->bw, cfg->cr4_denom, 
+                         cfg->preamble_syms, cfg->crc, &image->regs);
+  image->cfg = *cfg;
+  image->valid = true;
+  return &image->regs;
 }
 
 bool LoRaModule::acknowledged_tx(radio_msg_buffer_t *tx_buf, uint8_t attempts) {
   bool sent = false;
   uint8_t attempt = 0;
-  Serial.printf("Sending acknowledged %d bytes...\n", tx_buf->len);
+  LOG_DEBUG("Sending acknowledged %d bytes...\n", tx_buf->len);
   // Disable retrying so we can escape in case of interrupt
   _rf95_dg.setRetries(1);
   // Handle multiple attempt behaviour, lots of retry behaviour not mirrored 
   // from RadioHead but good enough
   while (!sent && (attempts == 0 || attempt < attempts)) {
     attempt++;
-    Serial.printf("* Attempt: %d\n", attempt);
+    LOG_DEBUG("* Attempt: %d\n", attempt);
     if (check_interrupt()) {
-      Serial.printf("Interrupted waiting for acknowledged TX!\n", tx_buf->len);
+      LOG_INFO("Interrupted waiting for acknowledged TX!\n");
       break;
     }
     sent = _rf95_dg.sendtoWait(tx_buf->data, tx_buf->len, tx_buf->to);
   }
-  Serial.printf("TX %s!\n", sent ? "successful" : "failed");
+  LOG_DEBUG("TX %s!\n", sent ? "successful" : "failed");
   return sent;
 }
 
 bool LoRaModule::unacknowledged_tx(radio_msg_buffer_t *tx_buf) {
-  Serial.printf("Sending unacknowledged %d bytes...\n", tx_buf->len);
-  bool queued = _rf95_dg.sendto(tx_buf->data, tx_buf->len, tx_buf->to);
+  LOG_DEBUG("Sending unacknowledged %d bytes...\n", tx_buf->len);
+  bool queued = queue_tx(tx_buf);
   if (!queued) {
-    Serial.printf("TX queued unsucessfully!\n");
+    LOG_ERROR("TX queued unsucessfully!\n");
     return false;
   }
+  // Results and log messages get written while our own transmissions are in
+  // the air, when nothing else can happen on the radio
+  int32_t airtime_left = _tx_end_time - millis();
+  if (airtime_left > 0) {
+    storage_flush_results(airtime_left);
+  }
   // Wait until it has actually been sent
   bool sent = _rf95_dg.waitPacketSent();
-  Serial.printf("TX %s!\n", sent ? "successful" : "failed");
+  LOG_DEBUG("TX %s!\n", sent ? "successful" : "failed");
   return sent;
 }
 
-bool LoRaModule::acknowledged_rx(radio_msg_buffer_t *rx_buf, uint16_t timeout) {
+bool LoRaModule::queue_tx(radio_msg_buffer_t *tx_buf) {
+  // The driver copies the message, so the buffer is free again straight away
+  _rf95_dg.setHeaderTo(tx_buf->to);
+  if (!_rf95.sendAsync(tx_buf->data, tx_buf->len)) {
+    return false;
+  }
+  expect_tx(tx_buf->len);
+  return true;
+}
+
+void LoRaModule::expect_tx(uint8_t len) {
+  // Transmissions follow each other, so each starts at the end of the last
+  uint32_t start = (int32_t) (_tx_end_time - millis()) > 0 ? _tx_end_time : millis();
+  _tx_end_time = start + calculate_packet_airtime(&_cur_cfg, len + RH_RF95_HEADER_LEN);
+}
+
+bool LoRaModule::on_radio_wait(void *context, uint16_t timeout) {
+  LoRaModule *module = (LoRaModule*) context;
+  if (module->_interrupt || timeout == 0) {
+    return !module->_interrupt;
+  }
+  // Sleep until a radio has something for us or we're asked to give up
+  event_wait(EVENT_RADIO, timeout);
+  return !module->_interrupt;
+}
+
+void LoRaModule::on_radio_interrupt(void *context) {
+  (void) context;
+  event_signal(EVENT_RADIO);
+}
+
+bool LoRaModule::acknowledged_rx(radio_msg_buffer_t *rx_buf, uint32_t timeout) {
   uint8_t exp_rx_len = _rx_buf.len;
   bool received = false;
-  uint16_t time = 0;
-  Serial.printf("Waiting for acknowledged RX...\n");
+  LOG_DEBUG("Waiting for acknowledged RX...\n");
+  // Timeouts count from when our own transmissions are done
+  _rf95.waitPacketSent();
+  uint32_t start_time = millis();
+  uint32_t time = 0;
   while (!received && (timeout == 0 || time < timeout)) {
+      // Wait for a message, never beyond the requested timeout
+      uint16_t wait_time = SINGLE_RX_CHECK_TIMEOUT;
+      if (timeout != 0 && (timeout - time) < wait_time) {
+        wait_time = timeout - time;
+      }
       rx_buf->len = exp_rx_len;
       // Copy full message if length not pre-configured correctly
       if (rx_buf->len == 0 || rx_buf->len > RH_RF95_MAX_MESSAGE_LEN) {
@@ -125,29 +289,36 @@ bool LoRaModule::acknowledged_rx(radio_msg_buffer_t *rx_buf, uint16_t timeout) {
       }
       // Wait for a message, receive it, and acknowledge it
       received = _rf95_dg.recvfromAckTimeout(rx_buf->data, &rx_buf->len, 
-                                      SINGLE_RX_CHECK_TIMEOUT, &rx_buf->from, &rx_buf->to);
-      time += SINGLE_RX_CHECK_TIMEOUT;
+                                      wait_time, &rx_buf->from, &rx_buf->to);
+      time = millis() - start_time;
       if (check_interrupt()) {
-        Serial.printf("Interrupted waiting for RX!\n");
+        LOG_INFO("Interrupted waiting for RX!\n");
         break;
       }
   }
   if (timeout != 0 && time >= timeout) {
-    Serial.printf("Timed out waiting for RX!\n");
+    LOG_DEBUG("Timed out waiting for RX!\n");
   }
-  Serial.printf("Acknowledged RX %s!\n", received ? "successful" : "failed");
+  LOG_DEBUG("Acknowledged RX %s!\n", received ? "successful" : "failed");
   return received;
 }
 
-bool LoRaModule::unacknowledged_rx(radio_msg_buffer_t *rx_buf, uint16_t timeout) {
+bool LoRaModule::unacknowledged_rx(radio_msg_buffer_t *rx_buf, uint32_t timeout) {
   uint8_t exp_rx_len = rx_buf->len;
   bool received = false;
-  uint16_t time = 0;
-  Serial.printf("Waiting for unacknowledged RX...\n");
+  LOG_DEBUG("Waiting for unacknowledged RX...\n");
+  // Timeouts count from when our own transmissions are done
+  _rf95.waitPacketSent();
+  uint32_t start_time = millis();
+  uint32_t time = 0;
   while (!received && (timeout == 0 || time < timeout)) {
-    // Wait for a message
-    bool available = _rf95.waitAvailableTimeout(SINGLE_RX_CHECK_TIMEOUT);
-    time += SINGLE_RX_CHECK_TIMEOUT;
+    // Wait for a message, never beyond the requested timeout
+    uint16_t wait_time = SINGLE_RX_CHECK_TIMEOUT;
+    if (timeout != 0 && (timeout - time) < wait_time) {
+      wait_time = timeout - time;
+    }
+    bool available = _rf95.waitAvailableTimeout(wait_time);
+    time = millis() - start_time;
     // Process message if one has arrived
     if (available) {
       // Copy full message if length not pre-configured correctly
@@ -162,19 +333,19 @@ bool LoRaModule::unacknowledged_rx(radio_msg_buffer_t *rx_buf, uint16_t timeout)
                     (rx_buf->to == _rf95_dg.thisAddress()));
     }
     if (check_interrupt()) {
-      Serial.printf("Interrupted waiting for RX!\n");
+      LOG_INFO("Interrupted waiting for RX!\n");
       break;
     }
   }
   if (timeout != 0 && time >= timeout) {
-    Serial.printf("Timed out waiting for RX!\n");
+    LOG_DEBUG("Timed out waiting for RX!\n");
   }
-  Serial.printf("Unacknowledged RX %s!\n", received ? "successful" : "failed");
+  LOG_DEBUG("Unacknowledged RX %s!\n", received ? "successful" : "failed");
   return received;
 }
 
 radio_cmd_t LoRaModule::recv_command(uint8_t *master_id) {
-  Serial.printf("Waiting for a command from master...\n");
+  LOG_DEBUG("Waiting for a command from master...\n");
   bool got_cmd = false;
   while (!got_cmd) {
     _rx_buf.len = LEN_MSG_EMPTY;
@@ -191,47 +362,142 @@ radio_cmd_t LoRaModule::recv_command(uint8_t *master_id) {
     // Handle conversion to command
     switch (_rx_buf.p_hdr->type) {
       case msg_test_qry:
-        Serial.printf("Received message is a handle testdef command!\n");
+        LOG_DEBUG("Received message is a handle testdef command!\n");
         return cmd_testdef;
       case msg_heartbeat:
-        Serial.printf("Received message is a heartbeat command!\n");
+        LOG_DEBUG("Received message is a heartbeat command!\n");
         return cmd_heartbeat;
+      case msg_plan_qry:
+        LOG_DEBUG("Received message is a handle plan command!\n");
+        return cmd_plan;
       default:
-        Serial.printf("Received message is not a command!\n");
+        LOG_DEBUG("Received message is not a command!\n");
         break;
     }
   }
   return cmd_invalid;
 }
 
-bool LoRaModule::send_testdef(lora_testdef_t *tx_testdef) {
+bool LoRaModule::query_slave(radio_msg_type_t qry_type, uint8_t *slave_id) {
     // Send QRY? command and wait for someone to say RDY!
     bool got_rdy = false;
     while(!got_rdy) {
-      Serial.printf("Sending QRY? request to slaves...\n");
+      LOG_DEBUG("Sending QRY? request to slaves...\n");
       _tx_buf.to = RH_BROADCAST_ADDRESS;
       _tx_buf.len = sizeof(radio_msg_t);
-      _tx_buf.p_hdr->type = msg_test_qry;
+      _tx_buf.p_hdr->type = qry_type;
       bool sent = unacknowledged_tx(&_tx_buf);
       if (!sent || check_interrupt())
         return false;
-      Serial.printf("Waiting for RDY! from a slave...\n");
-      _rx_buf.len = LEN_MSG_EMPTY;
+      LOG_DEBUG("Waiting for RDY! from a slave...\n");
+      _rx_buf.len = LEN_MSG_RDY;
       got_rdy = acknowledged_rx(&_rx_buf, RDY_RX_TIMEOUT);
       if (!got_rdy || check_interrupt())
         return false;
-      // Verify received message is a RDY!
-      got_rdy = (_rx_buf.p_hdr->type == msg_test_rdy);
-      got_rdy &= _rx_buf.from != RH_BROADCAST_ADDRESS;
-      got_rdy &= _rx_buf.to == _rf95_dg.thisAddress();
-      Serial.printf("Received message is%s a RDY!\n", got_rdy ? "" : " not");
+      got_rdy = is_rdy();
+    }
+    *slave_id = _rx_buf.from;
+    record_link_quality(true);
+    return true;
+}
+
+uint8_t LoRaModule::enrol_slaves(uint8_t slave_ids[], uint8_t max_cnt) {
+  // Send a single QRY? and enrol every slave that says RDY! in the window
+  LOG_DEBUG("Sending QRY? request to slaves...\n");
+  _tx_buf.to = RH_BROADCAST_ADDRESS;
+  _tx_buf.len = sizeof(radio_msg_t);
+  _tx_buf.p_hdr->type = msg_plan_qry;
+  bool sent = unacknowledged_tx(&_tx_buf);
+  if (!sent || check_interrupt())
+    return 0;
+  LOG_DEBUG("Waiting for RDY! from slaves...\n");
+  uint8_t slave_cnt = 0;
+  uint32_t enrol_window = calculate_plan_enrol_window(&_cur_cfg);
+  uint32_t start_time = millis();
+  uint32_t elapsed;
+  while (slave_cnt < max_cnt && (elapsed = millis() - start_time) < enrol_window) {
+    _rx_buf.len = LEN_MSG_RDY;
+    bool got_rdy = acknowledged_rx(&_rx_buf, enrol_window - elapsed);
+    if (check_interrupt())
+      return 0;
+    if (!got_rdy || !is_rdy())
+      continue;
+    // A slave repeats its RDY! if our acknowledgment was lost
+    bool enrolled = false;
+    for (uint8_t i=0; i < slave_cnt; i++) {
+      enrolled |= slave_ids[i] == _rx_buf.from;
     }
+    if (enrolled)
+      continue;
+    record_link_quality(slave_cnt == 0);
+    slave_ids[slave_cnt++] = _rx_buf.from;
+    LOG_INFO("Enrolled slave 0x%02X!\n", _rx_buf.from);
+  }
+  LOG_INFO("Enrolled %d slave(s)\n", slave_cnt);
+  return slave_cnt;
+}
+
+bool LoRaModule::is_rdy(void) {
+  // Verify received message is a RDY!
+  bool got_rdy = (_rx_buf.p_hdr->type == msg_test_rdy);
+  got_rdy &= _rx_buf.from != RH_BROADCAST_ADDRESS;
+  got_rdy &= _rx_buf.to == _rf95_dg.thisAddress();
+  got_rdy &= _rx_buf.len == LEN_MSG_RDY;
+  LOG_DEBUG("Received message is%s a RDY!\n", got_rdy ? "" : " not");
+  return got_rdy;
+}
+
+void LoRaModule::record_link_quality(bool first) {
+  // Track link quality in both directions for choosing the control configuration,
+  // with several slaves only the weakest link matters
+  radio_link_report_t remote;
+  memcpy(&remote, &_rx_buf.data[MSG_PAYLOAD_START], sizeof(radio_link_report_t));
+  radio_link_report_t local;
+  local.snr = _rf95.lastSNR();
+  local.rssi = _rf95.lastRssi();
+  local.test_radios = g_test_radio_cnt;
+  LOG_INFO("Link Quality | [Local SNR: %ddB] [Remote SNR: %ddB]\n", local.snr, remote.snr);
+  LOG_INFO("Slave has %d test radio(s)\n", remote.test_radios);
+  if (first) {
+    _link_local = local;
+    _link_remote = remote;
+    return;
+  }
+  _link_local.snr = min(_link_local.snr, local.snr);
+  _link_local.rssi = min(_link_local.rssi, local.rssi);
+  _link_remote.snr = min(_link_remote.snr, remote.snr);
+  _link_remote.rssi = min(_link_remote.rssi, remote.rssi);
+  _link_remote.test_radios = min(_link_remote.test_radios, remote.test_radios);
+}
+
+bool LoRaModule::send_rdy(uint8_t master_id) {
+  // Respond to master with a RDY!, reporting how well its query was heard
+  radio_link_report_t report;
+  report.snr = _rf95.lastSNR();
+  report.rssi = _rf95.lastRssi();
+  report.test_radios = g_test_radio_cnt;
+  _tx_buf.to = master_id;
+  _tx_buf.len = LEN_MSG_RDY;
+  _tx_buf.p_hdr->type = msg_test_rdy;
+  memcpy(&_tx_buf.data[MSG_PAYLOAD_START], &report, sizeof(radio_link_report_t));
+  LOG_DEBUG("Responding with RDY! to master...\n");
+  bool acked_rdy = acknowledged_tx(&_tx_buf, 3);
+  if (!acked_rdy || check_interrupt())
+    return false;
+  LOG_DEBUG("Got acknowledgment to RDY!\n");
+  return true;
+}
+
+bool LoRaModule::send_testdef(lora_testdef_t *tx_testdef) {
+    uint8_t slave_id;
+    if (!query_slave(msg_test_qry, &slave_id))
+      return false;
     // Track the members of the exchange
     tx_testdef->master_id = _rf95_dg.thisAddress();
-    tx_testdef->slave_id = _rx_buf.from;
+    tx_testdef->slave_id = slave_id;
 
     // Send Test Definition
-    Serial.printf("Sending test definition to slave...\n");
+    LOG_DEBUG("Sending test definition to slave...\n");
     _tx_buf.to = tx_testdef->slave_id;
     _tx_buf.len = LEN_MSG_TESTDEF;
     _tx_buf.p_hdr->type = msg_test_testdef;
@@ -240,25 +506,18 @@ bool LoRaModule::send_testdef(lora_testdef_t *tx_testdef) {
     bool acked_testdef = acknowledged_tx(&_tx_buf, 3);
     if (!acked_testdef || check_interrupt())
       return false;  
-    Serial.printf("Testdef delivered successfully!\n");
+    LOG_INFO("Testdef delivered successfully!\n");
 
     return true;
 }
 
 bool LoRaModule::recv_testdef(lora_testdef_t *rx_testdef) {
-  // Respond to master with a RDY!
-  _tx_buf.to = rx_testdef->master_id;
-  _tx_buf.len = LEN_MSG_EMPTY;
-  _tx_buf.p_hdr->type = msg_test_rdy;
-  Serial.printf("Responding with RDY! to master...\n");
-  bool acked_rdy = acknowledged_tx(&_tx_buf, 3);
-  if (!acked_rdy || check_interrupt())
+  if (!send_rdy(rx_testdef->master_id))
     return false;
-  Serial.printf("Got acknowledgment to RDY!\n");
 
   // Receive Test Definition
   bool got_testdef = false;
-  Serial.printf("Waiting for test definition from master...\n");
+  LOG_DEBUG("Waiting for test definition from master...\n");
   while (!got_testdef) {
     // Give up if we haven't received any message within a timeout of the last
     _rx_buf.len = LEN_MSG_TESTDEF;
@@ -272,16 +531,307 @@ bool LoRaModule::recv_testdef(lora_testdef_t *rx_testdef) {
   }
   // Copy out testdef to receive buffer
   memcpy(rx_testdef, &_rx_buf.data[MSG_PAYLOAD_START], sizeof(lora_testdef_t));
-  Serial.printf("Testdef received successfully!\n");
+  LOG_INFO("Testdef received successfully!\n");
   dbg_print_testdef((lora_testdef_t*) &_rx_buf.data[MSG_PAYLOAD_START]);
-  Serial.printf("\n");
+  LOG_DEBUG("\n");
   return true;
 }
 
+bool LoRaModule::send_plan(uint16_t testdef_cnt, uint32_t max_block_duration, uint8_t slave_ids[],
+                           uint8_t *slave_cnt) {
+  *slave_cnt = enrol_slaves(slave_ids, MAX_PLAN_SLAVES);
+  if (*slave_cnt == 0)
+    return false;
+  // Move to the fastest control configuration the links support for the rest
+  // of the exchange, failure here just leaves us on the base configuration
+  negotiate_ctrl_cfg(slave_ids, *slave_cnt);
+
+  // Announce the plan to every slave along with its slot, the testdefs
+  // themselves follow block by block
+  LOG_INFO("Announcing plan of %d testdefs to %d slave(s)...\n", testdef_cnt, *slave_cnt);
+  radio_plan_frag_t frag;
+  frag.total = testdef_cnt;
+  frag.first = 0;
+  frag.cnt = 0;
+  frag.slot_cnt = *slave_cnt;
+  frag.max_block_duration = max_block_duration;
+  bool delivered = false;
+  for (uint8_t slot=0; slot < *slave_cnt; slot++) {
+    if (slave_ids[slot] == PLAN_SLOT_DROPPED) {
+      continue;
+    }
+    frag.slot = slot;
+    _tx_buf.to = slave_ids[slot];
+    _tx_buf.len = LEN_MSG_PLAN_FRAG(0);
+    _tx_buf.p_hdr->type = msg_plan_frag;
+    _tx_buf.p_hdr->id = 0;
+    memcpy(&_tx_buf.data[MSG_PAYLOAD_START], &frag, sizeof(radio_plan_frag_t));
+    bool acked_frag = acknowledged_tx(&_tx_buf, 3);
+    if (check_interrupt())
+      return false;
+    // Its slot is left empty so the other slaves' schedules are unaffected
+    if (!acked_frag) {
+      LOG_ERROR("Dropping slave 0x%02X!\n", slave_ids[slot]);
+      slave_ids[slot] = PLAN_SLOT_DROPPED;
+      continue;
+    }
+    delivered = true;
+  }
+  if (!delivered)
+    return false;
+  LOG_INFO("Plan announced successfully!\n");
+  return true;
+}
+
+bool LoRaModule::recv_plan(uint8_t master_id, uint16_t *testdef_cnt, uint32_t *max_block_duration, 
+                           uint8_t *slot, uint8_t *slot_cnt) {
+  // Other slaves may have heard the same QRY?, so avoid answering together
+  delay(random(PLAN_RDY_BACKOFF_MAX));
+  if (!send_rdy(master_id))
+    return false;
+
+  // Announcements to every other slave may be sent before ours
+  uint32_t timeout = TESTDEF_RX_TIMEOUT + calculate_plan_enrol_window(&_base_cfg) + (MAX_PLAN_SLAVES - 1) * 
+                     (calculate_plan_frag_duration(&_base_cfg, 0) + ACK_TIMEOUT);
+  LOG_INFO("Waiting for plan from master...\n");
+  while (true) {
+    // Give up if we haven't received any message within a timeout of the last
+    _rx_buf.len = RH_RF95_MAX_MESSAGE_LEN;
+    bool got_frag = acknowledged_rx(&_rx_buf, timeout);
+    if (!got_frag || check_interrupt())
+      return false;
+    got_frag &= _rx_buf.from == master_id;
+    // Control configuration is negotiated before the plan arrives
+    if (got_frag && _rx_buf.p_hdr->type == msg_ctrl_cfg && _rx_buf.len == LEN_MSG_CTRL_CFG) {
+      memcpy(&_ctrl_cfg, &_rx_buf.data[MSG_PAYLOAD_START], sizeof(lora_cfg_t));
+      LOG_INFO("Switching to control configuration with SF%d...\n", _ctrl_cfg.sf);
+      reset_to_ctrl_cfg();
+      continue;
+    }
+    // Verify received message is the plan announcement
+    got_frag &= _rx_buf.p_hdr->type == msg_plan_frag;
+    got_frag &= _rx_buf.to == _rf95_dg.thisAddress();
+    got_frag &= _rx_buf.len == LEN_MSG_PLAN_FRAG(0);
+    if (got_frag) {
+      break;
+    }
+  }
+  radio_plan_frag_t frag;
+  memcpy(&frag, &_rx_buf.data[MSG_PAYLOAD_START], sizeof(radio_plan_frag_t));
+  if (frag.slot >= frag.slot_cnt || frag.slot_cnt > MAX_PLAN_SLAVES) {
+    LOG_ERROR("Plan announcement is not valid!\n");
+    return false;
+  }
+  *testdef_cnt = frag.total;
+  *max_block_duration = frag.max_block_duration;
+  *slot = frag.slot;
+  *slot_cnt = frag.slot_cnt;
+  LOG_INFO("Plan of %d testdefs announced, using slot %d of %d!\n", 
+                frag.total, *slot + 1, *slot_cnt);
+  return true;
+}
+
+uint8_t LoRaModule::get_remote_test_radio_cnt(void) {
+  // Slaves always have at least one test radio
+  return max(_link_remote.test_radios, (uint8_t) 1);
+}
+
+bool LoRaModule::send_plan_block(uint8_t slave_ids[], uint8_t slave_cnt, lora_testdef_t testdefs[], 
+                                 uint16_t first, uint16_t cnt) {
+  // Track the members of the exchange, the session tracks any further slaves
+  for (uint16_t i=0; i < cnt; i++) {
+    testdefs[i].master_id = _rf95_dg.thisAddress();
+    testdefs[i].slave_id = slave_ids[0];
+  }
+  // Fragments are interleaved between slaves so none waits for a whole block.
+  // A lost acknowledgment does not mean the slave missed the fragment, so it
+  // keeps getting the rest. One that did miss part of the block refuses its
+  // sync and sits the block out until the next sync
+  bool acked_all = true;
+  uint16_t sent = 0;
+  while (sent < cnt) {
+    radio_plan_frag_t frag;
+    // Only an announcement describes the whole plan
+    frag.total = 0;
+    frag.first = first + sent;
+    frag.cnt = min((uint16_t) PLAN_TESTDEFS_PER_FRAG, (uint16_t) (cnt - sent));
+    frag.slot_cnt = slave_cnt;
+    frag.max_block_duration = 0;
+    for (uint8_t slot=0; slot < slave_cnt; slot++) {
+      if (slave_ids[slot] == PLAN_SLOT_DROPPED) {
+        continue;
+      }
+      frag.slot = slot;
+      _tx_buf.to = slave_ids[slot];
+      _tx_buf.len = LEN_MSG_PLAN_FRAG(frag.cnt);
+      _tx_buf.p_hdr->type = msg_plan_frag;
+      _tx_buf.p_hdr->id = frag.first;
+      memcpy(&_tx_buf.data[MSG_PAYLOAD_START], &frag, sizeof(radio_plan_frag_t));
+      memcpy(&_tx_buf.data[PLAN_FRAG_PAYLOAD_START], &testdefs[sent], 
+             frag.cnt * sizeof(lora_testdef_t));
+      LOG_INFO("Sending testdefs %d to %d to slave 0x%02X...\n", 
+                    frag.first, frag.first + frag.cnt - 1, slave_ids[slot]);
+      bool acked_frag = acknowledged_tx(&_tx_buf, 3);
+      if (check_interrupt())
+        return false;
+      if (!acked_frag) {
+        LOG_ERROR("Slave 0x%02X may miss this block!\n", slave_ids[slot]);
+        acked_all = false;
+      }
+    }
+    sent += frag.cnt;
+  }
+  return acked_all;
+}
+
+bool LoRaModule::send_plan_sync(uint8_t slave_ids[], uint8_t slave_cnt, uint16_t next, uint16_t cnt,
+                                uint8_t parallel, uint32_t *start_time) {
+  radio_plan_sync_t sync;
+  sync.next = next;
+  sync.cnt = cnt;
+  sync.parallel = parallel;
+  // Allow enough time for every attempt to every slave to complete before the block starts
+  uint32_t sync_airtime = calculate_packet_airtime(&_cur_cfg, RH_RF95_HEADER_LEN + LEN_MSG_PLAN_SYNC);
+  uint8_t active_cnt = 0;
+  for (uint8_t i=0; i < slave_cnt; i++) {
+    active_cnt += slave_ids[i] != PLAN_SLOT_DROPPED;
+  }
+  *start_time = millis() + calculate_plan_sync_duration(&_cur_cfg) * active_cnt;
+
+  LOG_DEBUG("Sending plan sync for testdefs %d to %d...\n", next, next + cnt - 1);
+  bool acked_all = true;
+  for (uint8_t i=0; i < slave_cnt; i++) {
+    if (slave_ids[i] == PLAN_SLOT_DROPPED) {
+      continue;
+    }
+    bool acked_sync = false;
+    for (uint8_t attempt=0; attempt < PLAN_SYNC_ATTEMPTS && !acked_sync; attempt++) {
+      // The start time is fixed, only the delay to it changes between attempts
+      int32_t start_delay = *start_time - millis() - sync_airtime;
+      if (start_delay <= 0)
+        break;
+      sync.start_delay = start_delay;
+      _tx_buf.to = slave_ids[i];
+      _tx_buf.len = LEN_MSG_PLAN_SYNC;
+      _tx_buf.p_hdr->type = msg_plan_sync;
+      _tx_buf.p_hdr->id = next;
+      memcpy(&_tx_buf.data[MSG_PAYLOAD_START], &sync, sizeof(radio_plan_sync_t));
+      acked_sync = acknowledged_tx(&_tx_buf, 1);
+      if (check_interrupt())
+        return false;
+    }
+    // A lost acknowledgment does not mean the slave missed the sync, the block is
+    // executed regardless. A slave that did miss it waits out the block for the next
+    LOG_INFO("Plan sync %s by slave 0x%02X!\n", 
+                  acked_sync ? "acknowledged" : "not acknowledged", slave_ids[i]);
+    acked_all &= acked_sync;
+  }
+  return acked_all;
+}
+
+bool LoRaModule::recv_plan_sync(uint8_t master_id, lora_testdef_t testdefs[], uint16_t max_cnt, 
+                                uint16_t *next, uint16_t *cnt, uint8_t *parallel, 
+                                uint32_t *start_time, uint32_t timeout) {
+  bool got_sync = false;
+  uint16_t block_first = 0;
+  uint16_t held = 0;
+  LOG_DEBUG("Waiting for plan sync from master...\n");
+  while (!got_sync) {
+    // Give up if we haven't received any message within a timeout of the last
+    _rx_buf.len = RH_RF95_MAX_MESSAGE_LEN;
+    bool got_msg = acknowledged_rx(&_rx_buf, timeout);
+    if (!got_msg || check_interrupt())
+      return false;
+    if (_rx_buf.from != master_id || _rx_buf.to != _rf95_dg.thisAddress())
+      continue;
+    // The testdefs of the block arrive ahead of its sync
+    if (_rx_buf.p_hdr->type == msg_plan_frag && _rx_buf.len >= LEN_MSG_PLAN_FRAG(0)) {
+      radio_plan_frag_t frag;
+      memcpy(&frag, &_rx_buf.data[MSG_PAYLOAD_START], sizeof(radio_plan_frag_t));
+      // A fragment that doesn't follow on from those held starts a new block
+      if (frag.first != block_first + held) {
+        block_first = frag.first;
+        held = 0;
+      }
+      if ((held + frag.cnt) > max_cnt || _rx_buf.len != LEN_MSG_PLAN_FRAG(frag.cnt)) {
+        LOG_ERROR("Plan fragment is not the one expected!\n");
+        held = 0;
+        continue;
+      }
+      memcpy(&testdefs[held], &_rx_buf.data[PLAN_FRAG_PAYLOAD_START], 
+             frag.cnt * sizeof(lora_testdef_t));
+      held += frag.cnt;
+      LOG_DEBUG("Received testdefs %d to %d\n", block_first, block_first + held - 1);
+      continue;
+    }
+    // Verify received message is a plan sync
+    got_sync = _rx_buf.p_hdr->type == msg_plan_sync && _rx_buf.len == LEN_MSG_PLAN_SYNC;
+  }
+  // The acknowledgment has been sent since the sync arrived so account for it
+  uint32_t ack_airtime = calculate_packet_airtime(&_cur_cfg, RH_RF95_HEADER_LEN + 1);
+  radio_plan_sync_t sync;
+  memcpy(&sync, &_rx_buf.data[MSG_PAYLOAD_START], sizeof(radio_plan_sync_t));
+  *next = sync.next;
+  *cnt = sync.cnt;
+  *parallel = sync.parallel;
+  *start_time = millis() - ack_airtime + sync.start_delay;
+  LOG_INFO("Plan sync received for testdefs %d to %d!\n", sync.next, sync.next + sync.cnt - 1);
+  // Can't take part in a block without all of its testdefs
+  if (sync.cnt > 0 && (sync.next != block_first || sync.cnt > held)) {
+    LOG_ERROR("Missing testdefs of the block!\n");
+    return false;
+  }
+  return true;
+}
+
+bool LoRaModule::send_plan_abort(uint8_t slave_ids[], uint8_t slave_cnt) {
+  bool acked_all = true;
+  for (uint8_t i=0; i < slave_cnt; i++) {
+    if (slave_ids[i] == PLAN_SLOT_DROPPED) {
+      continue;
+    }
+    _tx_buf.to = slave_ids[i];
+    _tx_buf.len = LEN_MSG_EMPTY;
+    _tx_buf.p_hdr->type = msg_plan_abort;
+    LOG_INFO("Sending plan abort to slave 0x%02X...\n", slave_ids[i]);
+    acked_all &= acknowledged_tx(&_tx_buf, 3);
+  }
+  return acked_all;
+}
+
+bool LoRaModule::poll_plan_abort(uint8_t master_id) {
+  // Never blocks so it can be used alongside another radio's traffic
+  if (!_rf95_dg.available()) {
+    return false;
+  }
+  _rx_buf.len = RH_RF95_MAX_MESSAGE_LEN;
+  if (!_rf95_dg.recvfromAck(_rx_buf.data, &_rx_buf.len, &_rx_buf.from, &_rx_buf.to)) {
+    return false;
+  }
+  return _rx_buf.p_hdr->type == msg_plan_abort && _rx_buf.from == master_id;
+}
+
 bool LoRaModule::send_testdef_packets(lora_testdef_t *testdef) {
+  return send_testdef_packets(testdef, millis());
+}
+
+bool LoRaModule::send_testdef_packets(lora_testdef_t *testdef, uint32_t start_time) {
+  if (!begin_send_testdef_packets(testdef, start_time)) {
+    return false;
+  }
+  while (poll_send_testdef_packets()) {
+    yield();
+  }
+  return end_send_testdef_packets();
+}
+
+bool LoRaModule::begin_send_testdef_packets(lora_testdef_t *testdef, uint32_t start_time,
+                                            uint8_t slot, uint8_t slot_cnt) {
+  _tx_session.active = false;
+  _tx_session.valid = false;
   // Verify anything that could start trashing memory
   if (testdef->packet_len < MIN_TESTDEF_PACKET_LEN || testdef->packet_len > MAX_TESTDEF_PACKET_LEN) {
-    Serial.printf("Packet length to send must be between %d and %d but was %d!\n",
+    LOG_ERROR("Packet length to send must be between %d and %d but was %d!\n",
         MIN_TESTDEF_PACKET_LEN, MAX_TESTDEF_PACKET_LEN, testdef->packet_len);
     return false;
   }
@@ -300,115 +850,323 @@ bool LoRaModule::send_testdef_packets(lora_testdef_t *testdef) {
     _tx_buf.data[MSG_PAYLOAD_START + i] = pattern[payload_len % 
                                               sizeof(pattern) / sizeof(pattern[0])]; 
   }
-  Serial.printf("Sending %d packets of length %d...\n", 
-    testdef->packet_cnt, testdef->packet_len);
-  // Give the master some time to prepare
-  delay(SLAVE_PACKET_SEND_DELAY);
+  // Load the packet into the radio once, each send only rewrites its ID
+  _tx_buf.p_hdr->id = 0;
+  _rf95_dg.setHeaderTo(_tx_buf.to);
+  _rf95.preloadPacket(_tx_buf.data, _tx_buf.len);
 
-  // Fire and forget the number of packets requested
-  uint16_t packet = 0;
-  uint32_t start_time = millis();
-  while (packet < testdef->packet_cnt) {
-    if (check_interrupt()) {
-      Serial.printf("Interrupted when sending packets!\n", packet);
-      return false;
+  // Every packet gets a fixed slot so the master can predict when each ID arrives
+  _tx_session.testdef = testdef;
+  _tx_session.slot_time = calculate_packet_slot(&testdef->cfg, testdef->packet_len);
+  LOG_DEBUG("Sending %d packets of length %d in %dms slots...\n", 
+    testdef->packet_cnt, testdef->packet_len, _tx_session.slot_time);
+  // Give the master some time to prepare, all slots are relative to this
+  _tx_session.start_time = start_time + SLAVE_PACKET_SEND_DELAY;
+  _tx_session.slot = slot;
+  _tx_session.slot_cnt = slot_cnt;
+  _tx_session.packet = 0;
+  _tx_session.active = true;
+  _tx_session.valid = true;
+  return true;
+}
+
+bool LoRaModule::poll_send_testdef_packets(void) {
+  radio_tx_session_t *session = &_tx_session;
+  if (!session->active) {
+    return false;
+  }
+  if (check_interrupt()) {
+    LOG_INFO("Interrupted when sending packet %d!\n", session->packet);
+    session->active = false;
+    session->valid = false;
+    return false;
+  }
+  // Fire and forget the number of packets requested, finishing once the
+  // last has left the radio
+  if (session->packet >= session->testdef->packet_cnt) {
+    session->active = _rf95.mode() == RHGenericDriver::RHModeTx;
+    return session->active;
+  }
+  // Wait for the start of the packet's slot, slot boundaries are absolute so
+  // any processing overhead does not accumulate over the test
+  uint32_t slot_start = session->start_time + (session->packet * session->slot_cnt + session->slot) * 
+                        session->slot_time;
+  if ((int32_t) (slot_start - millis()) > 0) {
+    return true;
+  }
+  // A packet started beyond the guard time would overrun into the next slot
+  if ((int32_t) (millis() - slot_start) > PACKET_SLOT_GUARD_MS) {
+    LOG_ERROR("Missed slot for packet %d!\n", session->packet);
+    session->packet++;
+    return true;
+  }
+  // A packet due while the previous is still in the air is queued to follow
+  // it straight from the interrupt, otherwise it is sent now
+  _tx_buf.p_hdr->id = session->packet;
+  const uint8_t *id = (const uint8_t*) &_tx_buf.p_hdr->id;
+  if (!_rf95.queuePreloaded(TEST_PACKET_ID_OFFSET, id, sizeof(_tx_buf.p_hdr->id))) {
+    if (_rf95.mode() == RHGenericDriver::RHModeTx) {
+      // The one queued before this hasn't started yet
+      return true;
     }
-    Serial.printf("Sending Packet %d...\n", packet);
-    _tx_buf.p_hdr->id = packet;
-    // If any fail to send we'll just ignore it, this shouldn't happen
-    unacknowledged_tx(&_tx_buf);
-    packet++;
-    delay(RX_PROCESS_TIME_MS);
-  }
-  // Calculate the sending duration, not worrying about wraps, should be good
-  // for 49 days...
-  uint32_t duration = millis() - start_time;
-  Serial.printf("Took %dms to send all packets!\n", duration);
+    // Receiving shares the FIFO, so load the whole packet again. If any fail
+    // to send we'll just ignore it, this shouldn't happen
+    _rf95.preloadPacket(_tx_buf.data, _tx_buf.len);
+    _rf95.queuePreloaded(TEST_PACKET_ID_OFFSET, id, sizeof(_tx_buf.p_hdr->id));
+  }
+  session->packet++;
   return true;
 }
 
-uint16_t LoRaModule::rx_bad_since_last_check(void) {
-  static uint16_t rx_bad_last = _rf95.rxBad();
+bool LoRaModule::end_send_testdef_packets(void) {
+  _tx_session.active = false;
+  _rf95_dg.waitPacketSent();
+  if (_tx_session.valid) {
+    // Calculate the sending duration, not worrying about wraps, should be good
+    // for 49 days...
+    uint32_t duration = millis() - _tx_session.start_time;
+    LOG_INFO("Took %dms to send all packets!\n", duration);
+  }
+  return _tx_session.valid;
+}
 
+uint16_t LoRaModule::rx_bad_since_last_check(void) {
   // Check if we have any bad receives
   uint16_t rx_bad = _rf95.rxBad();
   // Find how many have occurred since last check
   uint16_t rx_bad_since = rx_bad;
-  if (rx_bad < rx_bad_last) {
+  if (rx_bad < _rx_bad_last) {
     rx_bad_since += UINT16_MAX;
   }
-  rx_bad_since -= rx_bad_last;
-  rx_bad_last = rx_bad;
+  rx_bad_since -= _rx_bad_last;
+  _rx_bad_last = rx_bad;
 
   return rx_bad_since;
 }
 
 bool LoRaModule::recv_testdef_packets(lora_testdef_t *testdef, uint16_t *recv_packets, File* log_file) {
-  bool results_valid = true;
-  File results_file = storage_init_result_file(testdef->id);
+  return recv_testdef_packets(testdef, recv_packets, log_file, millis());
+}
+
+bool LoRaModule::recv_testdef_packets(lora_testdef_t *testdef, uint16_t *recv_packets, File* log_file,
+                                      uint32_t start_time) {
+  begin_recv_testdef_packets(testdef, log_file, start_time);
+  while (poll_recv_testdef_packets()) {
+    storage_flush_results(get_recv_idle_time());
+    yield();
+  }
+  return end_recv_testdef_packets(recv_packets);
+}
+
+void LoRaModule::begin_recv_testdef_packets(lora_testdef_t *testdef, File* log_file, 
+                                            uint32_t start_time, uint8_t slave_ids[], uint8_t slot_cnt) {
+  radio_rx_session_t *session = &_rx_session;
+  session->testdef = testdef;
+  session->log_file = log_file;
+  // Without an enrolled session the testdef's own slave has every slot
+  if (slave_ids == NULL) {
+    slave_ids = &testdef->slave_id;
+    slot_cnt = 1;
+  }
+  session->slot_cnt = slot_cnt;
+  // Track the number of failed receives
+  session->rx_bad_total = 0;
+  rx_bad_since_last_check(); // reset the internal count
+  session->ring_dropped_start = _rf95.rxRingDropped();
+
+  // Slaves send on fixed slots so the window is known exactly
+  session->start_time = start_time;
+  session->start_time_us = micros() - (int32_t) (millis() - start_time) * 1000;
+  session->timeout = calculate_testdef_duration(testdef, slot_cnt);
+  session->time_left = session->timeout;
+  // Arrival times would wrap before the last packet, so the results are refused
+  if (session->timeout > MAX_TESTDEF_DURATION_MS) {
+    SERIAL_AND_LOG((*log_file), "Window of %lums for %d slots exceeds %lums, not receiving!\n", 
+                   session->timeout, slot_cnt, MAX_TESTDEF_DURATION_MS);
+    session->slot_cnt = 0;
+    session->active = false;
+    session->valid = false;
+    return;
+  }
   // Use the mutually agreed configuration
   set_cfg(&testdef->cfg);
-  uint16_t valid_packets = 0;
-  // Track the number of failed receives
-  uint32_t rx_bad_total = 0;
-  rx_bad_since_last_check(); // reset the functions internal count
+  SERIAL_AND_LOG((*log_file), "Waiting for packets for %dms...\n", session->timeout);
 
-  // Determine a timeout that should allow all packets to be captured
-  uint32_t packet_airtime = calculate_packet_airtime(&testdef->cfg, testdef->packet_len);
-  uint32_t packet_timeout = packet_airtime * AIRTIME_MULTIPLIER + RX_PROCESS_TIME_MS;
-  uint32_t timeout = packet_timeout * (testdef->packet_cnt+1) + SLAVE_PACKET_SEND_DELAY;
-  SERIAL_AND_LOG((*log_file), "Waiting for packets for %dms...\n", timeout);
+  // Until a packet arrives predictions are made from each slave's schedule
+  session->slot_time = calculate_packet_slot(&testdef->cfg, testdef->packet_len);
+  uint32_t airtime = calculate_packet_airtime(&testdef->cfg, testdef->packet_len);
+  for (uint8_t slot=0; slot < slot_cnt; slot++) {
+    radio_rx_slave_t *slave = &session->slaves[slot];
+    slave->id = slave_ids[slot];
+    slave->active = slave->id != PLAN_SLOT_DROPPED;
+    if (!slave->active) {
+      continue;
+    }
+    slave->results = storage_init_result_file(testdef->id, slot_cnt > 1 ? slave->id : 0);
+    slave->anchor_time = start_time + SLAVE_PACKET_SEND_DELAY + slot * session->slot_time + airtime;
+    slave->anchor_id = 0;
+    slave->next_id = 0;
+    slave->valid_packets = 0;
+  }
+  session->active = true;
+  session->valid = true;
+}
 
-  uint32_t start_time = millis();
-  int32_t time_left = 0;
-  while ((time_left = timeout - (millis() - start_time)) > 0) {
-    if (check_interrupt()) {
-      SERIAL_AND_LOG((*log_file), "Interrupted when receiving packets!\n");
-      results_valid = false;
-      break;
+bool LoRaModule::poll_recv_testdef_packets(void) {
+  radio_rx_session_t *session = &_rx_session;
+  if (!session->active) {
+    return false;
+  }
+  lora_testdef_t *testdef = session->testdef;
+  File *log_file = session->log_file;
+  session->time_left = session->timeout - (millis() - session->start_time);
+  if (session->time_left <= 0) {
+    session->active = false;
+    return false;
+  }
+  if (check_interrupt()) {
+    SERIAL_AND_LOG((*log_file), "Interrupted when receiving packets!\n");
+    session->valid = false;
+    session->active = false;
+    return false;
+  }
+  // Each of a slave's packets is a whole packet interval after the last
+  uint32_t interval = session->slot_time * session->slot_cnt;
+  bool any_active = false;
+  for (uint8_t slot=0; slot < session->slot_cnt; slot++) {
+    radio_rx_slave_t *slave = &session->slaves[slot];
+    if (!slave->active) {
+      continue;
+    }
+    // Stop as soon as the last packet's slot has passed
+    int32_t last_deadline = slave->anchor_time + RX_SLOT_TOLERANCE_MS + 
+                            (int32_t) (testdef->packet_cnt - 1 - slave->anchor_id) * interval;
+    if ((int32_t) (last_deadline - millis()) <= 0) {
+      SERIAL_AND_LOG((*log_file), "Slot of last packet from 0x%02X has passed!\n", slave->id);
+      slave->active = false;
+      continue;
     }
-    _rx_buf.len = testdef->packet_len - RH_RF95_HEADER_LEN;
-    bool got_packet = unacknowledged_rx(&_rx_buf, SINGLE_RX_CHECK_TIMEOUT);
-
-    if (got_packet) {
-      // Verify received message is a test packet, contents should be
-      // pre-verified by crc check so only valid packets should reach this stage
-      got_packet &= _rx_buf.p_hdr->type == msg_test_packet;
-      got_packet &= _rx_buf.from == testdef->slave_id;
-      got_packet &= _rx_buf.to == testdef->master_id;
-      got_packet &= (_rx_buf.len + RH_RF95_HEADER_LEN) == testdef->packet_len;
-      
-      if (got_packet) {
-        valid_packets++;
-        int16_t rssi = _rf95.lastRssi();
-        int16_t snr = _rf95.lastSNR();
-        rx_bad_total += rx_bad_since_last_check();
-        Serial.printf("Packet Received | [ID: %d] [RSSI: %ddBm] [SNR: %ddB] " \
-                        "[Packets: %d/%d] [Bad Recvs: %ld] [Time Left: %ld]\n", 
-                        _rx_buf.p_hdr->id, rssi, snr, valid_packets, testdef->packet_cnt, 
-                        rx_bad_total, time_left);
-        // Record to results file
-        storage_write_result(&results_file, _rx_buf.p_hdr->id, rssi, snr, rx_bad_total, time_left);
-        // Got the last packet, may as well stop
-        if (_rx_buf.p_hdr->id == (testdef->packet_cnt - 1)) {
-          break;
-        }
-        // TODO: Could adjust timeout based on received packets
+    // Or once the slots of too many consecutive packets have been empty
+    if (RX_MAX_EMPTY_SLOTS > 0) {
+      int32_t empty_deadline = slave->anchor_time + RX_SLOT_TOLERANCE_MS +
+                               (int32_t) (slave->next_id + RX_MAX_EMPTY_SLOTS - 1 - 
+                                          slave->anchor_id) * interval;
+      if ((int32_t) (empty_deadline - millis()) <= 0) {
+        SERIAL_AND_LOG((*log_file), "No packets from 0x%02X in %d consecutive slots!\n", 
+                       slave->id, RX_MAX_EMPTY_SLOTS);
+        slave->active = false;
+        continue;
       }
     }
+    any_active = true;
+  }
+  if (!any_active) {
+    session->active = false;
+    return false;
+  }
+  // Never block so other radios can be serviced. Test packets are read where the
+  // driver received them rather than copied out
+  RHRxView packet;
+  if (!_rf95_dg.borrowfrom(&packet)) {
+    return true;
+  }
+  radio_msg_t *hdr = (radio_msg_t*) packet.data;
+  radio_rx_slave_t *slave = NULL;
+  for (uint8_t slot=0; slot < session->slot_cnt; slot++) {
+    if (session->slaves[slot].active && session->slaves[slot].id == packet.headerFrom) {
+      slave = &session->slaves[slot];
+    }
+  }
+  // Verify received message is a test packet, contents should be
+  // pre-verified by crc check so only valid packets should reach this stage
+  bool got_packet = (packet.len + RH_RF95_HEADER_LEN) == testdef->packet_len;
+  got_packet &= slave != NULL;
+  got_packet &= packet.headerTo == testdef->master_id;
+  got_packet = got_packet && hdr->type == msg_test_packet;
+  got_packet = got_packet && hdr->id < testdef->packet_cnt;
+  uint16_t id = got_packet ? hdr->id : 0;
+  _rf95_dg.release();
+  if (!got_packet) {
+    return true;
+  }
+  slave->valid_packets++;
+  // Received packet is the new reference for the slave's predicted arrivals, using
+  // when the radio took it rather than when it was handled
+  uint32_t arrival = packet.time - session->start_time_us;
+  slave->anchor_time = session->start_time + arrival / 1000;
+  slave->anchor_id = id;
+  slave->next_id = slave->anchor_id + 1;
+  int16_t rssi = packet.rssi;
+  int16_t snr = packet.snr;
+  session->rx_bad_total += rx_bad_since_last_check();
+  // Only queued, formatting and printing wait until no packet is due
+  storage_defer_log(NULL, "Packet Received | [From: 0x%02X] [ID: %d] [RSSI: %ddBm] [SNR: %ddB] " \
+                    "[Packets: %d/%d] [Bad Recvs: %ld] [Time Left: %ld]\n", 
+                    slave->id, id, rssi, snr, slave->valid_packets, 
+                    testdef->packet_cnt, session->rx_bad_total, session->time_left);
+  // Record to results file
+  storage_write_result(slave->results, id, rssi, snr, 
+                       session->rx_bad_total, session->time_left, arrival);
+  // Got the last packet, may as well stop listening for this slave
+  if (id == (testdef->packet_cnt - 1)) {
+    slave->active = false;
   }
-  rx_bad_total += rx_bad_since_last_check();
-  if (time_left < 0) {
+  return true;
+}
+
+uint32_t LoRaModule::get_recv_idle_time(void) {
+  // Time until the earliest a packet is due from any slave, anything that
+  // completes within this can't delay handling a packet
+  radio_rx_session_t *session = &_rx_session;
+  if (!session->active) {
+    return UINT32_MAX;
+  }
+  uint32_t interval = session->slot_time * session->slot_cnt;
+  int32_t idle_time = INT32_MAX;
+  for (uint8_t slot=0; slot < session->slot_cnt; slot++) {
+    radio_rx_slave_t *slave = &session->slaves[slot];
+    if (!slave->active) {
+      continue;
+    }
+    int32_t due_time = slave->anchor_time - RX_SLOT_TOLERANCE_MS + 
+                       (int32_t) (slave->next_id - slave->anchor_id) * interval;
+    idle_time = min(idle_time, (int32_t) (due_time - millis()));
+  }
+  return max(idle_time, (int32_t) 0);
+}
+
+bool LoRaModule::end_recv_testdef_packets(uint16_t *recv_packets) {
+  radio_rx_session_t *session = &_rx_session;
+  File *log_file = session->log_file;
+  session->active = false;
+  session->rx_bad_total += rx_bad_since_last_check();
+  if (session->time_left <= 0) {
     SERIAL_AND_LOG((*log_file), "Timed out when receiving packets!\n");
   }
-  SERIAL_AND_LOG((*log_file), "Finished receiving [%d/%d] packets!\n", valid_packets, testdef->packet_cnt);
-  SERIAL_AND_LOG((*log_file), "In this time %d failed receive(s) occurred!\n", rx_bad_total);
+  uint16_t valid_packets = 0;
+  for (uint8_t slot=0; slot < session->slot_cnt; slot++) {
+    radio_rx_slave_t *slave = &session->slaves[slot];
+    if (slave->id == PLAN_SLOT_DROPPED) {
+      continue;
+    }
+    SERIAL_AND_LOG((*log_file), "Finished receiving [%d/%d] packets from 0x%02X!\n", 
+                   slave->valid_packets, session->testdef->packet_cnt, slave->id);
+    valid_packets += slave->valid_packets;
+    storage_close_result_file(slave->results);
+  }
+  SERIAL_AND_LOG((*log_file), "In this time %d failed receive(s) occurred!\n", session->rx_bad_total);
+  // Packets that arrived but were never handled are our loss, not the channel's
+  uint16_t ring_dropped = _rf95.rxRingDropped() - session->ring_dropped_start;
+  if (ring_dropped > 0) {
+    SERIAL_AND_LOG((*log_file), "%d packet(s) lost to a full receive ring!\n", ring_dropped);
+  }
+  storage_flush_log();
+  LOG_INFO("Worst results write so far took %ldus\n", storage_get_max_write_latency());
 
   if (recv_packets != NULL) {
     *recv_packets = valid_packets;
   }
-  results_file.close();
-  return results_valid;
+  return session->valid;
 }
 
 bool LoRaModule::send_heartbeat(void) {
@@ -433,35 +1191,80 @@ void LoRaModule::ack_heartbeat(uint8_t master_id) {
   _tx_buf.to = master_id;
   _tx_buf.len = LEN_MSG_EMPTY;
   _tx_buf.p_hdr->type = msg_ack;
-  unacknowledged_tx(&_tx_buf);
+  // Nothing follows that depends on it being sent, anything that next needs
+  // the radio waits for it first
+  if (!queue_tx(&_tx_buf)) {
+    LOG_ERROR("TX queued unsucessfully!\n");
+  }
 }
 
 uint32_t LoRaModule::calculate_packet_airtime(lora_cfg_t *cfg, uint16_t packet_len) {
-    // All equations used from (modified slightly for our formats):
-    // https://www.semtech.com/uploads/documents/LoraDesignGuide_STD.pdf
-
-    float symbol_time = 1000.0 * pow(2, cfg->sf) / cfg->bw;	// ms
-    float preamble_time = (cfg->preamble_syms + 4.25) * symbol_time;
-    bool ldr = is_low_datarate_required(cfg);
-    // N.B Explicit header is always enabled by RadioHead so -20 always present
-    uint16_t psc_top = 8 * packet_len - 4 * cfg->sf + 28 + 16 - 20;
-    uint16_t psc_bot = 4 * (cfg->sf - 2 * ldr);
-    uint16_t psc_lhs = (int) ceil(psc_top / psc_bot);
-    uint16_t payload_symbol_count = 8 + (max(psc_lhs * (cfg->cr4_denom), 0));
-    float payload_time = payload_symbol_count * symbol_time;
-    float total_time = preamble_time + payload_time;
-    return total_time;
+    return testdef_packet_airtime(cfg, packet_len);
+}
+
+uint32_t LoRaModule::calculate_packet_slot(lora_cfg_t *cfg, uint16_t packet_len) {
+    return testdef_packet_slot(cfg, packet_len);
+}
+
+uint32_t LoRaModule::calculate_testdef_duration(lora_testdef_t *testdef, uint8_t slot_cnt) {
+    uint32_t slot_time = calculate_packet_slot(&testdef->cfg, testdef->packet_len);
+    return calculate_testdef_duration(slot_time, testdef->packet_cnt, slot_cnt);
+}
+
+uint32_t LoRaModule::calculate_testdef_duration(uint32_t slot_time, uint16_t packet_cnt, 
+                                                uint8_t slot_cnt) {
+    return testdef_duration(slot_time, packet_cnt, slot_cnt);
+}
+
+uint32_t LoRaModule::calculate_plan_enrol_window(lora_cfg_t *cfg) {
+    // Every slave's acknowledged RDY! in turn after the longest backoff, with
+    // time for one to be repeated after colliding with another
+    uint32_t ack_airtime = calculate_packet_airtime(cfg, RH_RF95_HEADER_LEN + 1);
+    uint32_t rdy_duration = calculate_packet_airtime(cfg, RH_RF95_HEADER_LEN + LEN_MSG_RDY) + ack_airtime;
+    return PLAN_RDY_BACKOFF_MAX + rdy_duration * (MAX_PLAN_SLAVES + 1) + 2 * ACK_TIMEOUT;
+}
+
+uint32_t LoRaModule::calculate_plan_transfer_duration(lora_cfg_t *cfg, uint8_t slave_cnt) {
+    // QRY? and the full enrolment window, every slave's acknowledged RDY! is within it,
+    // followed by the announcement to each slave
+    uint32_t duration = calculate_packet_airtime(cfg, RH_RF95_HEADER_LEN + LEN_MSG_EMPTY) + 
+                        calculate_plan_enrol_window(cfg);
+    return duration + calculate_plan_frag_duration(cfg, 0) * slave_cnt;
+}
+
+uint32_t LoRaModule::calculate_plan_block_transfer_duration(lora_cfg_t *cfg, uint16_t testdef_cnt,
+                                                            uint8_t slave_cnt) {
+    // Each acknowledged fragment, assuming all but the last are full
+    uint16_t full_frags = testdef_cnt / PLAN_TESTDEFS_PER_FRAG;
+    uint16_t last_frag_cnt = testdef_cnt % PLAN_TESTDEFS_PER_FRAG;
+    uint32_t frags_duration = full_frags * calculate_plan_frag_duration(cfg, PLAN_TESTDEFS_PER_FRAG);
+    if (last_frag_cnt > 0) {
+      frags_duration += calculate_plan_frag_duration(cfg, last_frag_cnt);
+    }
+    return frags_duration * slave_cnt;
+}
+
+uint32_t LoRaModule::calculate_plan_frag_duration(lora_cfg_t *cfg, uint8_t cnt) {
+    uint32_t ack_airtime = calculate_packet_airtime(cfg, RH_RF95_HEADER_LEN + 1);
+    return calculate_packet_airtime(cfg, RH_RF95_HEADER_LEN + LEN_MSG_PLAN_FRAG(cnt)) + ack_airtime;
+}
+
+uint32_t LoRaModule::calculate_plan_sync_duration(lora_cfg_t *cfg) {
+    // Time from sending a sync to the block starting, allowing for every attempt
+    uint32_t sync_airtime = calculate_packet_airtime(cfg, RH_RF95_HEADER_LEN + LEN_MSG_PLAN_SYNC);
+    return (sync_airtime + ACK_TIMEOUT) * PLAN_SYNC_ATTEMPTS + PLAN_SYNC_SETUP_TIME;
 }
 
 bool LoRaModule::is_low_datarate_required(lora_cfg_t *cfg) {
-    float symbol_time = 1000.0 * pow(2, cfg->sf) / cfg->bw;	// ms
-    // Value of 16.0 for symbol time required for enabling low data rate is copied from
-    // RadioHead library. No source provided but keep the same for consistency.
-    return symbol_time > 16.0;    
+    return testdef_low_datarate_required(cfg);
 }
 
 void LoRaModule::set_interrupt(bool value) {
   _interrupt = value;
+  // Anything waiting on the radio gives up straight away
+  if (value) {
+    event_signal(EVENT_RADIO);
+  }
 }
 
 bool LoRaModule::check_interrupt(bool clear) {
@@ -473,27 +1276,27 @@ bool LoRaModule::check_interrupt(bool clear) {
 }
 
 void LoRaModule::dbg_print_cur_cfg(void) {
-  Serial.printf("Current Radio Configuration:\n");
+  LOG_DEBUG("Current Radio Configuration:\n");
   dbg_print_cfg(&_cur_cfg, false);
 }
 
 void LoRaModule::dbg_print_cfg(lora_cfg_t *cfg, bool title) {
   if (title) {
-    Serial.printf("Radio Configuration:\n");
+    LOG_DEBUG("Radio Configuration:\n");
   }
-  Serial.printf("* Frequency (MHz): %.03f\n", cfg->freq);
-  Serial.printf("* Spreading Factor: %d\n", cfg->sf);
-  Serial.printf("* Power (dBm): %d\n", cfg->tx_dbm);
-  Serial.printf("* Bandwidth (Hz): %d\n", cfg->bw);
-  Serial.printf("* Coding rate: 4 / %d \n", cfg->cr4_denom);
-  Serial.printf("* Preamble Symbols: %d \n", cfg->preamble_syms);
-  Serial.printf("* CRC Enable: %d\n", cfg->crc);
+  LOG_DEBUG("* Frequency (MHz): %.03f\n", cfg->freq);
+  LOG_DEBUG("* Spreading Factor: %d\n", cfg->sf);
+  LOG_DEBUG("* Power (dBm): %d\n", cfg->tx_dbm);
+  LOG_DEBUG("* Bandwidth (Hz): %d\n", cfg->bw);
+  LOG_DEBUG("* Coding rate: 4 / %d \n", cfg->cr4_denom);
+  LOG_DEBUG("* Preamble Symbols: %d \n", cfg->preamble_syms);
+  LOG_DEBUG("* CRC Enable: %d\n", cfg->crc);
 }
 
 void LoRaModule::dbg_print_testdef(lora_testdef_t *testdef) {
-  Serial.printf("Test Definition: %s\n", testdef->id);
-  Serial.printf("* Expected Range: %d\n", testdef->exp_range);
-  Serial.printf("* Packet Length: %d\n", testdef->packet_len);
-  Serial.printf("* Packet Count: %d\n", testdef->packet_cnt);
+  LOG_INFO("Test Definition: %s\n", testdef->id);
+  LOG_INFO("* Expected Range: %d\n", testdef->exp_range);
+  LOG_INFO("* Packet Length: %d\n", testdef->packet_len);
+  LOG_INFO("* Packet Count: %d\n", testdef->packet_cnt);
   dbg_print_cfg(&testdef->cfg, false);
 }
@@ -1,33 +1,45 @@
 #include <TimeLib.h>
 
 #include "storage.h"
+#include "telemetry.h"
 
-static void extract_testdef_name(File* file, char *testdef_id);
+static bool load_testdef_sweep(File* file, testdef_sweep_t *sweep);
+static int read_testdef_file(void *src, char *buf, uint16_t len);
+static uint16_t load_plan_file_keys(File *file, plan_key_t keys[], uint16_t arr_len, uint8_t *ordered_for);
+static uint16_t remove_duplicate_ids(plan_key_t keys[], uint16_t n);
+static bool buffer_result_bytes(storage_result_writer_t *writer, const char *data, uint16_t len);
+static bool write_result_block(storage_result_writer_t *writer);
+static bool timed_result_write(storage_result_writer_t *writer, uint16_t len);
+static void drain_result_writer(storage_result_writer_t *writer);
+static void update_run_container_len(void);
+static bool write_log_entry(void);
 static void get_fat_date_time(uint16_t *date, uint16_t* time);
 
 #define MAX_TESTDEF_FILELEN (48)
-static const char *TESTDEF_FIELDS[] = {"exp_range", "packet_cnt", "packet_len", "freq", "sf", "tx_dbm",
-                                       "bw", "cr4_denom", "preamble_syms", "crc"};
-#define TESTDEF_FIELD_COUNT (uint8_t) (sizeof(TESTDEF_FIELDS) / sizeof(TESTDEF_FIELDS[1]))
-
-static const char *RECV_PACKETS_FIELDS[] = {"id", "rssi", "snr", "failed_recv", "time_left"};            
+static const char *RECV_PACKETS_FIELDS[] = {"id", "rssi", "snr", "failed_recv", "time_left", "arrival_us"};            
 #define RECV_PACKETS_FIELD_COUNT (uint8_t) (sizeof(RECV_PACKETS_FIELDS) / sizeof(RECV_PACKETS_FIELDS[1]))   
 
 SdFatSdio SD;
 static bool _initialised;
+static storage_result_writer_t _result_writers[MAX_RESULT_WRITERS];
+// Worst time taken by a single results write, us
+static uint32_t _max_write_latency;
+// Messages waiting for idle time, the producer only moves the head and the
+// consumer only the tail so neither needs a lock
+static storage_log_entry_t _log_ring[LOG_RING_LEN];
+static volatile uint16_t _log_head;
+static volatile uint16_t _log_tail;
+static uint16_t _log_dropped;
+// Worst time taken to format and write a single log message, us
+static uint32_t _max_log_latency;
+// Plan keys refer to records of a compiled plan rather than testdef files
+static bool _plan_from_file;
+// Ring shared by every stream of the run container
+static storage_result_writer_t _run_container;
+static run_container_header_t _run_container_header;
 
-typedef enum testdef_field_t {
-  FIELD_EXP_RANGE = 0,
-  FIELD_PACKET_CNT,
-  FIELD_PACKET_LEN, 
-  FIELD_FREQ, 
-  FIELD_SF, 
-  FIELD_TX_DBM, 
-  FIELD_BW,
-  FIELD_CR4_DENOM,
-  FIELD_PREAMBLE_SYMS,
-  FIELD_CRC,
-} testdef_field_t;
+static_assert(RUN_CONTAINER_ID_LEN == TESTDEF_ID_LEN, "Run container ID length must match testdefs");
+static_assert(MAX_RESULT_WRITERS <= RUN_CONTAINER_MAX_STREAMS, "Too many result writers for run container");
 
 bool storage_init(void) {
   if (_initialised) {
@@ -47,27 +59,27 @@ bool storage_master_defaults(void) {
   }
   // Create any directories that are expected to exist
   if (!SD.exists(TESTDEF_DIR)) {
-    Serial.printf("Making testdef directory...\n");
+    LOG_INFO("Making testdef directory...\n");
     bool made_dir = SD.mkdir(TESTDEF_DIR);
-    Serial.printf("Creation of directory '%s' %s!\n", TESTDEF_DIR, made_dir ? "successful" : "failed");
+    LOG_INFO("Creation of directory '%s' %s!\n", TESTDEF_DIR, made_dir ? "successful" : "failed");
   }
   if (!SD.exists(RESULTS_DIR)) {
-    Serial.printf("Making results directory...\n");
+    LOG_INFO("Making results directory...\n");
     bool made_dir = SD.mkdir(RESULTS_DIR);
-    Serial.printf("Creation of directory '%s' %s!\n", RESULTS_DIR, made_dir ? "successful" : "failed");
+    LOG_INFO("Creation of directory '%s' %s!\n", RESULTS_DIR, made_dir ? "successful" : "failed");
   }
   // Create helper files for format explanations
   if (!SD.exists(TESTDEF_FORMAT_FILE)) {
-    Serial.printf("Making example format file...\n");
+    LOG_INFO("Making example format file...\n");
     File file = SD.open(TESTDEF_FORMAT_FILE, FILE_WRITE);
 
-    for (uint8_t field=0; field < TESTDEF_FIELD_COUNT; field++) {
-      file.write(TESTDEF_FIELDS[field]);
+    for (uint8_t field=0; field < TESTDEF_FIELD_CNT; field++) {
+      file.write(testdef_field_name(field));
       // TODO: Currently actually need a comma on the end, aim to remove this at some point
       file.write(",");
     }
     file.close();
-    Serial.printf("Creation of example testdef format successful!\n");
+    LOG_INFO("Creation of example testdef format successful!\n");
   }
   return true;
 }
@@ -80,127 +92,566 @@ bool storage_slave_defaults(void) {
 }
 
 bool storage_load_testdef(File* file, lora_testdef_t *testdef) {
-  // Get filename as test id
-  extract_testdef_name(file, testdef->id); 
-  // Extract each field as if csv format with an extra ',' on the end
-  for (uint8_t field=0; field < TESTDEF_FIELD_COUNT; field++) {
-    String str = file->readStringUntil(',');
-    switch (field) {
-      case FIELD_EXP_RANGE:
-        testdef->exp_range = str.toInt();
-        break;
-      case FIELD_PACKET_CNT:
-        testdef->packet_cnt = str.toInt();
-        break;
-      case FIELD_PACKET_LEN:
-        testdef->packet_len = str.toInt();
-        break;
-      case FIELD_FREQ: 
-        testdef->cfg.freq = str.toFloat();
-        break;
-      case FIELD_SF:
-        testdef->cfg.sf = str.toInt();
-        break;
-      case FIELD_TX_DBM:
-        testdef->cfg.tx_dbm = str.toInt();
-        break;
-      case FIELD_BW:
-        testdef->cfg.bw = str.toInt();
-        break;
-      case FIELD_CR4_DENOM:
-        testdef->cfg.cr4_denom = str.toInt();
-        break;
-      case FIELD_PREAMBLE_SYMS:
-        testdef->cfg.preamble_syms = str.toInt();
-        break;
-      case FIELD_CRC:
-        testdef->cfg.crc = str.toInt() ? true : false;
-        break;
-      default:
-        return false;
-    }
-  }
-  // TODO: Should probably do some form of validation
+  testdef_sweep_t sweep;
+  if (!load_testdef_sweep(file, &sweep)) {
+    return false;
+  }
+  testdef_get_variant(&sweep, 0, testdef);
   return true;
 }
 
 bool storage_load_testdef(char* path, lora_testdef_t *testdef) {
   File file = SD.open(path, O_READ);
-  storage_load_testdef(&file, testdef);
+  bool loaded = storage_load_testdef(&file, testdef);
   file.close();
-  return true;
+  return loaded;
 }
 
-uint8_t storage_load_testdefs(lora_testdef_t testdefs[], uint8_t arr_len) {
+uint16_t storage_load_plan_keys(plan_key_t keys[], uint16_t arr_len, uint8_t *ordered_for) {
+  // A compiled plan replaces every testdef file
+  *ordered_for = 0;
+  File plan_file = SD.open(TESTDEF_DIR PLAN_FILE, O_RDONLY);
+  _plan_from_file = plan_file;
+  if (_plan_from_file) {
+    uint16_t n = load_plan_file_keys(&plan_file, keys, arr_len, ordered_for);
+    plan_file.close();
+    return n;
+  }
   File dir = SD.open(TESTDEF_DIR, O_RDONLY);
   File file;
-  uint8_t n = 0;
+  uint16_t n = 0;
   while (n < arr_len && file.openNext(&dir, O_RDONLY)) {
     char buf[MAX_TESTDEF_FILELEN];
     file.getName(buf, MAX_TESTDEF_FILELEN);
     if (!file.isSubDir() && !file.isHidden()) {
-      Serial.printf("* Found: %s", buf);
+      LOG_INFO("* Found: %s", buf);
       if (buf[0] == '_') {
-        Serial.printf(" [Ignored]\n");
+        LOG_INFO(" [Ignored]\n");
       } else {   
-        bool loaded = storage_load_testdef(&file, &testdefs[n]);
-        if (loaded) {
+        testdef_sweep_t sweep;
+        bool loaded = load_testdef_sweep(&file, &sweep);
+        if (loaded && sweep.variant_cnt > 1) {
+          LOG_INFO(" [%d variants]", sweep.variant_cnt);
+        }
+        LOG_INFO("%s\n", loaded ? "" : "[FAILED]");
+        // Only the key of each variant is kept, it is rebuilt when scheduled
+        for (uint16_t variant=0; loaded && variant < sweep.variant_cnt && n < arr_len; variant++) {
+          lora_testdef_t testdef;
+          testdef_get_variant(&sweep, variant, &testdef);
+          if (!testdef_is_valid(&testdef)) {
+            LOG_ERROR("[FAILED] %s\n", testdef.id);
+            continue;
+          }
+          plan_make_key(&testdef, file.dirIndex(), variant, &keys[n]);
           n++;
         }
-        Serial.printf("%s\n", loaded ? "" : "[FAILED]");
+        if (n == arr_len) {
+          LOG_INFO("Plan is full, ignoring any further testdefs!\n");
+        }
       }
     }
     file.close();
   }
-  Serial.printf("%d testdefs loaded!\n", n);
+  dir.close();
+  // A compiled plan had its ids checked by the plan compiler
+  n = remove_duplicate_ids(keys, n);
+  LOG_INFO("%d testdefs loaded!\n", n);
   return n;
 }
 
-File storage_init_result_file(char* filename) {
-    char buf[TESTDEF_ID_LEN + 5];
-    sprintf(buf, "%s.csv", filename);
-    Serial.printf("Making results file...\n");
-    File file = SD.open(buf, FILE_WRITE);
+bool storage_load_plan_testdef(plan_key_t *key, lora_testdef_t *testdef) {
+  if (_plan_from_file) {
+    // Keys of a compiled plan hold the index of their record
+    File plan_file = SD.open(TESTDEF_DIR PLAN_FILE, O_RDONLY);
+    plan_file_testdef_t rec;
+    bool loaded = plan_file.seek(sizeof(plan_file_header_t) + key->dir_index * sizeof(rec)) &&
+                  plan_file.read(&rec, sizeof(rec)) == sizeof(rec);
+    if (loaded) {
+      plan_file_unpack_testdef(&rec, testdef);
+    }
+    plan_file.close();
+    return loaded;
+  }
+  File dir = SD.open(TESTDEF_DIR, O_RDONLY);
+  File file;
+  testdef_sweep_t sweep;
+  bool loaded = file.open(&dir, key->dir_index, O_RDONLY) && load_testdef_sweep(&file, &sweep) &&
+                key->variant < sweep.variant_cnt;
+  if (loaded) {
+    testdef_get_variant(&sweep, key->variant, testdef);
+  }
+  file.close();
+  dir.close();
+  return loaded;
+}
+
+storage_result_writer_t* storage_init_result_file(char* filename, uint8_t slave_id) {
+    uint8_t idx = 0;
+    while (idx < MAX_RESULT_WRITERS && _result_writers[idx].open) {
+      idx++;
+    }
+    if (idx == MAX_RESULT_WRITERS) {
+      LOG_ERROR("No free results writer!\n");
+      return NULL;
+    }
+    storage_result_writer_t *writer = &_result_writers[idx];
+    if (_run_container.open) {
+      // A repeated stream replaces any earlier results of the testdef
+      uint8_t buf[RC_MAX_BEGIN_LEN];
+      writer->contained = true;
+      writer->stream_idx = idx;
+      rc_reset_stream(&writer->stream);
+      writer->open = true;
+      uint8_t len = rc_encode_begin(writer->stream_idx, slave_id, filename, buf);
+      buffer_result_bytes(&_run_container, (char*) buf, len);
+      LOG_INFO("Initialised test results stream!\n");
+      return writer;
+    }
+    char buf[TESTDEF_ID_LEN + 8];
+    if (slave_id != 0) {
+      // Sessions with several slaves keep each slave's results separate
+      sprintf(buf, "%s_%02X.csv", filename, slave_id);
+    } else {
+      sprintf(buf, "%s.csv", filename);
+    }
+    LOG_INFO("Making results file...\n");
+    // Replace the results of a testdef that was interrupted before a resume
+    writer->file = SD.open(buf, O_RDWR | O_CREAT | O_TRUNC);
+    writer->buffered = 0;
+    writer->written = 0;
+    writer->contained = false;
+    writer->open = true;
+    // Header is buffered like any result so blocks stay aligned to the file
     for (uint8_t field=0; field < RECV_PACKETS_FIELD_COUNT; field++) {
-      file.write(RECV_PACKETS_FIELDS[field]);
+      buffer_result_bytes(writer, RECV_PACKETS_FIELDS[field], strlen(RECV_PACKETS_FIELDS[field]));
       if ((field + 1) < RECV_PACKETS_FIELD_COUNT) {
-        file.write(",");
+        buffer_result_bytes(writer, ",", 1);
       }
     }
-    Serial.printf("Initialised test results file!\n");
-    return file;
+    LOG_INFO("Initialised test results file!\n");
+    return writer;
+}
+
+bool storage_write_result(storage_result_writer_t *writer, uint16_t id, int16_t rssi, int16_t snr, 
+                                        uint32_t failed_recv, int32_t time_left, uint32_t arrival) {
+  if (writer == NULL) {
+    return false;
+  }
+  if (writer->contained) {
+    uint8_t buf[RC_MAX_RESULT_LEN];
+    uint8_t len = rc_encode_result(&writer->stream, writer->stream_idx, id, rssi, snr, 
+                                   failed_recv, time_left, arrival, buf);
+    return buffer_result_bytes(&_run_container, (char*) buf, len);
+  }
+  char wr_buf[64];
+  uint8_t len = sprintf(wr_buf, "\n%d,%d,%d,%ld,%ld,%lu", id, rssi, snr, failed_recv, time_left, arrival);
+  return buffer_result_bytes(writer, wr_buf, len);
+}
+
+void storage_close_result_file(storage_result_writer_t *writer) {
+  if (writer == NULL) {
+    return;
+  }
+  writer->open = false;
+  if (writer->contained) {
+    // Its records are left in the ring for the idle time, the stream is only
+    // made durable when the journal records its testdef as done
+    return;
+  }
+  drain_result_writer(writer);
+  writer->file.close();
+}
+
+void storage_flush_results(uint32_t idle_time) {
+  uint32_t start_time = micros();
+  uint32_t budget = idle_time > (UINT32_MAX / 1000) ? UINT32_MAX : idle_time * 1000;
+  for (uint8_t i=0; i <= MAX_RESULT_WRITERS; i++) {
+    storage_result_writer_t *writer = i < MAX_RESULT_WRITERS ? &_result_writers[i] : &_run_container;
+    if (!writer->open || writer->contained) {
+      continue;
+    }
+    // Only start a write if the worst seen so far would still finish in time
+    while ((micros() - start_time) + max(_max_write_latency, (uint32_t) SD_WRITE_LATENCY_ESTIMATE_US) < 
+           budget && write_result_block(writer)) {}
+  }
+  // Log messages only get what time is left once results are safe, writing
+  // one can still land a whole block on the card
+  while ((micros() - start_time) + max(_max_log_latency, (uint32_t) SD_WRITE_LATENCY_ESTIMATE_US) <
+         budget && write_log_entry()) {}
+}
+
+uint32_t storage_get_max_write_latency(void) {
+  return _max_write_latency;
+}
+
+bool storage_init_run_container(plan_key_t keys[], uint16_t cnt, uint32_t exp_results) {
+  if (_run_container.open) {
+    return false;
+  }
+  run_container_header_t *header = &_run_container_header;
+  _run_container.file = SD.open(RUN_CONTAINER_FILE, O_RDWR | O_CREAT);
+  if (!_run_container.file) {
+    LOG_ERROR("Failed to open run container!\n");
+    return false;
+  }
+  _run_container.contained = false;
+  _run_container.open = true;
+  // Carry on from the last results known to be on the card when resuming
+  if (_run_container.file.read(header, sizeof(*header)) == sizeof(*header) && 
+      header->magic == RUN_CONTAINER_MAGIC && header->version == RUN_CONTAINER_VERSION) {
+    _run_container.buffered = header->data_offset + header->data_len;
+    _run_container.written = _run_container.buffered;
+    _run_container.file.seekSet(_run_container.written);
+    // Keep the ring aligned to the file by reloading the partial block
+    uint16_t partial = _run_container.written % SD_BLOCK_LEN;
+    if (partial > 0) {
+      _run_container.written -= partial;
+      _run_container.file.seekSet(_run_container.written);
+      _run_container.file.read(&_run_container.buf[_run_container.written % RESULT_BUFFER_LEN], partial);
+      _run_container.file.seekSet(_run_container.written);
+    }
+    LOG_INFO("Resuming run container, %ld bytes of results\n", header->data_len);
+    return true;
+  }
+  
+  header->magic = RUN_CONTAINER_MAGIC;
+  header->version = RUN_CONTAINER_VERSION;
+  header->testdef_cnt = cnt;
+  header->table_offset = sizeof(*header);
+  header->data_offset = header->table_offset + cnt * sizeof(run_container_testdef_t);
+  header->data_len = 0;
+  header->year = year();
+  header->month = month();
+  header->day = day();
+  header->hour = hour();
+  header->minute = minute();
+  header->second = second();
+  _run_container.file.truncate(0);
+  // Contiguous clusters avoid FAT updates between blocks while results arrive
+  uint32_t exp_len = header->data_offset + exp_results * RC_MAX_RESULT_LEN;
+  if (!_run_container.file.preAllocate(exp_len)) {
+    LOG_ERROR("Failed to preallocate run container of %ld bytes\n", exp_len);
+  }
+  _run_container.buffered = 0;
+  _run_container.written = 0;
+  buffer_result_bytes(&_run_container, (char*) header, sizeof(*header));
+  for (uint16_t i=0; i < cnt; i++) {
+    lora_testdef_t testdef;
+    run_container_testdef_t entry;
+    // An entry is still written for a testdef that can't be reloaded to keep the table whole
+    memset(&testdef, 0, sizeof(testdef));
+    storage_load_plan_testdef(&keys[i], &testdef);
+    memcpy(entry.id, testdef.id, RUN_CONTAINER_ID_LEN);
+    entry.exp_range = testdef.exp_range;
+    entry.packet_cnt = testdef.packet_cnt;
+    entry.packet_len = testdef.packet_len;
+    entry.freq = testdef.cfg.freq;
+    entry.sf = testdef.cfg.sf;
+    entry.tx_dbm = testdef.cfg.tx_dbm;
+    entry.bw = testdef.cfg.bw;
+    entry.cr4_denom = testdef.cfg.cr4_denom;
+    entry.preamble_syms = testdef.cfg.preamble_syms;
+    entry.crc = testdef.cfg.crc;
+    buffer_result_bytes(&_run_container, (char*) &entry, sizeof(entry));
+  }
+  LOG_INFO("Initialised run container!\n");
+  return true;
 }
 
-bool storage_write_result(File *file, uint16_t id, int16_t rssi, int16_t snr, 
-                                        uint32_t failed_recv, int32_t time_left) {
-  char wr_buf[30];
-  sprintf(wr_buf, "\n%d,%d,%d,%ld,%ld", id, rssi, snr, failed_recv, time_left);
-  return file->write(wr_buf) ? true : false;
+void storage_close_run_container(void) {
+  if (!_run_container.open) {
+    return;
+  }
+  update_run_container_len();
+  // Give back whatever was preallocated but not used
+  _run_container.file.truncate(_run_container.written);
+  _run_container.file.close();
+  _run_container.open = false;
+  LOG_INFO("Closed run container, %ld bytes of results\n", _run_container_header.data_len);
 }
 
 File storage_init_test_log(void) {
-    Serial.printf("Making test log file...\n");
+    LOG_INFO("Making test log file...\n");
     File file = SD.open(LOG_FILE, FILE_WRITE);
       file.write("Test log created!\n");
-    Serial.printf("Initialised test log file!\n");
+    LOG_INFO("Initialised test log file!\n");
+    return file;
+}
+
+bool storage_find_resumable_results(char* path) {
+  // Results directories are named by datetime so the last by name is the latest
+  File dir = SD.open(RESULTS_DIR, O_RDONLY);
+  File entry;
+  char latest[MAX_TESTDEF_FILELEN] = "";
+  while (entry.openNext(&dir, O_RDONLY)) {
+    char buf[MAX_TESTDEF_FILELEN];
+    entry.getName(buf, MAX_TESTDEF_FILELEN);
+    if (entry.isSubDir() && strcmp(buf, latest) > 0) {
+      strcpy(latest, buf);
+    }
+    entry.close();
+  }
+  dir.close();
+  if (latest[0] == '\0') {
+    return false;
+  }
+  // Only a plan that started but never finished has anything to resume
+  snprintf(path, MAX_RESULTS_PATH_LEN, "%s%s/", RESULTS_DIR, latest);
+  char journal_path[MAX_RESULTS_PATH_LEN + sizeof(JOURNAL_FILE)];
+  sprintf(journal_path, "%s%s", path, JOURNAL_FILE);
+  if (!SD.exists(journal_path)) {
+    return false;
+  }
+  File journal = SD.open(journal_path, O_RDONLY);
+  bool finished = false;
+  char testdef_id[TESTDEF_ID_LEN + 1];
+  uint8_t exp_range;
+  uint16_t recv_packets;
+  while (storage_read_journal_entry(&journal, testdef_id, &exp_range, &recv_packets)) {
+    finished = strcmp(testdef_id, JOURNAL_END_MARKER) == 0;
+  }
+  journal.close();
+  return !finished;
+}
+
+File storage_init_journal(void) {
+    LOG_INFO("Opening plan journal...\n");
+    File file = SD.open(JOURNAL_FILE, FILE_WRITE);
+    file.sync();
     return file;
 }
 
+bool storage_write_journal_entry(File *file, lora_testdef_t *testdef, uint16_t recv_packets) {
+  // The run container must hold the testdef's results before it is marked done,
+  // no radio is receiving by the time a checkpoint is written
+  if (_run_container.open) {
+    update_run_container_len();
+  }
+  char wr_buf[TESTDEF_ID_LEN + 12];
+  sprintf(wr_buf, "%.*s,%d,%d\n", TESTDEF_ID_LEN, testdef->id, testdef->exp_range, recv_packets);
+  bool written = file->write(wr_buf) ? true : false;
+  // Entries must survive a power loss straight after the testdef
+  return file->sync() && written;
+}
+
+bool storage_read_journal_entry(File *file, char *testdef_id, uint8_t *exp_range, 
+                                uint16_t *recv_packets) {
+  // Read a line into a fixed buffer, anything beyond it can't be a valid entry
+  char line[JOURNAL_LINE_LEN];
+  uint8_t len = 0;
+  int c;
+  while ((c = file->read()) >= 0 && c != '\n') {
+    if (len < JOURNAL_LINE_LEN - 1) {
+      line[len++] = c;
+    }
+  }
+  if (len == 0) {
+    return false;
+  }
+  line[len] = '\0';
+  // Entry is csv of the testdef id, expected range and packets received
+  char *range = strchr(line, ',');
+  char *packets = range != NULL ? strchr(range + 1, ',') : NULL;
+  if (range != NULL) {
+    *range = '\0';
+  }
+  strncpy(testdef_id, line, TESTDEF_ID_LEN);
+  testdef_id[TESTDEF_ID_LEN] = '\0';
+  *exp_range = packets != NULL ? strtoul(range + 1, NULL, 10) : 0;
+  *recv_packets = packets != NULL ? strtoul(packets + 1, NULL, 10) : 0;
+  return true;
+}
+
+bool storage_finish_journal(File *file) {
+  file->write(JOURNAL_END_MARKER "\n");
+  return file->sync();
+}
+
+storage_log_entry_t* storage_claim_log_entry(File *file, const char *format) {
+  if ((uint16_t) (_log_head - _log_tail) >= LOG_RING_LEN) {
+    _log_dropped++;
+    return NULL;
+  }
+  storage_log_entry_t *entry = &_log_ring[_log_head % LOG_RING_LEN];
+  entry->file = file;
+  entry->format = format;
+  entry->arg_cnt = 0;
+  entry->str_mask = 0;
+  entry->strs_len = 0;
+  return entry;
+}
+
+void storage_commit_log_entry(void) {
+  _log_head++;
+}
+
+void storage_flush_log(void) {
+  while (write_log_entry()) {}
+}
+
 bool is_storage_initialised(void) {
   return _initialised;
 }
 
-static void extract_testdef_name(File* file, char *testdef_id) {
-  char rd_buf[MAX_TESTDEF_FILELEN];
-  file->getName(rd_buf, MAX_TESTDEF_FILELEN);
-  // Get substring of filename to not include extension and not exceed max id length
-  for (uint8_t i=0; i < MAX_TESTDEF_FILELEN; i++) {
-    if (rd_buf[i] == '.' || rd_buf[i] == '\0' || i == TESTDEF_ID_LEN) {
-      testdef_id[i] = '\0';
+static bool load_testdef_sweep(File* file, testdef_sweep_t *sweep) {
+  char filename[MAX_TESTDEF_FILELEN];
+  file->getName(filename, MAX_TESTDEF_FILELEN);
+  return testdef_load_sweep(read_testdef_file, file, filename, sweep);
+}
+
+static int read_testdef_file(void *src, char *buf, uint16_t len) {
+  return ((File*) src)->read(buf, len);
+}
+
+static uint16_t load_plan_file_keys(File *file, plan_key_t keys[], uint16_t arr_len, uint8_t *ordered_for) {
+  plan_file_header_t header;
+  if (file->read(&header, sizeof(header)) != sizeof(header) || header.magic != PLAN_FILE_MAGIC ||
+      header.version != PLAN_FILE_VERSION) {
+    LOG_ERROR("* Found: %s [FAILED] (not a supported plan)\n", PLAN_FILE);
+    return 0;
+  }
+  LOG_INFO("* Found: %s [%d testdefs]\n", PLAN_FILE, header.testdef_cnt);
+  // Records are read straight through, they were validated when compiled but a
+  // damaged card shouldn't be able to put an illegal configuration on air
+  uint16_t n = 0;
+  for (uint16_t i=0; i < header.testdef_cnt && n < arr_len; i++) {
+    plan_file_testdef_t rec;
+    if (file->read(&rec, sizeof(rec)) != sizeof(rec)) {
+      LOG_ERROR("Plan is truncated after %d testdefs!\n", i);
       break;
     }
-    testdef_id[i] = rd_buf[i];
+    lora_testdef_t testdef;
+    plan_file_unpack_testdef(&rec, &testdef);
+    if (!testdef_is_valid(&testdef)) {
+      LOG_ERROR("[FAILED] %s\n", testdef.id);
+      continue;
+    }
+    plan_make_key(&testdef, i, 0, &keys[n]);
+    n++;
+  }
+  if (n == arr_len && n < header.testdef_cnt) {
+    LOG_INFO("Plan is full, ignoring any further testdefs!\n");
+  }
+  // Dropping a testdef leaves the rest in order
+  *ordered_for = header.parallel;
+  LOG_INFO("%d testdefs loaded!\n", n);
+  return n;
+}
+
+static uint16_t remove_duplicate_ids(plan_key_t keys[], uint16_t n) {
+  // Results and the journal are keyed on the id, so a repeat would overwrite
+  // another testdef's results or be skipped as already done. Ids are only
+  // reloaded to compare in full when their hashes match
+  uint16_t kept = 0;
+  for (uint16_t i=0; i < n; i++) {
+    bool duplicate = false;
+    for (uint16_t j=0; j < kept && !duplicate; j++) {
+      if (keys[j].id_hash != keys[i].id_hash) {
+        continue;
+      }
+      lora_testdef_t first;
+      lora_testdef_t repeat;
+      duplicate = storage_load_plan_testdef(&keys[j], &first) && 
+                  storage_load_plan_testdef(&keys[i], &repeat) &&
+                  strncmp(first.id, repeat.id, TESTDEF_ID_LEN) == 0;
+      if (duplicate) {
+        LOG_ERROR("Testdef id '%.*s' is used more than once, ignoring the repeat!\n", 
+                  TESTDEF_ID_LEN, repeat.id);
+      }
+    }
+    if (!duplicate) {
+      keys[kept++] = keys[i];
+    }
+  }
+  return kept;
+}
+
+static bool buffer_result_bytes(storage_result_writer_t *writer, const char *data, uint16_t len) {
+  for (uint16_t i=0; i < len; i++) {
+    // Only stall on the card if results arrive faster than the gaps allow
+    if ((writer->buffered - writer->written) == RESULT_BUFFER_LEN && !write_result_block(writer)) {
+      return false;
+    }
+    writer->buf[writer->buffered % RESULT_BUFFER_LEN] = data[i];
+    writer->buffered++;
+  }
+  return true;
+}
+
+static bool write_result_block(storage_result_writer_t *writer) {
+  // Write up to the next block boundary of the file, if it is all buffered
+  uint16_t len = SD_BLOCK_LEN - (writer->written % SD_BLOCK_LEN);
+  if ((writer->buffered - writer->written) < len) {
+    return false;
+  }
+  return timed_result_write(writer, len);
+}
+
+static void drain_result_writer(storage_result_writer_t *writer) {
+  // Whole blocks first, leaving a partial block that can't wrap the ring
+  while (write_result_block(writer)) {}
+  uint16_t len = writer->buffered - writer->written;
+  if (len > 0) {
+    timed_result_write(writer, len);
+  }
+}
+
+static void update_run_container_len(void) {
+  // The length only ever covers records already written, and is synced with
+  // them, so after a power loss the header never claims more than the card
+  // holds. Records are buffered whole, a stream cut short by an interrupt is
+  // replaced when its testdef is rerun
+  run_container_header_t *header = &_run_container_header;
+  drain_result_writer(&_run_container);
+  // Every testdef of a batch is checkpointed, only the first has records left
+  if (header->data_len == _run_container.written - header->data_offset) {
+    return;
   }
+  header->data_len = _run_container.written - header->data_offset;
+  uint32_t start_time = micros();
+  _run_container.file.seekSet(offsetof(run_container_header_t, data_len));
+  _run_container.file.write((uint8_t*) &header->data_len, sizeof(header->data_len));
+  _run_container.file.seekSet(_run_container.written);
+  _run_container.file.sync();
+  _max_write_latency = max(_max_write_latency, micros() - start_time);
+}
+
+static bool timed_result_write(storage_result_writer_t *writer, uint16_t len) {
+  uint32_t start_time = micros();
+  size_t written = writer->file.write(&writer->buf[writer->written % RESULT_BUFFER_LEN], len);
+  _max_write_latency = max(_max_write_latency, micros() - start_time);
+  // Dropping the bytes on failure keeps the ring usable
+  writer->written += len;
+  return written == len;
+}
+
+static bool write_log_entry(void) {
+  if (_log_tail == _log_head) {
+    return false;
+  }
+  uint32_t start_time = micros();
+  storage_log_entry_t *entry = &_log_ring[_log_tail % LOG_RING_LEN];
+  if (_log_dropped > 0) {
+    LOG_ERROR("[%d log message(s) dropped]\n", _log_dropped);
+    _log_dropped = 0;
+  }
+  uintptr_t args[LOG_MAX_ARGS];
+  for (uint8_t i=0; i < LOG_MAX_ARGS; i++) {
+    bool is_str = i < entry->arg_cnt && (entry->str_mask & (1 << i));
+    args[i] = is_str ? (uintptr_t) &entry->strs[entry->args[i]] : entry->args[i];
+  }
+  // Unused arguments are passed as well, printf ignores any extra
+  static_assert(LOG_MAX_ARGS == 8, "Log formatting must pass every argument");
+  char line[LOG_MAX_LINE_LEN];
+  snprintf(line, LOG_MAX_LINE_LEN, entry->format, args[0], args[1], args[2], args[3], 
+           args[4], args[5], args[6], args[7]);
+  telemetry_print(line);
+  if (entry->file != NULL) {
+    entry->file->write(line);
+  }
+  _log_tail++;
+  _max_log_latency = max(_max_log_latency, micros() - start_time);
+  return true;
 }
 
 static void get_fat_date_time(uint16_t* date, uint16_t* time) {
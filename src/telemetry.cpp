@@ -0,0 +1,195 @@
+#include <Arduino.h>
+
+#include "telemetry.h"
+
+// Formats already sent to the host, by address as every format is a literal
+#define TELEMETRY_FORMAT_SET_LEN (256)
+
+static bool write_frame(uint8_t type, const uint8_t *payload, uint8_t len);
+static bool send_format(const char *format);
+static bool is_format_sent(const char *format, bool add);
+static bool write_dropped_note(void);
+static bool write_available(const uint8_t *data, uint16_t len);
+static uint8_t add_varint(uint8_t *payload, uint8_t len, uint32_t val);
+static bool has_room(uint8_t *payload, uint8_t len, uint8_t arg_len);
+
+static const char *_sent_formats[TELEMETRY_FORMAT_SET_LEN];
+static uint16_t _sent_format_cnt;
+// Messages dropped while USB couldn't take them
+static uint32_t _dropped;
+static bool _host_connected;
+
+void telemetry_print(const char *text) {
+  uint16_t len = strlen(text);
+#if TELEMETRY_BINARY
+  while (len > 0) {
+    uint8_t frag_len = min(len, (uint16_t) TELEMETRY_MAX_PAYLOAD);
+    if (!write_frame(tlm_text, (const uint8_t*) text, frag_len)) {
+      return;
+    }
+    text += frag_len;
+    len -= frag_len;
+  }
+#else
+  if (write_dropped_note()) {
+    write_available((const uint8_t*) text, len);
+  }
+#endif
+}
+
+uint8_t telemetry_begin_message(uint8_t *payload, uint8_t level, const char *format) {
+  payload[0] = level;
+  uint32_t id = (uint32_t) (uintptr_t) format;
+  memcpy(&payload[1], &id, sizeof(id));
+  return 1 + sizeof(id);
+}
+
+uint8_t telemetry_add_arg(uint8_t *payload, uint8_t len, int32_t val) {
+  if (!has_room(payload, len, 5)) {
+    return len;
+  }
+  // Zigzag keeps small negative values short
+  return add_varint(payload, len, ((uint32_t) val << 1) ^ (uint32_t) (val >> 31));
+}
+
+uint8_t telemetry_add_arg(uint8_t *payload, uint8_t len, float val) {
+  if (!has_room(payload, len, sizeof(val))) {
+    return len;
+  }
+  memcpy(&payload[len], &val, sizeof(val));
+  return len + sizeof(val);
+}
+
+uint8_t telemetry_add_arg(uint8_t *payload, uint8_t len, const char *str) {
+  // Long strings are cut short to what is left of the payload rather than
+  // losing the message, only the null has to fit
+  if (!has_room(payload, len, 1)) {
+    return len;
+  }
+  uint8_t str_len = strnlen(str, min(TELEMETRY_MAX_STR_LEN, TELEMETRY_MAX_PAYLOAD - len - 1));
+  memcpy(&payload[len], str, str_len);
+  payload[len + str_len] = '\0';
+  return len + str_len + 1;
+}
+
+void telemetry_send_message(const char *format, uint8_t *payload, uint8_t len) {
+  if (!send_format(format)) {
+    return;
+  }
+  write_frame(tlm_message, payload, len);
+}
+
+static bool write_frame(uint8_t type, const uint8_t *payload, uint8_t len) {
+  if (!write_dropped_note()) {
+    return false;
+  }
+  uint8_t header[] = {TELEMETRY_SYNC, len, type};
+  uint8_t check = len ^ type;
+  for (uint8_t i=0; i < len; i++) {
+    check ^= payload[i];
+  }
+  return write_available(header, sizeof(header)) && write_available(payload, len) &&
+         write_available(&check, sizeof(check));
+}
+
+static bool send_format(const char *format) {
+  // A new host has seen none of the formats
+  bool connected = Serial.dtr();
+  if (connected && !_host_connected) {
+    _sent_format_cnt = 0;
+    memset(_sent_formats, 0, sizeof(_sent_formats));
+  }
+  _host_connected = connected;
+  if (is_format_sent(format, false)) {
+    return true;
+  }
+  uint8_t payload[TELEMETRY_MAX_PAYLOAD];
+  uint32_t id = (uint32_t) (uintptr_t) format;
+  memcpy(payload, &id, sizeof(id));
+  uint8_t format_len = min(strlen(format), TELEMETRY_MAX_PAYLOAD - sizeof(id));
+  memcpy(&payload[sizeof(id)], format, format_len);
+  if (!write_frame(tlm_format, payload, sizeof(id) + format_len)) {
+    return false;
+  }
+  is_format_sent(format, true);
+  return true;
+}
+
+static bool is_format_sent(const char *format, bool add) {
+  // Open addressing on the address, once full every new format is just resent
+  uint16_t idx = ((uint32_t) (uintptr_t) format >> 2) % TELEMETRY_FORMAT_SET_LEN;
+  for (uint16_t i=0; i < TELEMETRY_FORMAT_SET_LEN; i++) {
+    const char **slot = &_sent_formats[(idx + i) % TELEMETRY_FORMAT_SET_LEN];
+    if (*slot == format) {
+      return true;
+    }
+    if (*slot == NULL) {
+      if (add && _sent_format_cnt < TELEMETRY_FORMAT_SET_LEN - 1) {
+        *slot = format;
+        _sent_format_cnt++;
+      }
+      return false;
+    }
+  }
+  return false;
+}
+
+static bool write_dropped_note(void) {
+  if (_dropped == 0) {
+    return true;
+  }
+  uint32_t dropped = _dropped;
+  _dropped = 0;
+#if TELEMETRY_BINARY
+  uint8_t payload[5];
+  bool written = write_frame(tlm_dropped, payload, add_varint(payload, 0, dropped));
+#else
+  char note[32];
+  uint8_t note_len = snprintf(note, sizeof(note), "[%lu message(s) dropped]\n", dropped);
+  bool written = write_available((const uint8_t*) note, note_len);
+#endif
+  if (!written) {
+    _dropped += dropped;
+  }
+  return written;
+}
+
+static bool write_available(const uint8_t *data, uint16_t len) {
+  // Only the current USB packet is known to be free, writing past it could
+  // wait for the host. A host that isn't reading just misses output, the
+  // decoder recovers from a frame cut short
+  while (len > 0) {
+    int free = Serial.availableForWrite();
+    if (free <= 0) {
+      _dropped++;
+      return false;
+    }
+    uint16_t chunk = min(len, (uint16_t) free);
+    Serial.write(data, chunk);
+    data += chunk;
+    len -= chunk;
+  }
+  return true;
+}
+
+static bool has_room(uint8_t *payload, uint8_t len, uint8_t arg_len) {
+  // Once an argument is left out so are all after it, otherwise the decoder
+  // would read them in its place
+  if ((payload[0] & TELEMETRY_TRUNCATED) || len + arg_len > TELEMETRY_MAX_PAYLOAD) {
+    payload[0] |= TELEMETRY_TRUNCATED;
+    return false;
+  }
+  return true;
+}
+
+static uint8_t add_varint(uint8_t *payload, uint8_t len, uint32_t val) {
+  if (len + 5 > TELEMETRY_MAX_PAYLOAD) {
+    return len;
+  }
+  while (val >= 0x80) {
+    payload[len++] = (uint8_t) (val | 0x80);
+    val >>= 7;
+  }
+  payload[len++] = (uint8_t) val;
+  return len;
+}
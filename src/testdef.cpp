@@ -0,0 +1,335 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "testdef.h"
+
+// Errors go to the console on the device and stdout on a host
+#ifdef ARDUINO
+#include "telemetry.h"
+#define TESTDEF_PRINTF LOG_INFO
+#else
+#include <stdio.h>
+#define TESTDEF_PRINTF printf
+#endif
+
+// Testdefs are read through a small fixed buffer rather than the heap
+#define TESTDEF_READ_BUF_LEN (32)
+#define TESTDEF_TOKEN_LEN (64)
+
+/*
+  Splits a testdef file into its comma separated fields in a single pass,
+  tracking the line so errors can be pointed at.
+*/
+typedef struct testdef_tokenizer_t {
+  testdef_read_t read;
+  void *src;
+  char buf[TESTDEF_READ_BUF_LEN];
+  uint8_t pos;
+  uint8_t len;
+  uint16_t line;
+  uint16_t token_line;    // line the last token started on
+  bool overlong;          // last token didn't fit and was cut short
+} testdef_tokenizer_t;
+
+static bool parse_sweep_field(char *token, uint8_t field, uint16_t line, testdef_sweep_field_t *sweep);
+static bool check_field_value(uint8_t field, float val, uint16_t line);
+static void print_field_error(uint8_t field, uint16_t line);
+static float get_sweep_value(testdef_sweep_field_t *sweep, uint16_t idx);
+static bool next_testdef_token(testdef_tokenizer_t *tok, char *token);
+static bool is_legal_bw(long bw);
+
+static const char *TESTDEF_FIELDS[] = {"exp_range", "packet_cnt", "packet_len", "freq", "sf", "tx_dbm",
+                                       "bw", "cr4_denom", "preamble_syms", "crc"};
+#define TESTDEF_FIELD_COUNT (uint8_t) (sizeof(TESTDEF_FIELDS) / sizeof(TESTDEF_FIELDS[1]))
+static_assert(TESTDEF_FIELD_COUNT == TESTDEF_FIELD_CNT, "Testdef field count mismatch");
+// Inclusive range each testdef field must fall within, in the order of the fields
+typedef struct testdef_field_limits_t {
+  long min;
+  long max;
+} testdef_field_limits_t;
+static const testdef_field_limits_t TESTDEF_LIMITS[] = {{0, UINT8_MAX}, {1, UINT16_MAX},
+                                                        {MIN_TESTDEF_PACKET_LEN, MAX_TESTDEF_PACKET_LEN},
+                                                        {137, 1020}, {6, 12}, {5, 23}, {7800, 500000},
+                                                        {5, 8}, {6, UINT8_MAX}, {0, 1}};
+// Bandwidths the RFM95 can be set to exactly, Hz
+static const long LEGAL_BWS[] = {7800, 10400, 15600, 20800, 31250, 41700, 62500, 125000, 250000, 500000};
+#define LEGAL_BW_COUNT (uint8_t) (sizeof(LEGAL_BWS) / sizeof(LEGAL_BWS[0]))
+
+bool testdef_load_sweep(testdef_read_t read, void *src, const char *filename,
+                        testdef_sweep_t *sweep) {
+  // Get filename as test id
+  testdef_extract_id(filename, sweep->name);
+  testdef_tokenizer_t tok;
+  tok.read = read;
+  tok.src = src;
+  tok.pos = 0;
+  tok.len = 0;
+  tok.line = 1;
+  tok.token_line = 1;
+  tok.overlong = false;
+  uint32_t variant_cnt = 1;
+  // Extract each field as if csv format with an extra ',' on the end
+  for (uint8_t field=0; field < TESTDEF_FIELD_COUNT; field++) {
+    char token[TESTDEF_TOKEN_LEN];
+    bool found = next_testdef_token(&tok, token);
+    uint16_t line = tok.token_line;
+    if (!found) {
+      TESTDEF_PRINTF(" (line %d, %s: missing) ", line, TESTDEF_FIELDS[field]);
+      return false;
+    }
+    if (tok.overlong) {
+      TESTDEF_PRINTF(" (line %d, %s: '%s...' is too long) ", line, TESTDEF_FIELDS[field], token);
+      return false;
+    }
+    if (!parse_sweep_field(token, field, line, &sweep->fields[field])) {
+      return false;
+    }
+    variant_cnt *= sweep->fields[field].cnt;
+    if (variant_cnt > UINT16_MAX) {
+      TESTDEF_PRINTF(" (line %d, %s: sweep has too many variants) ", line, TESTDEF_FIELDS[field]);
+      return false;
+    }
+  }
+  sweep->variant_cnt = variant_cnt;
+  return true;
+}
+
+void testdef_get_variant(testdef_sweep_t *sweep, uint16_t variant, lora_testdef_t *testdef) {
+  // Variants count through the values of the last field fastest
+  float vals[TESTDEF_FIELD_COUNT];
+  uint16_t remaining = variant;
+  for (int8_t field=TESTDEF_FIELD_COUNT - 1; field >= 0; field--) {
+    testdef_sweep_field_t *field_sweep = &sweep->fields[field];
+    vals[field] = get_sweep_value(field_sweep, remaining % field_sweep->cnt);
+    remaining /= field_sweep->cnt;
+  }
+  testdef->exp_range = lroundf(vals[FIELD_EXP_RANGE]);
+  testdef->packet_cnt = lroundf(vals[FIELD_PACKET_CNT]);
+  testdef->packet_len = lroundf(vals[FIELD_PACKET_LEN]);
+  testdef->cfg.freq = vals[FIELD_FREQ];
+  testdef->cfg.sf = lroundf(vals[FIELD_SF]);
+  testdef->cfg.tx_dbm = lroundf(vals[FIELD_TX_DBM]);
+  testdef->cfg.bw = lroundf(vals[FIELD_BW]);
+  testdef->cfg.cr4_denom = lroundf(vals[FIELD_CR4_DENOM]);
+  testdef->cfg.preamble_syms = lroundf(vals[FIELD_PREAMBLE_SYMS]);
+  testdef->cfg.crc = lroundf(vals[FIELD_CRC]) ? true : false;
+  // Variants of a sweep are told apart by their index
+  if (sweep->variant_cnt > 1) {
+    snprintf(testdef->id, TESTDEF_ID_LEN, "%.*s_%u", TESTDEF_ID_LEN - 7, sweep->name, variant);
+  } else {
+    strcpy(testdef->id, sweep->name);
+  }
+}
+
+bool testdef_is_valid(lora_testdef_t *testdef) {
+  // Applies the same rules as loading a testdef file to one that was already built
+  float vals[TESTDEF_FIELD_COUNT] = {
+    (float) testdef->exp_range, (float) testdef->packet_cnt, (float) testdef->packet_len,
+    testdef->cfg.freq, (float) testdef->cfg.sf, (float) testdef->cfg.tx_dbm, (float) testdef->cfg.bw,
+    (float) testdef->cfg.cr4_denom, (float) testdef->cfg.preamble_syms, (float) testdef->cfg.crc};
+  if (testdef->id[0] == '\0') {
+    TESTDEF_PRINTF(" (missing id) ");
+    return false;
+  }
+  for (uint8_t field=0; field < TESTDEF_FIELD_COUNT; field++) {
+    if (!check_field_value(field, vals[field], 0)) {
+      return false;
+    }
+  }
+  // Must fit the window with every slave of a plan sharing it
+  uint32_t duration = testdef_duration(testdef_packet_slot(&testdef->cfg, testdef->packet_len),
+                                       testdef->packet_cnt, MAX_PLAN_SLAVES);
+  if (duration > MAX_TESTDEF_DURATION_MS) {
+    TESTDEF_PRINTF(" (duration %lums exceeds %lums) ", (unsigned long) duration, 
+                   (unsigned long) MAX_TESTDEF_DURATION_MS);
+    return false;
+  }
+  return true;
+}
+
+const char* testdef_field_name(uint8_t field) {
+  return field < TESTDEF_FIELD_COUNT ? TESTDEF_FIELDS[field] : "";
+}
+
+void testdef_extract_id(const char *filename, char *testdef_id) {
+  // Get substring of filename to not include extension and not exceed max id length
+  for (uint8_t i=0; i < TESTDEF_ID_LEN; i++) {
+    if (filename[i] == '.' || filename[i] == '\0' || i == (TESTDEF_ID_LEN - 1)) {
+      testdef_id[i] = '\0';
+      break;
+    }
+    testdef_id[i] = filename[i];
+  }
+}
+
+bool testdef_low_datarate_required(lora_cfg_t *cfg) {
+  float symbol_time = 1000.0 * pow(2, cfg->sf) / cfg->bw;	// ms
+  // Value of 16.0 for symbol time required for enabling low data rate is copied from
+  // RadioHead library. No source provided but keep the same for consistency.
+  return symbol_time > 16.0;
+}
+
+uint32_t testdef_packet_airtime(lora_cfg_t *cfg, uint16_t packet_len) {
+  // All equations used from (modified slightly for our formats):
+  // https://www.semtech.com/uploads/documents/LoraDesignGuide_STD.pdf
+
+  float symbol_time = 1000.0 * pow(2, cfg->sf) / cfg->bw;	// ms
+  float preamble_time = (cfg->preamble_syms + 4.25) * symbol_time;
+  bool ldr = testdef_low_datarate_required(cfg);
+  // N.B RadioHead always uses an explicit header, the -20 only applies without one
+  int32_t psc_top = 8 * packet_len - 4 * cfg->sf + 28 + 16 * cfg->crc;
+  int32_t psc_bot = 4 * (cfg->sf - 2 * ldr);
+  if (psc_top < 0) {
+    psc_top = 0;
+  }
+  // Whole coding rate blocks are always sent, so round up
+  uint16_t psc_lhs = (psc_top + psc_bot - 1) / psc_bot;
+  uint16_t payload_symbol_count = 8 + psc_lhs * cfg->cr4_denom;
+  float payload_time = payload_symbol_count * symbol_time;
+  float total_time = preamble_time + payload_time;
+  return total_time;
+}
+
+uint32_t testdef_packet_slot(lora_cfg_t *cfg, uint16_t packet_len) {
+  return testdef_packet_airtime(cfg, packet_len) + PACKET_SLOT_GUARD_MS;
+}
+
+uint32_t testdef_duration(uint32_t slot_time, uint16_t packet_cnt, uint8_t slot_cnt) {
+  return SLAVE_PACKET_SEND_DELAY + slot_time * packet_cnt * slot_cnt + RX_WINDOW_TOLERANCE_MS;
+}
+
+static bool parse_sweep_field(char *token, uint8_t field, uint16_t line, testdef_sweep_field_t *sweep) {
+  // A range is 'first:last' or 'first:last:step', otherwise values are listed as 'a|b|c'
+  bool is_range = strchr(token, ':') != NULL;
+  char sep = is_range ? ':' : '|';
+  float parsed[TESTDEF_SWEEP_MAX_LIST];
+  uint8_t parsed_cnt = 0;
+  char *pos = token;
+  while (true) {
+    if (parsed_cnt == TESTDEF_SWEEP_MAX_LIST || (is_range && parsed_cnt == 3)) {
+      TESTDEF_PRINTF(" (line %d, %s: too many values) ", line, TESTDEF_FIELDS[field]);
+      return false;
+    }
+    char *end;
+    parsed[parsed_cnt] = strtod(pos, &end);
+    // Only frequencies can be fractional
+    if (end == pos || (*end != '\0' && *end != sep) ||
+        (field != FIELD_FREQ && parsed[parsed_cnt] != floorf(parsed[parsed_cnt]))) {
+      TESTDEF_PRINTF(" (line %d, %s: '%s' is not a number) ", line, TESTDEF_FIELDS[field], token);
+      return false;
+    }
+    parsed_cnt++;
+    if (*end == '\0') {
+      break;
+    }
+    pos = end + 1;
+  }
+
+  sweep->is_range = is_range;
+  if (!is_range) {
+    memcpy(sweep->values, parsed, parsed_cnt * sizeof(float));
+    sweep->cnt = parsed_cnt;
+  } else {
+    float step = parsed_cnt == 3 ? parsed[2] : 1;
+    if (parsed_cnt < 2 || step <= 0 || parsed[1] < parsed[0]) {
+      TESTDEF_PRINTF(" (line %d, %s: '%s' is not a valid range) ", line, TESTDEF_FIELDS[field], token);
+      return false;
+    }
+    sweep->values[0] = parsed[0];
+    sweep->values[1] = step;
+    // Allow for rounding so the last value is included when the step lands on it
+    uint32_t cnt = (uint32_t) ((parsed[1] - parsed[0]) / step + 0.001) + 1;
+    if (cnt > UINT16_MAX) {
+      TESTDEF_PRINTF(" (line %d, %s: range is too large) ", line, TESTDEF_FIELDS[field]);
+      return false;
+    }
+    sweep->cnt = cnt;
+  }
+  for (uint16_t i=0; i < sweep->cnt; i++) {
+    if (!check_field_value(field, get_sweep_value(sweep, i), line)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool check_field_value(uint8_t field, float val, uint16_t line) {
+  if (val < TESTDEF_LIMITS[field].min || val > TESTDEF_LIMITS[field].max) {
+    print_field_error(field, line);
+    TESTDEF_PRINTF("%g outside %ld-%ld) ", val, TESTDEF_LIMITS[field].min, TESTDEF_LIMITS[field].max);
+    return false;
+  }
+  if (field == FIELD_BW && !is_legal_bw(lroundf(val))) {
+    print_field_error(field, line);
+    TESTDEF_PRINTF("%g is not a legal bandwidth) ", val);
+    return false;
+  }
+  return true;
+}
+
+static void print_field_error(uint8_t field, uint16_t line) {
+  // Line 0 marks a testdef that wasn't read from a file
+  if (line > 0) {
+    TESTDEF_PRINTF(" (line %d, %s: ", line, TESTDEF_FIELDS[field]);
+  } else {
+    TESTDEF_PRINTF(" (%s: ", TESTDEF_FIELDS[field]);
+  }
+}
+
+static float get_sweep_value(testdef_sweep_field_t *sweep, uint16_t idx) {
+  if (sweep->is_range) {
+    return sweep->values[0] + idx * sweep->values[1];
+  }
+  return sweep->values[idx];
+}
+
+static bool next_testdef_token(testdef_tokenizer_t *tok, char *token) {
+  uint8_t len = 0;
+  bool started = false;
+  tok->token_line = tok->line;
+  tok->overlong = false;
+  while (true) {
+    if (tok->pos == tok->len) {
+      int read = tok->read(tok->src, tok->buf, TESTDEF_READ_BUF_LEN);
+      tok->pos = 0;
+      tok->len = read > 0 ? read : 0;
+      if (tok->len == 0) {
+        break;
+      }
+    }
+    char c = tok->buf[tok->pos++];
+    if (c == ',') {
+      // An empty field is still a field, it just won't parse
+      started = true;
+      break;
+    }
+    if (c == '\n') {
+      tok->line++;
+    }
+    // Whitespace is dropped so fields can be split over lines
+    if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+      continue;
+    }
+    if (!started) {
+      tok->token_line = tok->line;
+      started = true;
+    }
+    if (len < (TESTDEF_TOKEN_LEN - 1)) {
+      token[len++] = c;
+    } else {
+      tok->overlong = true;
+    }
+  }
+  token[len] = '\0';
+  return started;
+}
+
+static bool is_legal_bw(long bw) {
+  for (uint8_t i=0; i < LEGAL_BW_COUNT; i++) {
+    if (bw == LEGAL_BWS[i]) {
+      return true;
+    }
+  }
+  return false;
+}
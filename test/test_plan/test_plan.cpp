@@ -0,0 +1,122 @@
+#include <unity.h>
+#include <string.h>
+
+#include "plan.h"
+
+static void make_key(uint16_t dir_index, uint8_t exp_range, float freq, uint8_t sf, 
+                     plan_key_t *key) {
+  lora_testdef_t testdef = {"", exp_range, 10, 20, {freq, sf, 14, 125000, 5, 8, true}, 0, 0};
+  plan_make_key(&testdef, dir_index, 0, key);
+}
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+void test_order_by_range_then_configuration(void) {
+  plan_key_t keys[5];
+  make_key(0, 1, 868.1, 7, &keys[0]);
+  make_key(1, 3, 869.5, 7, &keys[1]);
+  make_key(2, 3, 868.1, 9, &keys[2]);
+  make_key(3, 2, 868.1, 7, &keys[3]);
+  make_key(4, 3, 868.1, 7, &keys[4]);
+  plan_order_testdefs(keys, 5);
+  // Highest expected range first, then grouped by frequency and spreading factor
+  const uint16_t order[] = {4, 2, 1, 3, 0};
+  for (uint8_t i=0; i < 5; i++) {
+    TEST_ASSERT_EQUAL_UINT16(order[i], keys[i].dir_index);
+  }
+}
+
+void test_order_is_deterministic_for_identical_configurations(void) {
+  plan_key_t keys[3];
+  make_key(2, 1, 868.1, 7, &keys[0]);
+  make_key(0, 1, 868.1, 7, &keys[1]);
+  make_key(1, 1, 868.1, 7, &keys[2]);
+  plan_order_testdefs(keys, 3);
+  for (uint8_t i=0; i < 3; i++) {
+    TEST_ASSERT_EQUAL_UINT16(i, keys[i].dir_index);
+  }
+}
+
+void test_batch_needs_separate_channels(void) {
+  plan_key_t keys[3];
+  // 100kHz apart overlaps two 125kHz channels, 400kHz apart does not
+  make_key(0, 1, 868.1, 7, &keys[0]);
+  make_key(1, 1, 868.2, 7, &keys[1]);
+  make_key(2, 1, 868.5, 7, &keys[2]);
+  TEST_ASSERT_EQUAL_UINT16(1, plan_batch_end(keys, 3, 0, 2));
+  TEST_ASSERT_EQUAL_UINT16(3, plan_batch_end(keys, 3, 1, 2));
+  // Never larger than the radios available
+  make_key(1, 1, 868.9, 7, &keys[1]);
+  TEST_ASSERT_EQUAL_UINT16(2, plan_batch_end(keys, 3, 0, 2));
+  TEST_ASSERT_EQUAL_UINT16(3, plan_batch_end(keys, 3, 0, 3));
+}
+
+void test_order_pulls_forward_batch_partners(void) {
+  plan_key_t keys[4];
+  make_key(0, 1, 868.1, 7, &keys[0]);
+  make_key(1, 1, 868.1, 9, &keys[1]);
+  make_key(2, 1, 868.5, 7, &keys[2]);
+  make_key(3, 1, 868.5, 9, &keys[3]);
+  plan_order_testdefs(keys, 4, 2);
+  // Testdefs on the same channel are split into separate batches
+  const uint16_t order[] = {0, 2, 1, 3};
+  for (uint8_t i=0; i < 4; i++) {
+    TEST_ASSERT_EQUAL_UINT16(order[i], keys[i].dir_index);
+  }
+  TEST_ASSERT_EQUAL_UINT16(2, plan_batch_end(keys, 4, 0, 2));
+  TEST_ASSERT_EQUAL_UINT16(4, plan_batch_end(keys, 4, 2, 2));
+}
+
+void test_batches_stay_within_their_level(void) {
+  plan_key_t keys[3];
+  make_key(0, 2, 868.1, 7, &keys[0]);
+  make_key(1, 2, 868.1, 9, &keys[1]);
+  make_key(2, 1, 868.5, 7, &keys[2]);
+  plan_order_testdefs(keys, 3, 2);
+  // The only separate channel is at a lower level, so can't be pulled forward
+  TEST_ASSERT_EQUAL_UINT16(0, keys[0].dir_index);
+  TEST_ASSERT_EQUAL_UINT16(1, keys[1].dir_index);
+  TEST_ASSERT_EQUAL_UINT16(2, keys[2].dir_index);
+  TEST_ASSERT_EQUAL_UINT16(2, plan_block_end(keys, 3, 0));
+}
+
+void test_block_end_is_bounded(void) {
+  plan_key_t keys[PLAN_MAX_BLOCK_LEN + 2];
+  for (uint16_t i=0; i < PLAN_MAX_BLOCK_LEN + 2; i++) {
+    make_key(i, 1, 868.1, 7, &keys[i]);
+  }
+  TEST_ASSERT_EQUAL_UINT16(PLAN_MAX_BLOCK_LEN, plan_block_end(keys, PLAN_MAX_BLOCK_LEN + 2, 0));
+  TEST_ASSERT_EQUAL_UINT16(PLAN_MAX_BLOCK_LEN + 2, 
+                           plan_block_end(keys, PLAN_MAX_BLOCK_LEN + 2, PLAN_MAX_BLOCK_LEN));
+}
+
+void test_batch_lasts_as_long_as_its_longest_testdef(void) {
+  plan_key_t keys[2];
+  make_key(0, 1, 868.1, 7, &keys[0]);
+  make_key(1, 1, 868.5, 9, &keys[1]);
+  uint32_t longest = testdef_duration(keys[1].slot_time, keys[1].packet_cnt);
+  TEST_ASSERT_EQUAL_UINT32(longest, plan_batch_duration(keys, 0, 2));
+  TEST_ASSERT_EQUAL_UINT32(longest, plan_block_duration(keys, 0, 2, 2));
+  TEST_ASSERT_EQUAL_UINT32(testdef_duration(keys[0].slot_time, keys[0].packet_cnt) + longest,
+                           plan_block_duration(keys, 0, 2, 1));
+}
+
+void test_hash_matches_equal_ids(void) {
+  TEST_ASSERT_EQUAL_UINT16(plan_hash_id("sweep_1"), plan_hash_id("sweep_1"));
+  TEST_ASSERT_TRUE(plan_hash_id("sweep_1") != plan_hash_id("sweep_2"));
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_order_by_range_then_configuration);
+  RUN_TEST(test_order_is_deterministic_for_identical_configurations);
+  RUN_TEST(test_batch_needs_separate_channels);
+  RUN_TEST(test_order_pulls_forward_batch_partners);
+  RUN_TEST(test_batches_stay_within_their_level);
+  RUN_TEST(test_block_end_is_bounded);
+  RUN_TEST(test_batch_lasts_as_long_as_its_longest_testdef);
+  RUN_TEST(test_hash_matches_equal_ids);
+  return UNITY_END();
+}
@@ -0,0 +1,55 @@
+#include <unity.h>
+#include <string.h>
+
+#include "plan_file.h"
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+void test_pack_unpack(void) {
+  lora_testdef_t testdef = {"sweep_3", 12, 500, 64, {868.3, 10, -3, 62500, 7, 12, false}, 0, 0};
+  plan_file_testdef_t rec;
+  plan_file_pack_testdef(&testdef, &rec);
+  lora_testdef_t unpacked;
+  memset(&unpacked, 0xA5, sizeof(unpacked));
+  plan_file_unpack_testdef(&rec, &unpacked);
+  TEST_ASSERT_EQUAL_STRING("sweep_3", unpacked.id);
+  TEST_ASSERT_EQUAL_UINT8(12, unpacked.exp_range);
+  TEST_ASSERT_EQUAL_UINT16(500, unpacked.packet_cnt);
+  TEST_ASSERT_EQUAL_UINT8(64, unpacked.packet_len);
+  TEST_ASSERT_EQUAL_FLOAT(868.3f, unpacked.cfg.freq);
+  TEST_ASSERT_EQUAL_UINT8(10, unpacked.cfg.sf);
+  TEST_ASSERT_EQUAL_INT(-3, unpacked.cfg.tx_dbm);
+  TEST_ASSERT_EQUAL_INT32(62500, unpacked.cfg.bw);
+  TEST_ASSERT_EQUAL_UINT8(7, unpacked.cfg.cr4_denom);
+  TEST_ASSERT_EQUAL_UINT8(12, unpacked.cfg.preamble_syms);
+  TEST_ASSERT_FALSE(unpacked.cfg.crc);
+  testdef.cfg.crc = true;
+  plan_file_pack_testdef(&testdef, &rec);
+  plan_file_unpack_testdef(&rec, &unpacked);
+  TEST_ASSERT_TRUE(unpacked.cfg.crc);
+}
+
+void test_unpack_terminates_damaged_id(void) {
+  plan_file_testdef_t rec;
+  memset(&rec, 0, sizeof(rec));
+  memset(rec.id, 'x', TESTDEF_ID_LEN);
+  lora_testdef_t testdef;
+  plan_file_unpack_testdef(&rec, &testdef);
+  TEST_ASSERT_EQUAL(TESTDEF_ID_LEN - 1, strlen(testdef.id));
+}
+
+void test_record_layout(void) {
+  // The format is shared between hosts and the device, so must not be padded
+  TEST_ASSERT_EQUAL(9, sizeof(plan_file_header_t));
+  TEST_ASSERT_EQUAL(TESTDEF_ID_LEN + 17, sizeof(plan_file_testdef_t));
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_pack_unpack);
+  RUN_TEST(test_unpack_terminates_damaged_id);
+  RUN_TEST(test_record_layout);
+  return UNITY_END();
+}
@@ -0,0 +1,114 @@
+#include <unity.h>
+#include <string.h>
+
+#include "run_container.h"
+
+typedef struct result_t {
+  uint16_t id;
+  int16_t rssi;
+  int16_t snr;
+  uint32_t failed_recv;
+  int32_t time_left;
+  uint32_t arrival;
+} result_t;
+
+static void check_round_trip(const result_t results[], uint8_t cnt) {
+  run_container_stream_t encoder, decoder;
+  rc_reset_stream(&encoder);
+  rc_reset_stream(&decoder);
+  uint8_t buf[RC_MAX_RESULT_LEN * 8];
+  size_t len = 0;
+  for (uint8_t i=0; i < cnt; i++) {
+    const result_t *r = &results[i];
+    uint8_t record_len = rc_encode_result(&encoder, 3, r->id, r->rssi, r->snr, r->failed_recv, 
+                                          r->time_left, r->arrival, &buf[len]);
+    TEST_ASSERT_LESS_OR_EQUAL(RC_MAX_RESULT_LEN, record_len);
+    len += record_len;
+  }
+  // Decode as the converter does, a tag then the fields of the stream it names
+  size_t pos = 0;
+  for (uint8_t i=0; i < cnt; i++) {
+    const result_t *r = &results[i];
+    uint8_t tag = buf[pos++];
+    TEST_ASSERT_EQUAL_UINT8(rc_tag_result, RC_TAG_TYPE(tag));
+    TEST_ASSERT_EQUAL_UINT8(3, RC_TAG_STREAM(tag));
+    size_t used = rc_decode_result(&decoder, &buf[pos], len - pos);
+    TEST_ASSERT_TRUE(used > 0);
+    pos += used;
+    TEST_ASSERT_EQUAL_UINT16(r->id, decoder.id);
+    TEST_ASSERT_EQUAL_INT16(r->rssi, decoder.rssi);
+    TEST_ASSERT_EQUAL_INT16(r->snr, decoder.snr);
+    TEST_ASSERT_EQUAL_UINT32(r->failed_recv, decoder.failed_recv);
+    TEST_ASSERT_EQUAL_INT32(r->time_left, decoder.time_left);
+    TEST_ASSERT_EQUAL_UINT32(r->arrival, decoder.arrival);
+  }
+  TEST_ASSERT_EQUAL(len, pos);
+}
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+void test_consecutive_results(void) {
+  const result_t results[] = {
+    {0, -80, 7, 0, 60000, 1250000},
+    {1, -82, 6, 0, 59000, 2250000},
+    {2, -79, 8, 1, 58000, 3250000},
+  };
+  check_round_trip(results, 3);
+}
+
+void test_missed_packets_and_negative_deltas(void) {
+  const result_t results[] = {
+    {5, -120, -15, 3, 1000, 1000},
+    {4, -30, 12, 3, 2000, 500},
+    {UINT16_MAX, INT16_MIN, INT16_MAX, 70000, -5, 0},
+    {0, INT16_MAX, INT16_MIN, 70000, INT32_MIN, 1},
+  };
+  check_round_trip(results, 4);
+}
+
+void test_arrival_beyond_signed_range(void) {
+  // Over 35.8 minutes from the start the arrival no longer fits a signed delta
+  const result_t results[] = {
+    {0, -80, 7, 0, 10, 2147000000UL},
+    {1, -80, 7, 0, 9, 2148000000UL},
+    {2, -80, 7, 0, 8, 4294000000UL},
+    {3, -80, 7, 0, 7, UINT32_MAX},
+  };
+  check_round_trip(results, 4);
+}
+
+void test_incomplete_result(void) {
+  run_container_stream_t encoder, decoder;
+  rc_reset_stream(&encoder);
+  rc_reset_stream(&decoder);
+  uint8_t buf[RC_MAX_RESULT_LEN];
+  uint8_t len = rc_encode_result(&encoder, 0, 0, -80, 7, 0, 60000, 1250000, buf);
+  // A record cut short by a crash is never decoded
+  for (uint8_t cut=1; cut < len; cut++) {
+    TEST_ASSERT_EQUAL(0, rc_decode_result(&decoder, &buf[1], cut - 1));
+  }
+  TEST_ASSERT_EQUAL(len - 1, rc_decode_result(&decoder, &buf[1], len - 1));
+}
+
+void test_begin_record(void) {
+  uint8_t buf[RC_MAX_BEGIN_LEN];
+  uint8_t len = rc_encode_begin(2, 0x41, "sweep_12", buf);
+  TEST_ASSERT_EQUAL_UINT8(3 + 8, len);
+  TEST_ASSERT_EQUAL_UINT8(rc_tag_begin, RC_TAG_TYPE(buf[0]));
+  TEST_ASSERT_EQUAL_UINT8(2, RC_TAG_STREAM(buf[0]));
+  TEST_ASSERT_EQUAL_UINT8(0x41, buf[1]);
+  TEST_ASSERT_EQUAL_UINT8(8, buf[2]);
+  TEST_ASSERT_TRUE(memcmp("sweep_12", &buf[3], 8) == 0);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_consecutive_results);
+  RUN_TEST(test_missed_packets_and_negative_deltas);
+  RUN_TEST(test_arrival_beyond_signed_range);
+  RUN_TEST(test_incomplete_result);
+  RUN_TEST(test_begin_record);
+  return UNITY_END();
+}
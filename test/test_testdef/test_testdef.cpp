@@ -0,0 +1,204 @@
+#include <unity.h>
+#include <string.h>
+
+#include "testdef.h"
+
+/*
+  Testdef file held in memory, handed out a few bytes at a time so fields
+  are split across reads as they would be from SD.
+*/
+typedef struct string_src_t {
+  const char *data;
+  size_t pos;
+  uint16_t chunk;
+} string_src_t;
+
+static int read_string(void *src, char *buf, uint16_t len) {
+  string_src_t *str = (string_src_t*) src;
+  size_t left = strlen(str->data) - str->pos;
+  size_t read = left < len ? left : len;
+  if (read > str->chunk) {
+    read = str->chunk;
+  }
+  memcpy(buf, &str->data[str->pos], read);
+  str->pos += read;
+  return read;
+}
+
+static bool load_sweep(const char *data, const char *filename, testdef_sweep_t *sweep) {
+  string_src_t src = {data, 0, 5};
+  return testdef_load_sweep(read_string, &src, filename, sweep);
+}
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+void test_single_testdef(void) {
+  testdef_sweep_t sweep;
+  lora_testdef_t testdef;
+  TEST_ASSERT_TRUE(load_sweep("10,100,20,\n868.1,7,14,125000,5,8,1,\n", "single.csv", &sweep));
+  TEST_ASSERT_EQUAL_UINT16(1, sweep.variant_cnt);
+  testdef_get_variant(&sweep, 0, &testdef);
+  // A single testdef keeps the file name as its id
+  TEST_ASSERT_EQUAL_STRING("single", testdef.id);
+  TEST_ASSERT_EQUAL_UINT8(10, testdef.exp_range);
+  TEST_ASSERT_EQUAL_UINT16(100, testdef.packet_cnt);
+  TEST_ASSERT_EQUAL_UINT8(20, testdef.packet_len);
+  TEST_ASSERT_EQUAL_FLOAT(868.1f, testdef.cfg.freq);
+  TEST_ASSERT_EQUAL_UINT8(7, testdef.cfg.sf);
+  TEST_ASSERT_EQUAL_INT(14, testdef.cfg.tx_dbm);
+  TEST_ASSERT_EQUAL_INT32(125000, testdef.cfg.bw);
+  TEST_ASSERT_EQUAL_UINT8(5, testdef.cfg.cr4_denom);
+  TEST_ASSERT_EQUAL_UINT8(8, testdef.cfg.preamble_syms);
+  TEST_ASSERT_TRUE(testdef.cfg.crc);
+  TEST_ASSERT_TRUE(testdef_is_valid(&testdef));
+}
+
+void test_fields_split_over_lines(void) {
+  testdef_sweep_t sweep;
+  lora_testdef_t testdef;
+  // Whitespace anywhere is dropped, so fields can be laid out freely
+  TEST_ASSERT_TRUE(load_sweep(" 10 ,\r\n100,\t20,\n\n868.1, 7,14 ,125000,5,8,0,", "spaced.txt", &sweep));
+  testdef_get_variant(&sweep, 0, &testdef);
+  TEST_ASSERT_EQUAL_STRING("spaced", testdef.id);
+  TEST_ASSERT_EQUAL_UINT16(100, testdef.packet_cnt);
+  TEST_ASSERT_EQUAL_UINT8(7, testdef.cfg.sf);
+  TEST_ASSERT_FALSE(testdef.cfg.crc);
+}
+
+void test_rejects_malformed_fields(void) {
+  testdef_sweep_t sweep;
+  // Missing the last field
+  TEST_ASSERT_FALSE(load_sweep("10,100,20,868.1,7,14,125000,5,8,", "bad.csv", &sweep));
+  // Empty field
+  TEST_ASSERT_FALSE(load_sweep("10,,20,868.1,7,14,125000,5,8,1,", "bad.csv", &sweep));
+  // Not a number, and only the frequency may be fractional
+  TEST_ASSERT_FALSE(load_sweep("10,100,20,868.1,seven,14,125000,5,8,1,", "bad.csv", &sweep));
+  TEST_ASSERT_FALSE(load_sweep("10,100.5,20,868.1,7,14,125000,5,8,1,", "bad.csv", &sweep));
+  // Outside the field's limits, or not a legal bandwidth
+  TEST_ASSERT_FALSE(load_sweep("10,100,20,868.1,13,14,125000,5,8,1,", "bad.csv", &sweep));
+  TEST_ASSERT_FALSE(load_sweep("10,100,20,868.1,7,14,126000,5,8,1,", "bad.csv", &sweep));
+}
+
+void test_rejects_overlong_token(void) {
+  testdef_sweep_t sweep;
+  char data[128] = "10,100,20,868.1";
+  // Longer than any token buffer without being cut to something valid
+  for (uint8_t i=0; i < 70; i++) {
+    strcat(data, "0");
+  }
+  strcat(data, ",7,14,125000,5,8,1,");
+  TEST_ASSERT_FALSE(load_sweep(data, "long.csv", &sweep));
+}
+
+void test_sweep_expansion(void) {
+  testdef_sweep_t sweep;
+  lora_testdef_t testdef;
+  TEST_ASSERT_TRUE(load_sweep("10,100,20,868.1,7|9,14,125000:250000:125000,5,8,1,", 
+                              "sweep.csv", &sweep));
+  TEST_ASSERT_EQUAL_UINT16(4, sweep.variant_cnt);
+  // The last field counts fastest
+  const uint8_t sfs[] = {7, 7, 9, 9};
+  const long bws[] = {125000, 250000, 125000, 250000};
+  const char *ids[] = {"sweep_0", "sweep_1", "sweep_2", "sweep_3"};
+  for (uint16_t variant=0; variant < sweep.variant_cnt; variant++) {
+    testdef_get_variant(&sweep, variant, &testdef);
+    TEST_ASSERT_EQUAL_STRING(ids[variant], testdef.id);
+    TEST_ASSERT_EQUAL_UINT8(sfs[variant], testdef.cfg.sf);
+    TEST_ASSERT_EQUAL_INT32(bws[variant], testdef.cfg.bw);
+    TEST_ASSERT_EQUAL_UINT16(100, testdef.packet_cnt);
+    TEST_ASSERT_TRUE(testdef_is_valid(&testdef));
+  }
+}
+
+void test_range_includes_last_value(void) {
+  testdef_sweep_t sweep;
+  lora_testdef_t testdef;
+  TEST_ASSERT_TRUE(load_sweep("10,100,20,868.1:868.5:0.1,7,14,125000,5,8,1,", "freq.csv", &sweep));
+  TEST_ASSERT_EQUAL_UINT16(5, sweep.variant_cnt);
+  testdef_get_variant(&sweep, 4, &testdef);
+  TEST_ASSERT_EQUAL_FLOAT(868.5f, testdef.cfg.freq);
+}
+
+void test_variant_id_fits_long_name(void) {
+  testdef_sweep_t sweep;
+  lora_testdef_t testdef;
+  TEST_ASSERT_TRUE(load_sweep("10,1:1000,20,868.1,7,14,125000,5,8,1,", "averylongname.csv", &sweep));
+  TEST_ASSERT_EQUAL_UINT16(1000, sweep.variant_cnt);
+  // The name is cut short so the largest variant index still fits
+  testdef_get_variant(&sweep, 999, &testdef);
+  TEST_ASSERT_EQUAL_STRING("averylong_999", testdef.id);
+  testdef_get_variant(&sweep, 1, &testdef);
+  TEST_ASSERT_EQUAL_STRING("averylong_1", testdef.id);
+}
+
+void test_sweep_rejects_invalid_values(void) {
+  testdef_sweep_t sweep;
+  // Spreading factor out of range in one listed value
+  TEST_ASSERT_FALSE(load_sweep("10,100,20,868.1,7|13,14,125000,5,8,1,", "bad.csv", &sweep));
+  // Bandwidth range stepping through illegal values
+  TEST_ASSERT_FALSE(load_sweep("10,100,20,868.1,7,14,125000:250000:1000,5,8,1,", "bad.csv", &sweep));
+  // Range that runs backwards
+  TEST_ASSERT_FALSE(load_sweep("10,100,20,868.1,9:7,14,125000,5,8,1,", "bad.csv", &sweep));
+}
+
+void test_sweep_rejects_too_many_variants(void) {
+  testdef_sweep_t sweep;
+  TEST_ASSERT_FALSE(load_sweep("0:255,1:1000,20,868.1,7,14,125000,5,8,1,", "big.csv", &sweep));
+}
+
+void test_is_valid_bounds_duration(void) {
+  lora_testdef_t testdef = {"long", 10, 100, 20, {868.1, 12, 14, 125000, 5, 8, true}, 0, 0};
+  TEST_ASSERT_TRUE(testdef_is_valid(&testdef));
+  // Arrival times would wrap before the last packet with every plan slave sharing the window
+  testdef.packet_cnt = 1000;
+  TEST_ASSERT_TRUE(testdef_duration(testdef_packet_slot(&testdef.cfg, testdef.packet_len), 
+                                    testdef.packet_cnt) < MAX_TESTDEF_DURATION_MS);
+  TEST_ASSERT_FALSE(testdef_is_valid(&testdef));
+  testdef.packet_cnt = 100;
+  testdef.id[0] = '\0';
+  TEST_ASSERT_FALSE(testdef_is_valid(&testdef));
+}
+
+void test_packet_airtime(void) {
+  // Reference values from the Semtech formula, explicit header and 8 preamble symbols
+  lora_cfg_t cfg = {868.1, 7, 14, 125000, 5, 8, true};
+  TEST_ASSERT_EQUAL_UINT32(41, testdef_packet_airtime(&cfg, 12));
+  // A partly filled coding rate block is still sent in full
+  cfg.sf = 12;
+  cfg.cr4_denom = 8;
+  TEST_ASSERT_EQUAL_UINT32(1449, testdef_packet_airtime(&cfg, 12));
+  cfg.cr4_denom = 5;
+  TEST_ASSERT_EQUAL_UINT32(1155, testdef_packet_airtime(&cfg, 12));
+  cfg.sf = 9;
+  cfg.cr4_denom = 7;
+  TEST_ASSERT_EQUAL_UINT32(1717, testdef_packet_airtime(&cfg, 255));
+  cfg.sf = 10;
+  cfg.bw = 250000;
+  cfg.cr4_denom = 6;
+  TEST_ASSERT_EQUAL_UINT32(402, testdef_packet_airtime(&cfg, 64));
+  cfg.sf = 11;
+  cfg.bw = 62500;
+  cfg.cr4_denom = 5;
+  TEST_ASSERT_EQUAL_UINT32(1974, testdef_packet_airtime(&cfg, 32));
+  // Without a CRC
+  cfg = {868.1, 7, 14, 500000, 5, 8, false};
+  TEST_ASSERT_EQUAL_UINT32(12, testdef_packet_airtime(&cfg, 20));
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_single_testdef);
+  RUN_TEST(test_fields_split_over_lines);
+  RUN_TEST(test_rejects_malformed_fields);
+  RUN_TEST(test_rejects_overlong_token);
+  RUN_TEST(test_sweep_expansion);
+  RUN_TEST(test_range_includes_last_value);
+  RUN_TEST(test_variant_id_fits_long_name);
+  RUN_TEST(test_sweep_rejects_invalid_values);
+  RUN_TEST(test_sweep_rejects_too_many_variants);
+  RUN_TEST(test_is_valid_bounds_duration);
+  RUN_TEST(test_packet_airtime);
+  return UNITY_END();
+}
@@ -0,0 +1,190 @@
+/*
+  Compiles testdef files into a binary plan for the master's SD card, using
+  the same validation, expansion of sweeps and ordering as the firmware so
+  problems show up before reaching the field rather than on the device.
+
+  Build: g++ -std=c++11 -Iinclude -o plan_compiler tools/plan_compiler.cpp src/testdef.cpp src/plan.cpp
+  Usage: plan_compiler [-r test radios] [-s slaves] <output plan> <testdef>...
+  Copy the output to the testdef directory as _plan.lpf, it replaces the testdef files there.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "plan.h"
+#include "plan_file.h"
+
+static int read_stdio_file(void *src, char *buf, uint16_t len);
+static bool load_testdefs(const char *path, std::vector<lora_testdef_t> *testdefs);
+static bool check_unique_ids(std::vector<lora_testdef_t> &testdefs);
+static void print_plan(std::vector<lora_testdef_t> &testdefs, std::vector<plan_key_t> &keys,
+                       uint8_t parallel, uint8_t slave_cnt);
+static bool write_plan(const char *path, std::vector<lora_testdef_t> &testdefs,
+                       std::vector<plan_key_t> &keys, uint8_t parallel);
+
+int main(int argc, char *argv[]) {
+  int parallel = 1;
+  int slave_cnt = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "r:s:")) != -1) {
+    switch (opt) {
+      case 'r':
+        parallel = atoi(optarg);
+        break;
+      case 's':
+        slave_cnt = atoi(optarg);
+        break;
+      default:
+        optind = argc;
+        break;
+    }
+  }
+  if (argc - optind < 2 || parallel < 1 || parallel > UINT8_MAX || slave_cnt < 1 || slave_cnt > UINT8_MAX) {
+    fprintf(stderr, "Usage: %s [-r test radios] [-s slaves] <output plan> <testdef>...\n", argv[0]);
+    return 1;
+  }
+  const char *out_path = argv[optind];
+
+  // Keep every testdef as the host has memory to spare, only keys go on the card
+  std::vector<lora_testdef_t> testdefs;
+  bool valid = true;
+  for (int i=optind + 1; i < argc; i++) {
+    valid &= load_testdefs(argv[i], &testdefs);
+  }
+  valid &= check_unique_ids(testdefs);
+  if (testdefs.size() > MAX_PLAN_TESTDEFS) {
+    fprintf(stderr, "Plan has %zu testdefs, the master holds at most %d\n", testdefs.size(),
+            MAX_PLAN_TESTDEFS);
+    valid = false;
+  }
+  if (!valid || testdefs.empty()) {
+    fprintf(stderr, "No plan written\n");
+    return 1;
+  }
+
+  // Keys refer to their testdef by index, ties in the ordering keep input order
+  std::vector<plan_key_t> keys(testdefs.size());
+  for (uint16_t i=0; i < testdefs.size(); i++) {
+    plan_make_key(&testdefs[i], i, 0, &keys[i]);
+  }
+  plan_order_testdefs(&keys[0], keys.size(), parallel);
+  print_plan(testdefs, keys, parallel, slave_cnt);
+  return write_plan(out_path, testdefs, keys, parallel) ? 0 : 1;
+}
+
+static int read_stdio_file(void *src, char *buf, uint16_t len) {
+  return fread(buf, 1, len, (FILE*) src);
+}
+
+static bool load_testdefs(const char *path, std::vector<lora_testdef_t> *testdefs) {
+  FILE *file = fopen(path, "r");
+  printf("* Found: %s", path);
+  if (file == NULL) {
+    printf("[FAILED] (cannot open)\n");
+    return false;
+  }
+  // Ids come from the filename alone, as on the device
+  const char *filename = strrchr(path, '/');
+  filename = filename != NULL ? filename + 1 : path;
+  testdef_sweep_t sweep;
+  bool loaded = testdef_load_sweep(read_stdio_file, file, filename, &sweep);
+  fclose(file);
+  if (loaded && sweep.variant_cnt > 1) {
+    printf(" [%d variants]", sweep.variant_cnt);
+  }
+  printf("%s\n", loaded ? "" : "[FAILED]");
+  // The device drops any variant that breaks the testdef rules, so the plan
+  // printed here would no longer be the one that runs
+  bool valid = loaded;
+  for (uint16_t variant=0; loaded && variant < sweep.variant_cnt; variant++) {
+    lora_testdef_t testdef = {};
+    testdef_get_variant(&sweep, variant, &testdef);
+    if (!testdef_is_valid(&testdef)) {
+      printf("[FAILED] %s\n", testdef.id);
+      valid = false;
+      continue;
+    }
+    testdefs->push_back(testdef);
+  }
+  return valid;
+}
+
+static bool check_unique_ids(std::vector<lora_testdef_t> &testdefs) {
+  // Results and the journal are keyed on the id, so a repeat would overwrite another testdef
+  bool unique = true;
+  for (size_t i=0; i < testdefs.size(); i++) {
+    for (size_t j=i + 1; j < testdefs.size(); j++) {
+      if (strncmp(testdefs[i].id, testdefs[j].id, TESTDEF_ID_LEN) == 0) {
+        fprintf(stderr, "Testdef id '%s' is used more than once\n", testdefs[i].id);
+        unique = false;
+        break;
+      }
+    }
+  }
+  return unique;
+}
+
+static void print_plan(std::vector<lora_testdef_t> &testdefs, std::vector<plan_key_t> &keys,
+                       uint8_t parallel, uint8_t slave_cnt) {
+  printf("\nPlan for %d test radio(s) and %d slave(s):\n", parallel, slave_cnt);
+  uint64_t total = 0;
+  uint16_t next = 0;
+  uint16_t block = 0;
+  while (next < keys.size()) {
+    uint16_t block_end = plan_block_end(&keys[0], keys.size(), next);
+    uint32_t block_duration = plan_block_duration(&keys[0], next, block_end, parallel, slave_cnt);
+    printf("Block %d, range %d, %.1fs\n", block, keys[next].exp_range, block_duration / 1000.0);
+    uint16_t first = next;
+    while (first < block_end) {
+      uint16_t batch_end = plan_batch_end(&keys[0], block_end, first, parallel);
+      for (uint16_t i=first; i < batch_end; i++) {
+        lora_testdef_t *testdef = &testdefs[keys[i].dir_index];
+        uint32_t duration = testdef_duration(keys[i].slot_time, keys[i].packet_cnt, slave_cnt);
+        printf("  %c %-*s %4d x %3dB  %8.3f MHz  SF%-2d  %6ld Hz  4/%d  %3d dBm  %7.1fs\n",
+               i == first ? '*' : '+', TESTDEF_ID_LEN, testdef->id, testdef->packet_cnt,
+               testdef->packet_len, testdef->cfg.freq, testdef->cfg.sf, testdef->cfg.bw,
+               testdef->cfg.cr4_denom, testdef->cfg.tx_dbm, duration / 1000.0);
+      }
+      first = batch_end;
+    }
+    total += block_duration;
+    next = block_end;
+    block++;
+  }
+  // Control traffic depends on the control configuration the master negotiates,
+  // the master predicts the full duration once the plan is delivered
+  uint32_t secs = total / 1000;
+  printf("\n%zu testdefs in %d blocks, testing time %02uh %02um %02us (excluding control traffic)\n",
+         keys.size(), block, secs / 3600, (secs / 60) % 60, secs % 60);
+}
+
+static bool write_plan(const char *path, std::vector<lora_testdef_t> &testdefs,
+                       std::vector<plan_key_t> &keys, uint8_t parallel) {
+  FILE *out = fopen(path, "wb");
+  if (out == NULL) {
+    fprintf(stderr, "Failed to create '%s'\n", path);
+    return false;
+  }
+  plan_file_header_t header = {};
+  header.magic = PLAN_FILE_MAGIC;
+  header.version = PLAN_FILE_VERSION;
+  header.testdef_cnt = keys.size();
+  header.parallel = parallel;
+  bool written = fwrite(&header, sizeof(header), 1, out) == 1;
+  // Records go in plan order so the device can use them as they are
+  for (size_t i=0; written && i < keys.size(); i++) {
+    plan_file_testdef_t rec;
+    plan_file_pack_testdef(&testdefs[keys[i].dir_index], &rec);
+    written = fwrite(&rec, sizeof(rec), 1, out) == 1;
+  }
+  written &= fclose(out) == 0;
+  if (!written) {
+    fprintf(stderr, "Failed to write '%s'\n", path);
+    return false;
+  }
+  printf("Wrote %zu testdefs to '%s'\n", keys.size(), path);
+  return true;
+}
@@ -0,0 +1,163 @@
+/*
+  Expands a binary run container into the CSV per testdef layout written
+  when the run container is disabled.
+
+  Build: g++ -std=c++11 -Iinclude -o run_container_to_csv tools/run_container_to_csv.cpp
+  Usage: run_container_to_csv <_results.lrc> [output directory]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <vector>
+
+#include "run_container.h"
+
+#define MAX_PATH_LEN (512)
+
+static const char *RECV_PACKETS_HEADER = "id,rssi,snr,failed_recv,time_left,arrival_us";
+
+typedef struct output_stream_t {
+  FILE *file;
+  char path[MAX_PATH_LEN];
+  run_container_stream_t last;
+} output_stream_t;
+
+static bool open_stream(output_stream_t streams[], uint8_t idx, const char *out_dir,
+                        const uint8_t *buf, size_t len, size_t *used);
+static void close_streams(output_stream_t streams[]);
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <run container> [output directory]\n", argv[0]);
+    return 1;
+  }
+  const char *out_dir = argc > 2 ? argv[2] : ".";
+  FILE *in = fopen(argv[1], "rb");
+  if (in == NULL) {
+    fprintf(stderr, "Failed to open '%s'\n", argv[1]);
+    return 1;
+  }
+  std::vector<uint8_t> data;
+  uint8_t chunk[4096];
+  size_t chunk_len;
+  while ((chunk_len = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+    data.insert(data.end(), chunk, chunk + chunk_len);
+  }
+  fclose(in);
+
+  run_container_header_t header;
+  if (data.size() < sizeof(header)) {
+    fprintf(stderr, "Too short to be a run container\n");
+    return 1;
+  }
+  memcpy(&header, &data[0], sizeof(header));
+  if (header.magic != RUN_CONTAINER_MAGIC || header.version != RUN_CONTAINER_VERSION) {
+    fprintf(stderr, "Not a supported run container\n");
+    return 1;
+  }
+  printf("Run started [%04d-%02d-%02d] %02d:%02d:%02d, %d testdef(s)\n", header.year, header.month,
+         header.day, header.hour, header.minute, header.second, header.testdef_cnt);
+  for (uint16_t i=0; i < header.testdef_cnt; i++) {
+    run_container_testdef_t testdef;
+    size_t offset = header.table_offset + i * sizeof(testdef);
+    if (offset + sizeof(testdef) > data.size()) {
+      fprintf(stderr, "Testdef table is truncated\n");
+      return 1;
+    }
+    memcpy(&testdef, &data[offset], sizeof(testdef));
+    printf("  %-*.*s range %3d, %4d packets of %3d bytes, %.3f MHz, SF%d, %ld Hz, 4/%d\n",
+           RUN_CONTAINER_ID_LEN, RUN_CONTAINER_ID_LEN, testdef.id, testdef.exp_range,
+           testdef.packet_cnt, testdef.packet_len, testdef.freq, testdef.sf, (long) testdef.bw,
+           testdef.cr4_denom);
+  }
+
+  // Anything after the recorded length is from an interrupted run
+  size_t end = header.data_offset + header.data_len;
+  if (end > data.size()) {
+    fprintf(stderr, "Run container is missing %zu byte(s) of results\n", end - data.size());
+    end = data.size();
+  }
+  output_stream_t streams[RUN_CONTAINER_MAX_STREAMS] = {};
+  uint32_t results = 0;
+  size_t pos = header.data_offset;
+  while (pos < end) {
+    uint8_t tag = data[pos++];
+    output_stream_t *stream = &streams[RC_TAG_STREAM(tag)];
+    size_t used = 0;
+    bool valid = false;
+    switch (RC_TAG_TYPE(tag)) {
+      case rc_tag_end:
+        pos = end;
+        valid = true;
+        break;
+      case rc_tag_begin:
+        valid = open_stream(streams, RC_TAG_STREAM(tag), out_dir, &data[pos], end - pos, &used);
+        break;
+      case rc_tag_result:
+        used = rc_decode_result(&stream->last, &data[pos], end - pos);
+        valid = used > 0 && stream->file != NULL;
+        if (valid) {
+          fprintf(stream->file, "\n%d,%d,%d,%" PRIu32 ",%" PRId32 ",%" PRIu32, stream->last.id,
+                  stream->last.rssi, stream->last.snr, stream->last.failed_recv,
+                  stream->last.time_left, stream->last.arrival);
+          results++;
+        }
+        break;
+    }
+    if (!valid) {
+      fprintf(stderr, "Invalid record at offset %zu\n", pos - 1);
+      close_streams(streams);
+      return 1;
+    }
+    pos += used;
+  }
+  close_streams(streams);
+  printf("Expanded %" PRIu32 " result(s)\n", results);
+  return 0;
+}
+
+static bool open_stream(output_stream_t streams[], uint8_t idx, const char *out_dir,
+                        const uint8_t *buf, size_t len, size_t *used) {
+  if (len < 2 || buf[1] > RUN_CONTAINER_ID_LEN || len < (size_t) 2 + buf[1]) {
+    return false;
+  }
+  uint8_t slave_id = buf[0];
+  char id[RUN_CONTAINER_ID_LEN + 1] = {};
+  memcpy(id, &buf[2], buf[1]);
+  *used = 2 + buf[1];
+
+  char path[MAX_PATH_LEN];
+  if (slave_id != 0) {
+    snprintf(path, sizeof(path), "%s/%s_%02X.csv", out_dir, id, slave_id);
+  } else {
+    snprintf(path, sizeof(path), "%s/%s.csv", out_dir, id);
+  }
+  // A testdef rerun after a resume replaces its earlier results, which may
+  // have been left open in another stream by the interruption
+  for (uint8_t i=0; i < RUN_CONTAINER_MAX_STREAMS; i++) {
+    if (streams[i].file != NULL && (i == idx || strcmp(streams[i].path, path) == 0)) {
+      fclose(streams[i].file);
+      streams[i].file = NULL;
+    }
+  }
+  output_stream_t *stream = &streams[idx];
+  strcpy(stream->path, path);
+  stream->file = fopen(path, "w");
+  if (stream->file == NULL) {
+    fprintf(stderr, "Failed to create '%s'\n", path);
+    return false;
+  }
+  fputs(RECV_PACKETS_HEADER, stream->file);
+  rc_reset_stream(&stream->last);
+  return true;
+}
+
+static void close_streams(output_stream_t streams[]) {
+  for (uint8_t i=0; i < RUN_CONTAINER_MAX_STREAMS; i++) {
+    if (streams[i].file != NULL) {
+      fclose(streams[i].file);
+      streams[i].file = NULL;
+    }
+  }
+}
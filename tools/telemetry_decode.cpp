@@ -0,0 +1,215 @@
+/*
+  Turns the binary telemetry of firmware built with TELEMETRY_BINARY back
+  into the text it would have printed, see include/telemetry.h for frames.
+
+  Build: g++ -std=c++11 -Iinclude -o telemetry_decode tools/telemetry_decode.cpp
+  Usage: telemetry_decode [-l level] [capture]
+  Reads the capture or stdin, e.g. telemetry_decode < /dev/ttyACM0, and
+  only prints messages at or below the level given (all by default).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <map>
+#include <string>
+
+#include "telemetry.h"
+
+static bool read_frame(FILE *in, uint8_t *type, uint8_t *payload, uint8_t *len);
+static void print_message(std::map<uint32_t, std::string> &formats, const uint8_t *payload,
+                          uint8_t len, uint8_t max_level);
+static bool take_varint(const uint8_t *payload, uint8_t len, uint8_t *pos, uint32_t *val);
+
+int main(int argc, char *argv[]) {
+  int max_level = LOG_LEVEL_DEBUG;
+  bool usage = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "l:")) != -1) {
+    switch (opt) {
+      case 'l':
+        max_level = atoi(optarg);
+        break;
+      default:
+        usage = true;
+        break;
+    }
+  }
+  if (usage || argc - optind > 1) {
+    fprintf(stderr, "Usage: %s [-l level] [capture]\n", argv[0]);
+    return 1;
+  }
+  FILE *in = argc > optind ? fopen(argv[optind], "rb") : stdin;
+  if (in == NULL) {
+    fprintf(stderr, "Failed to open '%s'\n", argv[optind]);
+    return 1;
+  }
+
+  // Formats are keyed on their address in the firmware
+  std::map<uint32_t, std::string> formats;
+  uint8_t type;
+  uint8_t payload[TELEMETRY_MAX_PAYLOAD];
+  uint8_t len;
+  while (read_frame(in, &type, payload, &len)) {
+    switch (type) {
+      case tlm_format:
+        if (len >= sizeof(uint32_t)) {
+          uint32_t id;
+          memcpy(&id, payload, sizeof(id));
+          formats[id] = std::string((const char*) &payload[sizeof(id)], len - sizeof(id));
+        }
+        break;
+      case tlm_message:
+        print_message(formats, payload, len, max_level);
+        break;
+      case tlm_text:
+        fwrite(payload, 1, len, stdout);
+        break;
+      case tlm_dropped: {
+        uint8_t pos = 0;
+        uint32_t dropped;
+        if (take_varint(payload, len, &pos, &dropped)) {
+          printf("[%u message(s) dropped]\n", dropped);
+        }
+        break;
+      }
+      default:
+        break;
+    }
+    fflush(stdout);
+  }
+  if (in != stdin) {
+    fclose(in);
+  }
+  return 0;
+}
+
+static bool read_frame(FILE *in, uint8_t *type, uint8_t *payload, uint8_t *len) {
+  // A frame cut short by the device leaves a bad check, so resync on the
+  // next sync byte after the one that started it. Bytes read past a bad
+  // frame may hold the next ones, so the window is kept between calls
+  static std::string window;
+  while (true) {
+    size_t sync = window.find((char) TELEMETRY_SYNC);
+    window.erase(0, sync == std::string::npos ? window.size() : sync);
+    uint8_t frame_len = window.size() >= 2 ? (uint8_t) window[1] : 0;
+    if (window.size() < 3 || window.size() < (size_t) frame_len + 4) {
+      int c = fgetc(in);
+      if (c == EOF) {
+        return false;
+      }
+      window.push_back((char) c);
+      continue;
+    }
+    uint8_t check = 0;
+    for (size_t i=1; i < (size_t) frame_len + 3; i++) {
+      check ^= (uint8_t) window[i];
+    }
+    if (check != (uint8_t) window[frame_len + 3]) {
+      window.erase(0, 1);
+      continue;
+    }
+    *len = frame_len;
+    *type = window[2];
+    memcpy(payload, window.data() + 3, frame_len);
+    window.erase(0, frame_len + 4);
+    return true;
+  }
+}
+
+static void print_message(std::map<uint32_t, std::string> &formats, const uint8_t *payload,
+                          uint8_t len, uint8_t max_level) {
+  if (len < 1 + sizeof(uint32_t) || (payload[0] & ~TELEMETRY_TRUNCATED) > max_level) {
+    return;
+  }
+  bool truncated = payload[0] & TELEMETRY_TRUNCATED;
+  uint32_t id;
+  memcpy(&id, &payload[1], sizeof(id));
+  std::map<uint32_t, std::string>::iterator format = formats.find(id);
+  if (format == formats.end()) {
+    // Started listening after the format was sent
+    printf("[message with unknown format 0x%08X]\n", id);
+    return;
+  }
+
+  // Each conversion is rebuilt on its own and fed the argument it consumes
+  const std::string &fmt = format->second;
+  uint8_t pos = 1 + sizeof(id);
+  std::string out;
+  char buf[TELEMETRY_MAX_LINE_LEN];
+  size_t i = 0;
+  while (i < fmt.size()) {
+    if (fmt[i] != '%') {
+      out.push_back(fmt[i++]);
+      continue;
+    }
+    size_t start = i++;
+    while (i < fmt.size() && strchr("-+ #0123456789.hlzjt", fmt[i]) != NULL) {
+      i++;
+    }
+    if (i == fmt.size()) {
+      break;
+    }
+    char conv = fmt[i++];
+    std::string spec = fmt.substr(start, i - start);
+    // Length modifiers only described the device's types
+    std::string clean;
+    for (size_t j=0; j < spec.size(); j++) {
+      if (strchr("hlzjt", spec[j]) == NULL) {
+        clean.push_back(spec[j]);
+      }
+    }
+    bool ok = true;
+    if (conv == '%') {
+      out.push_back('%');
+      continue;
+    } else if (conv == 's') {
+      const uint8_t *str = &payload[pos];
+      size_t str_len = strnlen((const char*) str, len - pos);
+      ok = pos + str_len < len;
+      if (ok) {
+        snprintf(buf, sizeof(buf), clean.c_str(), (const char*) str);
+        pos += str_len + 1;
+      }
+    } else if (strchr("fFeEgGaA", conv) != NULL) {
+      float val;
+      ok = pos + sizeof(val) <= len;
+      if (ok) {
+        memcpy(&val, &payload[pos], sizeof(val));
+        snprintf(buf, sizeof(buf), clean.c_str(), (double) val);
+        pos += sizeof(val);
+      }
+    } else {
+      uint32_t zigzag;
+      ok = take_varint(payload, len, &pos, &zigzag);
+      if (ok) {
+        int32_t val = (int32_t) (zigzag >> 1) ^ -(int32_t) (zigzag & 1);
+        if (strchr("uxXoc", conv) != NULL) {
+          snprintf(buf, sizeof(buf), clean.c_str(), (uint32_t) val);
+        } else {
+          snprintf(buf, sizeof(buf), clean.c_str(), val);
+        }
+      }
+    }
+    if (!ok && truncated) {
+      // The rest of the arguments were left out by the device
+      out += "<truncated>\n";
+      break;
+    }
+    out += ok ? buf : "<?>";
+  }
+  fputs(out.c_str(), stdout);
+}
+
+static bool take_varint(const uint8_t *payload, uint8_t len, uint8_t *pos, uint32_t *val) {
+  *val = 0;
+  for (uint8_t shift=0; *pos < len && shift < 35; shift += 7) {
+    uint8_t b = payload[(*pos)++];
+    *val |= (uint32_t) (b & 0x7F) << shift;
+    if ((b & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}